@@ -0,0 +1,504 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Buffer comparison kernels used by the erase/write engine on whole-chip images. Each operation has a portable
+ * word-at-a-time implementation and, where the compiler allows it, SSE2/AVX2 (x86, selected at runtime) or
+ * NEON (aarch64) variants. All "first" functions return @len if there is no match.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "flash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__DJGPP__) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define BUFCMP_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define BUFCMP_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct bufcmp_kernels {
+	const char *name;
+	size_t (*first_diff)(const uint8_t *a, const uint8_t *b, size_t len);
+	size_t (*first_not_ff)(const uint8_t *buf, size_t len);
+	size_t (*first_unprogrammable)(const uint8_t *have, const uint8_t *want, size_t len);
+	size_t (*count_diff)(const uint8_t *a, const uint8_t *b, size_t len);
+	size_t (*count_not_ff)(const uint8_t *buf, size_t len);
+};
+
+/* Portable implementation. It works on unsigned long words and only looks at single bytes near a hit. */
+
+typedef unsigned long word_t;
+#define ONES_WORD	((word_t)-1)
+
+static word_t load_word(const uint8_t *p)
+{
+	word_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/* Number of non-zero bytes in @w. */
+static size_t nonzero_bytes(word_t w)
+{
+	size_t i, n = 0;
+
+	for (i = 0; w && i < sizeof(w); i++, w >>= 8)
+		if (w & 0xff)
+			n++;
+	return n;
+}
+
+static size_t first_diff_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(word_t) <= len; i += sizeof(word_t))
+		if (load_word(a + i) != load_word(b + i))
+			break;
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+static size_t first_not_ff_scalar(const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(word_t) <= len; i += sizeof(word_t))
+		if (load_word(buf + i) != ONES_WORD)
+			break;
+	for (; i < len; i++)
+		if (buf[i] != 0xff)
+			break;
+	return i;
+}
+
+static size_t first_unprogrammable_scalar(const uint8_t *have, const uint8_t *want, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(word_t) <= len; i += sizeof(word_t)) {
+		const word_t w = load_word(want + i);
+		if ((load_word(have + i) & w) != w)
+			break;
+	}
+	for (; i < len; i++)
+		if ((have[i] & want[i]) != want[i])
+			break;
+	return i;
+}
+
+static size_t count_diff_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0, n = 0;
+
+	for (; i + sizeof(word_t) <= len; i += sizeof(word_t))
+		n += nonzero_bytes(load_word(a + i) ^ load_word(b + i));
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			n++;
+	return n;
+}
+
+static size_t count_not_ff_scalar(const uint8_t *buf, size_t len)
+{
+	size_t i = 0, n = 0;
+
+	for (; i + sizeof(word_t) <= len; i += sizeof(word_t))
+		n += nonzero_bytes(~load_word(buf + i));
+	for (; i < len; i++)
+		if (buf[i] != 0xff)
+			n++;
+	return n;
+}
+
+static const struct bufcmp_kernels kernels_scalar = {
+	.name			= "scalar",
+	.first_diff		= first_diff_scalar,
+	.first_not_ff		= first_not_ff_scalar,
+	.first_unprogrammable	= first_unprogrammable_scalar,
+	.count_diff		= count_diff_scalar,
+	.count_not_ff		= count_not_ff_scalar,
+};
+
+#if BUFCMP_X86
+/*
+ * The x86 kernels compare vectors with PCMPEQB and look at the resulting byte mask. They are compiled for
+ * their instruction set with target attributes so that the rest of flashrom keeps the baseline ISA.
+ */
+#define SSE2_FN	__attribute__((target("sse2")))
+#define AVX2_FN	__attribute__((target("avx2")))
+
+SSE2_FN static unsigned int eq_mask_sse2(const uint8_t *a, const uint8_t *b)
+{
+	const __m128i va = _mm_loadu_si128((const __m128i *)a);
+	const __m128i vb = _mm_loadu_si128((const __m128i *)b);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+}
+
+SSE2_FN static unsigned int ff_mask_sse2(const uint8_t *buf)
+{
+	const __m128i v = _mm_loadu_si128((const __m128i *)buf);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(-1)));
+}
+
+SSE2_FN static unsigned int prog_mask_sse2(const uint8_t *have, const uint8_t *want)
+{
+	const __m128i vh = _mm_loadu_si128((const __m128i *)have);
+	const __m128i vw = _mm_loadu_si128((const __m128i *)want);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(vh, vw), vw));
+}
+
+SSE2_FN static size_t first_diff_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const unsigned int m = eq_mask_sse2(a + i, b + i);
+		if (m != 0xffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+SSE2_FN static size_t first_not_ff_sse2(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const unsigned int m = ff_mask_sse2(buf + i);
+		if (m != 0xffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_not_ff_scalar(buf + i, len - i);
+}
+
+SSE2_FN static size_t first_unprogrammable_sse2(const uint8_t *have, const uint8_t *want, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const unsigned int m = prog_mask_sse2(have + i, want + i);
+		if (m != 0xffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_unprogrammable_scalar(have + i, want + i, len - i);
+}
+
+SSE2_FN static size_t count_diff_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		n += 16 - __builtin_popcount(eq_mask_sse2(a + i, b + i));
+	return n + count_diff_scalar(a + i, b + i, len - i);
+}
+
+SSE2_FN static size_t count_not_ff_sse2(const uint8_t *buf, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		n += 16 - __builtin_popcount(ff_mask_sse2(buf + i));
+	return n + count_not_ff_scalar(buf + i, len - i);
+}
+
+static const struct bufcmp_kernels kernels_sse2 = {
+	.name			= "sse2",
+	.first_diff		= first_diff_sse2,
+	.first_not_ff		= first_not_ff_sse2,
+	.first_unprogrammable	= first_unprogrammable_sse2,
+	.count_diff		= count_diff_sse2,
+	.count_not_ff		= count_not_ff_sse2,
+};
+
+AVX2_FN static uint32_t eq_mask_avx2(const uint8_t *a, const uint8_t *b)
+{
+	const __m256i va = _mm256_loadu_si256((const __m256i *)a);
+	const __m256i vb = _mm256_loadu_si256((const __m256i *)b);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+AVX2_FN static uint32_t ff_mask_avx2(const uint8_t *buf)
+{
+	const __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(-1)));
+}
+
+AVX2_FN static uint32_t prog_mask_avx2(const uint8_t *have, const uint8_t *want)
+{
+	const __m256i vh = _mm256_loadu_si256((const __m256i *)have);
+	const __m256i vw = _mm256_loadu_si256((const __m256i *)want);
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(vh, vw), vw));
+}
+
+AVX2_FN static size_t first_diff_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		const uint32_t m = eq_mask_avx2(a + i, b + i);
+		if (m != 0xffffffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+AVX2_FN static size_t first_not_ff_avx2(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		const uint32_t m = ff_mask_avx2(buf + i);
+		if (m != 0xffffffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_not_ff_scalar(buf + i, len - i);
+}
+
+AVX2_FN static size_t first_unprogrammable_avx2(const uint8_t *have, const uint8_t *want, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		const uint32_t m = prog_mask_avx2(have + i, want + i);
+		if (m != 0xffffffff)
+			return i + __builtin_ctz(~m);
+	}
+	return i + first_unprogrammable_scalar(have + i, want + i, len - i);
+}
+
+AVX2_FN static size_t count_diff_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		n += 32 - __builtin_popcount(eq_mask_avx2(a + i, b + i));
+	return n + count_diff_scalar(a + i, b + i, len - i);
+}
+
+AVX2_FN static size_t count_not_ff_avx2(const uint8_t *buf, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		n += 32 - __builtin_popcount(ff_mask_avx2(buf + i));
+	return n + count_not_ff_scalar(buf + i, len - i);
+}
+
+static const struct bufcmp_kernels kernels_avx2 = {
+	.name			= "avx2",
+	.first_diff		= first_diff_avx2,
+	.first_not_ff		= first_not_ff_avx2,
+	.first_unprogrammable	= first_unprogrammable_avx2,
+	.count_diff		= count_diff_avx2,
+	.count_not_ff		= count_not_ff_avx2,
+};
+#endif /* BUFCMP_X86 */
+
+#if BUFCMP_NEON
+/* The NEON kernels test 16 byte blocks with a horizontal minimum and locate hits with the scalar code. */
+
+static size_t first_diff_neon(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xff)
+			break;
+	return i + first_diff_scalar(a + i, b + i, len - i);
+}
+
+static size_t first_not_ff_neon(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		if (vminvq_u8(vld1q_u8(buf + i)) != 0xff)
+			break;
+	return i + first_not_ff_scalar(buf + i, len - i);
+}
+
+static size_t first_unprogrammable_neon(const uint8_t *have, const uint8_t *want, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const uint8x16_t w = vld1q_u8(want + i);
+		if (vminvq_u8(vceqq_u8(vandq_u8(vld1q_u8(have + i), w), w)) != 0xff)
+			break;
+	}
+	return i + first_unprogrammable_scalar(have + i, want + i, len - i);
+}
+
+/* The counting kernels add 1 per mismatching lane to byte counters which are summed every 255 blocks. */
+static size_t count_diff_neon(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0, n = 0;
+
+	while (i + 16 <= len) {
+		uint8x16_t acc = vdupq_n_u8(0);
+		unsigned int k;
+
+		for (k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+			acc = vsubq_u8(acc, vmvnq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+		n += vaddlvq_u8(acc);
+	}
+	return n + count_diff_scalar(a + i, b + i, len - i);
+}
+
+static size_t count_not_ff_neon(const uint8_t *buf, size_t len)
+{
+	const uint8x16_t ones = vdupq_n_u8(0xff);
+	size_t i = 0, n = 0;
+
+	while (i + 16 <= len) {
+		uint8x16_t acc = vdupq_n_u8(0);
+		unsigned int k;
+
+		for (k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+			acc = vsubq_u8(acc, vmvnq_u8(vceqq_u8(vld1q_u8(buf + i), ones)));
+		n += vaddlvq_u8(acc);
+	}
+	return n + count_not_ff_scalar(buf + i, len - i);
+}
+
+static const struct bufcmp_kernels kernels_neon = {
+	.name			= "neon",
+	.first_diff		= first_diff_neon,
+	.first_not_ff		= first_not_ff_neon,
+	.first_unprogrammable	= first_unprogrammable_neon,
+	.count_diff		= count_diff_neon,
+	.count_not_ff		= count_not_ff_neon,
+};
+#endif /* BUFCMP_NEON */
+
+/* All implementations usable on this build, best last. */
+static const struct bufcmp_kernels *const all_kernels[] = {
+	&kernels_scalar,
+#if BUFCMP_X86
+	&kernels_sse2,
+	&kernels_avx2,
+#endif
+#if BUFCMP_NEON
+	&kernels_neon,
+#endif
+};
+
+static const struct bufcmp_kernels *kernels;
+
+static int kernels_supported(const struct bufcmp_kernels *k)
+{
+#if BUFCMP_X86
+	if (k == &kernels_sse2)
+		return __builtin_cpu_supports("sse2");
+	if (k == &kernels_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+static const struct bufcmp_kernels *get_kernels(void)
+{
+	int i;
+
+	if (kernels)
+		return kernels;
+#if BUFCMP_X86
+	__builtin_cpu_init();
+#endif
+	for (i = ARRAY_SIZE(all_kernels) - 1; i >= 0; i--) {
+		if (kernels_supported(all_kernels[i])) {
+			kernels = all_kernels[i];
+			break;
+		}
+	}
+	return kernels;
+}
+
+/* Returns the name of the selected implementation. */
+const char *bufcmp_impl(void)
+{
+	return get_kernels()->name;
+}
+
+/* Returns the name of the @i-th implementation available on this machine or NULL if there is none. */
+const char *bufcmp_impl_name(unsigned int i)
+{
+	unsigned int j;
+
+	get_kernels();
+	for (j = 0; j < ARRAY_SIZE(all_kernels); j++) {
+		if (!kernels_supported(all_kernels[j]))
+			continue;
+		if (!i--)
+			return all_kernels[j]->name;
+	}
+	return NULL;
+}
+
+/* Force the implementation called @name. Returns 0 on success, 1 if it is not available. */
+int bufcmp_select_impl(const char *name)
+{
+	unsigned int i;
+
+	get_kernels();
+	for (i = 0; i < ARRAY_SIZE(all_kernels); i++) {
+		if (!strcmp(all_kernels[i]->name, name) && kernels_supported(all_kernels[i])) {
+			kernels = all_kernels[i];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Offset of the first byte where @a and @b differ. */
+size_t buf_first_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	return get_kernels()->first_diff(a, b, len);
+}
+
+/* Offset of the first byte of @buf which is not in the erased state (0xff). */
+size_t buf_first_not_ff(const uint8_t *buf, size_t len)
+{
+	return get_kernels()->first_not_ff(buf, len);
+}
+
+/* Offset of the first byte of @have which can not be turned into @want by clearing bits. */
+size_t buf_first_unprogrammable(const uint8_t *have, const uint8_t *want, size_t len)
+{
+	return get_kernels()->first_unprogrammable(have, want, len);
+}
+
+/* Number of bytes where @a and @b differ. */
+size_t buf_count_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	return get_kernels()->count_diff(a, b, len);
+}
+
+/* Number of bytes of @buf which are not in the erased state (0xff). */
+size_t buf_count_not_ff(const uint8_t *buf, size_t len)
+{
+	return get_kernels()->count_not_ff(buf, len);
+}
@@ -22,9 +22,14 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <libusb.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
+#include "spi.h"
 
 /* LIBUSB_CALL ensures the right calling conventions on libusb callbacks.
  * However, the macro is not defined everywhere. m(
@@ -76,11 +81,16 @@
 /* Number of parallel IN transfers. 32 seems to produce the most stable throughput on Windows. */
 #define USB_IN_TRANSFERS 32
 
+/* Number of SPI stream packets sent per OUT transfer while streaming a read. */
+#define STREAM_OUT_PACKETS 64
+
 /* We need to use many queued IN transfers for any resemblance of performance (especially on Windows)
  * because USB spec says that transfers end on non-full packets and the device sends the 31 reply
  * data bytes to each 32-byte packet with command + 31 bytes of data... */
 static struct libusb_transfer *transfer_out = NULL;
 static struct libusb_transfer *transfer_ins[USB_IN_TRANSFERS] = {0};
+/* Buffers of the IN transfers while streaming a read. */
+static uint8_t stream_ins[USB_IN_TRANSFERS][CH341_PACKET_LENGTH - 1];
 
 /* Accumulate delays to be plucked between CS deassertion and CS assertions. */
 static unsigned int stored_delay_us = 0;
@@ -135,6 +145,35 @@ static void LIBUSB_CALL cb_in(struct libusb_transfer *transfer)
 	cb_common(__func__, transfer);
 }
 
+/* Cancel all active transfers and wait for the cancellations to complete. */
+static void cancel_transfers(int *state_out, int *state_in)
+{
+	unsigned int i;
+
+	if (*state_out == TRANS_ACTIVE) {
+		if (libusb_cancel_transfer(transfer_out) != 0)
+			*state_out = TRANS_ERR;
+	}
+	for (i = 0; i < USB_IN_TRANSFERS; i++) {
+		if (state_in[i] == TRANS_ACTIVE)
+			if (libusb_cancel_transfer(transfer_ins[i]) != 0)
+				state_in[i] = TRANS_ERR;
+	}
+
+	while (1) {
+		bool finished = true;
+		if (*state_out == TRANS_ACTIVE)
+			finished = false;
+		for (i = 0; i < USB_IN_TRANSFERS; i++) {
+			if (state_in[i] == TRANS_ACTIVE)
+				finished = false;
+		}
+		if (finished)
+			break;
+		libusb_handle_events_timeout(NULL, &(struct timeval){1, 0});
+	}
+}
+
 static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned int readcnt, const uint8_t *writearr, uint8_t *readarr)
 {
 	if (handle == NULL)
@@ -154,6 +193,7 @@ static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned in
 			state_out = TRANS_ERR;
 			goto err;
 		}
+		stats_usb_transfer();
 	}
 
 	/* Handle all asynchronous packets as long as we have stuff to write or read. The write(s) simply need
@@ -179,6 +219,7 @@ static int32_t usb_transfer(const char *func, unsigned int writecnt, unsigned in
 					 func, libusb_error_name(ret));
 				goto err;
 			}
+			stats_usb_transfer();
 			in_buf += cur_todo;
 			in_active += cur_todo;
 			state_in[free_idx] = TRANS_ACTIVE;
@@ -225,36 +266,8 @@ err:
 	/* Clean up on errors. */
 	msg_perr("%s: Failed to %s %d bytes\n", func, (state_out == TRANS_ERR) ? "write" : "read",
 		 (state_out == TRANS_ERR) ? writecnt : readcnt);
-	/* First, we must cancel any ongoing requests and wait for them to be canceled. */
-	if ((writecnt > 0) && (state_out == TRANS_ACTIVE)) {
-		if (libusb_cancel_transfer(transfer_out) != 0)
-			state_out = TRANS_ERR;
-	}
-	if (readcnt > 0) {
-		unsigned int i;
-		for (i = 0; i < USB_IN_TRANSFERS; i++) {
-			if (state_in[i] == TRANS_ACTIVE)
-				if (libusb_cancel_transfer(transfer_ins[i]) != 0)
-					state_in[i] = TRANS_ERR;
-		}
-	}
-
-	/* Wait for cancellations to complete. */
-	while (1) {
-		bool finished = true;
-		if ((writecnt > 0) && (state_out == TRANS_ACTIVE))
-			finished = false;
-		if (readcnt > 0) {
-			unsigned int i;
-			for (i = 0; i < USB_IN_TRANSFERS; i++) {
-				if (state_in[i] == TRANS_ACTIVE)
-					finished = false;
-			}
-		}
-		if (finished)
-			break;
-		libusb_handle_events_timeout(NULL, &(struct timeval){1, 0});
-	}
+	/* We must cancel any ongoing requests and wait for them to be canceled. */
+	cancel_transfers(&state_out, state_in);
 	return -1;
 }
 
@@ -397,6 +410,118 @@ static int ch341a_spi_spi_send_command(struct flashctx *flash, unsigned int writ
 	return 0;
 }
 
+/*
+ * Read a range of the flash chip with a single read command. spi_read_chunked() would issue one command per
+ * page and wait for each of them to complete. Here, the SPI stream packets are generated on the fly and sent
+ * in OUT transfers of STREAM_OUT_PACKETS packets while all IN transfers are kept queued, so the USB pipe stays
+ * full until the whole range has been read.
+ */
+static int ch341a_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	uint8_t cmd[JEDEC_READ_CMD_MAXLEN];
+	uint8_t wbuf[STREAM_OUT_PACKETS + 1][CH341_PACKET_LENGTH];
+	enum spi_io_mode io_mode;
+	int state_out = TRANS_IDLE;
+	int state_in[USB_IN_TRANSFERS] = {0};
+	unsigned int in_len[USB_IN_TRANSFERS];
+	unsigned int free_idx = 0; /* The IN transfer we expect to be free next. */
+	unsigned int in_idx = 0; /* The IN transfer we expect to be completed next. */
+	unsigned long out_pos = 0, in_pos = 0, in_queued = 0, total;
+	bool first = true;
+	int cmdlen, ret;
+	unsigned int i;
+
+	if (handle == NULL)
+		return -1;
+
+	cmdlen = spi_prepare_read_cmd(flash, start, cmd, &io_mode);
+	if (cmdlen < 0)
+		return cmdlen;
+	if (io_mode != SPI_IO_SINGLE) {
+		msg_perr("%s: Multi-I/O reads are not supported.\n", __func__);
+		return -1;
+	}
+	/* Number of bytes to be clocked on the SPI bus: the command followed by the data. */
+	total = cmdlen + len;
+
+	transfer_out->buffer = wbuf[0];
+	transfer_out->user_data = &state_out;
+	do {
+		/* Send the next packets as soon as the previous ones have been accepted by the device. */
+		if (state_out == TRANS_IDLE && out_pos < total) {
+			uint8_t *ptr = wbuf[0];
+			unsigned int p;
+
+			if (first) {
+				/* Initialize the CS packet to zero to prevent writing random stack contents. */
+				memset(ptr, 0, CH341_PACKET_LENGTH);
+				pluck_cs(ptr);
+				ptr += CH341_PACKET_LENGTH;
+				first = false;
+			}
+			for (p = 0; p < STREAM_OUT_PACKETS && out_pos < total; p++) {
+				unsigned int now = min(CH341_PACKET_LENGTH - 1, total - out_pos);
+
+				*ptr++ = CH341A_CMD_SPI_STREAM;
+				for (i = 0; i < now; i++, out_pos++)
+					*ptr++ = (out_pos < cmdlen) ? swap_byte(cmd[out_pos]) : 0xFF;
+			}
+			transfer_out->length = ptr - wbuf[0];
+			state_out = TRANS_ACTIVE;
+			ret = libusb_submit_transfer(transfer_out);
+			if (ret) {
+				msg_perr("%s: failed to submit OUT transfer: %s\n", __func__, libusb_error_name(ret));
+				state_out = TRANS_ERR;
+				goto err;
+			}
+			stats_usb_transfer();
+		}
+
+		/* Every stream packet returns as many bytes as it clocked, each in its own IN transfer. */
+		while (in_queued < total && state_in[free_idx] == TRANS_IDLE) {
+			in_len[free_idx] = min(CH341_PACKET_LENGTH - 1, total - in_queued);
+			transfer_ins[free_idx]->length = in_len[free_idx];
+			transfer_ins[free_idx]->buffer = stream_ins[free_idx];
+			transfer_ins[free_idx]->user_data = &state_in[free_idx];
+			ret = libusb_submit_transfer(transfer_ins[free_idx]);
+			if (ret) {
+				state_in[free_idx] = TRANS_ERR;
+				msg_perr("%s: failed to submit IN transfer: %s\n", __func__, libusb_error_name(ret));
+				goto err;
+			}
+			stats_usb_transfer();
+			in_queued += in_len[free_idx];
+			state_in[free_idx] = TRANS_ACTIVE;
+			free_idx = (free_idx + 1) % USB_IN_TRANSFERS; /* Increment (and wrap around). */
+		}
+
+		libusb_handle_events_timeout(NULL, &(struct timeval){1, 0});
+
+		if (state_out == TRANS_ERR)
+			goto err;
+		else if (state_out > 0)
+			state_out = TRANS_IDLE;
+		/* Collect completed transfers in order and skip the bytes clocked during the command. */
+		while (state_in[in_idx] != TRANS_IDLE && state_in[in_idx] != TRANS_ACTIVE) {
+			if (state_in[in_idx] != in_len[in_idx])
+				goto err;
+			for (i = 0; i < in_len[in_idx]; i++, in_pos++) {
+				if (in_pos >= cmdlen)
+					buf[in_pos - cmdlen] = swap_byte(stream_ins[in_idx][i]);
+			}
+			state_in[in_idx] = TRANS_IDLE;
+			in_idx = (in_idx + 1) % USB_IN_TRANSFERS; /* Increment (and wrap around). */
+		}
+	} while (in_pos < total || state_out == TRANS_ACTIVE);
+
+	msg_pspew("%s: streamed %u bytes from 0x%06x.\n", __func__, len, start);
+	return 0;
+err:
+	msg_perr("%s: Failed to read %u bytes from 0x%06x\n", __func__, len, start);
+	cancel_transfers(&state_out, state_in);
+	return -1;
+}
+
 static const struct spi_master spi_master_ch341a_spi = {
 	.type		= SPI_CONTROLLER_CH341A_SPI,
 	/* flashrom's current maximum is 256 B. CH341A was tested on Linux and Windows to accept atleast
@@ -404,9 +529,10 @@ static const struct spi_master spi_master_ch341a_spi = {
 	 * sent to the device and most of their payload streamed via SPI. */
 	.max_data_read	= 4 * 1024,
 	.max_data_write	= 4 * 1024,
+	.features	= SPI_MASTER_4BA,
 	.command	= ch341a_spi_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
+	.read		= ch341a_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
 };
@@ -431,16 +557,136 @@ static int ch341a_spi_shutdown(void *data)
 	return 0;
 }
 
+/*
+ * Open the @num-th device (counting from 0) matching @vid and @pid, and also @bus and @addr unless @bus is
+ * negative, and the serial number @serial unless it is NULL. Devices which do not report a serial number never
+ * match a @serial.
+ */
+static struct libusb_device_handle *ch341a_open_device(uint16_t vid, uint16_t pid, unsigned int num,
+						       int bus, int addr, const char *serial)
+{
+	struct libusb_device **list;
+	ssize_t count = libusb_get_device_list(NULL, &list);
+	if (count < 0) {
+		msg_perr("Getting the USB device list failed (%s)!\n", libusb_error_name(count));
+		return NULL;
+	}
+
+	struct libusb_device_handle *dev_handle = NULL;
+	ssize_t i;
+	for (i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+		unsigned char devserial[256];
+		int err;
+
+		if (libusb_get_device_descriptor(list[i], &desc) != 0)
+			continue;
+		if (desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		msg_pdbg("Found USB device %04x:%04x at address %d:%d.\n", vid, pid,
+			 libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+		if (bus >= 0 && (libusb_get_bus_number(list[i]) != bus || libusb_get_device_address(list[i]) != addr))
+			continue;
+		if (serial) {
+			if (!desc.iSerialNumber) {
+				msg_pdbg("The device reports no serial number.\n");
+				continue;
+			}
+			/* Reading the serial number needs the device to be opened. */
+			err = libusb_open(list[i], &dev_handle);
+			if (err != 0) {
+				msg_pdbg("Opening the USB device failed (%s), skipping it.\n", libusb_error_name(err));
+				dev_handle = NULL;
+				continue;
+			}
+			err = libusb_get_string_descriptor_ascii(dev_handle, desc.iSerialNumber, devserial,
+								 sizeof(devserial));
+			if (err < 0 || strcmp((const char *)devserial, serial)) {
+				msg_pdbg("Serial number: %s\n", err < 0 ? libusb_error_name(err) : (char *)devserial);
+				libusb_close(dev_handle);
+				dev_handle = NULL;
+				continue;
+			}
+		}
+		if (num-- > 0) {
+			if (dev_handle)
+				libusb_close(dev_handle);
+			dev_handle = NULL;
+			continue;
+		}
+		if (dev_handle)
+			break;
+		err = libusb_open(list[i], &dev_handle);
+		if (err != 0) {
+			msg_perr("Opening the USB device failed (%s)!\n", libusb_error_name(err));
+			dev_handle = NULL;
+		}
+		break;
+	}
+	libusb_free_device_list(list, 1);
+	return dev_handle;
+}
+
 int ch341a_spi_init(void)
 {
+	unsigned long usedevice = 0, usebus = 0, useaddr = 0;
+	int bus = -1, addr = -1;
+	char *device, *serial;
+
 	if (handle != NULL) {
 		msg_cerr("%s: handle already set! Please report a bug at flashrom@flashrom.org\n", __func__);
 		return -1;
 	}
 
+	device = extract_programmer_param("device");
+	if (device) {
+		char *dev_suffix;
+		errno = 0;
+		usedevice = strtoul(device, &dev_suffix, 10);
+		if (errno != 0 || device == dev_suffix || *dev_suffix != '\0' || usedevice > UINT_MAX) {
+			msg_perr("Error: Invalid value for 'device': \"%s\".\n", device);
+			free(device);
+			return -1;
+		}
+		msg_pinfo("Using device %lu.\n", usedevice);
+		free(device);
+	}
+
+	device = extract_programmer_param("address");
+	if (device) {
+		char *dev_suffix;
+		errno = 0;
+		usebus = strtoul(device, &dev_suffix, 10);
+		if (!errno && dev_suffix != device && *dev_suffix == ':') {
+			char *addr_str = dev_suffix + 1;
+			useaddr = strtoul(addr_str, &dev_suffix, 10);
+			if (dev_suffix == addr_str)
+				errno = EINVAL;
+		} else {
+			errno = EINVAL;
+		}
+		if (errno != 0 || *dev_suffix != '\0' || usebus > 255 || useaddr > 255) {
+			msg_perr("Error: Invalid value for 'address': \"%s\", use <bus>:<address>.\n", device);
+			free(device);
+			return -1;
+		}
+		bus = usebus;
+		addr = useaddr;
+		msg_pinfo("Using the device at address %d:%d.\n", bus, addr);
+		free(device);
+	}
+
+	serial = extract_programmer_param("serial");
+	if (serial && !*serial) {
+		msg_perr("Error: Empty value for 'serial'.\n");
+		free(serial);
+		return -1;
+	}
+
 	int32_t ret = libusb_init(NULL);
 	if (ret < 0) {
 		msg_perr("Couldnt initialize libusb!\n");
+		free(serial);
 		return -1;
 	}
 
@@ -448,11 +694,18 @@ int ch341a_spi_init(void)
 
 	uint16_t vid = devs_ch341a_spi[0].vendor_id;
 	uint16_t pid = devs_ch341a_spi[0].device_id;
-	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	handle = ch341a_open_device(vid, pid, usedevice, bus, addr, serial);
 	if (handle == NULL) {
-		msg_perr("Couldn't open device %04x:%04x.\n", vid, pid);
+		msg_perr("Couldn't open device %04x:%04x (number %lu", vid, pid, usedevice);
+		if (bus >= 0)
+			msg_perr(" at address %d:%d", bus, addr);
+		if (serial)
+			msg_perr(" with serial number %s", serial);
+		msg_perr(").\n");
+		free(serial);
 		return -1;
 	}
+	free(serial);
 
 /* libusb_detach_kernel_driver() and friends basically only work on Linux. We simply try to detach on Linux
  * without a lot of passion here. If that works fine else we will fail on claiming the interface anyway. */
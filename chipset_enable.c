@@ -377,11 +377,16 @@ static int enable_flash_ich_bios_cntl_memmapped(enum ich_chipset ich_generation,
 	return enable_flash_ich_bios_cntl_common(ich_generation, addr, NULL, 0);
 }
 
+/* Size of the range below 4 GB that FWH_DEC_EN1 routes to the boot flash, regardless of the IDSEL settings. */
+uint32_t ich_bios_decode;
+
 static int enable_flash_ich_fwh_decode(struct pci_dev *dev, enum ich_chipset ich_generation)
 {
 	uint8_t fwh_sel1 = 0, fwh_sel2 = 0, fwh_dec_en_lo = 0, fwh_dec_en_hi = 0; /* silence compilers */
 	bool implemented = 0;
 	void *ilb = NULL; /* Only for Baytrail */
+
+	ich_bios_decode = 0xffffffff;
 	switch (ich_generation) {
 	case CHIPSET_ICH:
 		/* FIXME: Unlike later chipsets, ICH and ICH-0 do only support mapping of the top-most 4MB
@@ -546,6 +551,7 @@ idsel_garbage_out:
 			contiguous = 0;
 		}
 	}
+	ich_bios_decode = max_decode_fwh_decode;
 	max_rom_decode.fwh = min(max_decode_fwh_idsel, max_decode_fwh_decode);
 	msg_pdbg("Maximum FWH chip size: 0x%x bytes\n", max_rom_decode.fwh);
 
@@ -26,10 +26,19 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <getopt.h>
 #include "flash.h"
 #include "flashchips.h"
 #include "programmer.h"
+#if !IS_WINDOWS && !defined(__DJGPP__)
+#include <unistd.h>
+#include <sys/wait.h>
+#define HAVE_GANG_MODE 1
+#endif
+
+/* Identical targets attached to up to this many programmers can be handled in one run (gang mode). */
+#define MAX_GANG_TARGETS 8
 
 static void cli_classic_usage(const char *name)
 {
@@ -41,12 +50,16 @@ static void cli_classic_usage(const char *name)
 	       "-z|"
 #endif
 	       "-p <programmername>[:<parameters>] [-c <chipname>]\n"
-	       "[-E|(-r|-w|-v) <file>] [-l <layoutfile> [-i <imagename>]...] [-n] [-f]]\n"
-	       "[-V[V[V]]] [-o <logfile>]\n\n", name);
+	       "[-E|(-r|-w|-v) <file>] [(-l <layoutfile>|--ifd|--fmap) [-i <imagename>]...] [-n|-A] [-f]]\n"
+	       "[-V[V[V]]] [-o <logfile>] [--erase-verify <policy>]\n\n", name);
 
 	printf(" -h | --help                        print this help text\n"
 	       " -R | --version                     print version (release)\n"
-	       " -r | --read <file>                 read flash and save to <file>\n"
+	       " -r | --read <file>                 read flash and save to <file> (\"-\" for stdout)\n"
+	       "      --read-window <size>[K|M]     read in windows of <size> bytes while writing\n"
+	       "                                    the previous one to <file>\n"
+	       "      --stats <file>                write operation counts and timings as JSON\n"
+	       "                                    to <file> (\"-\" for stdout)\n"
 	       " -w | --write <file>                write <file> to flash\n"
 	       " -v | --verify <file>               verify flash against <file>\n"
 	       " -E | --erase                       erase flash memory\n"
@@ -54,7 +67,15 @@ static void cli_classic_usage(const char *name)
 	       " -c | --chip <chipname>             probe only for specified flash chip\n"
 	       " -f | --force                       force specific operations (see man page)\n"
 	       " -n | --noverify                    don't auto-verify\n"
+	       " -A | --verify-all                  verify the whole chip after writing, not only\n"
+	       "                                    the modified parts\n"
+	       "      --erase-verify <policy>       check erased blocks: auto, full, deferred,\n"
+	       "                                    status or sampled (see man page)\n"
 	       " -l | --layout <layoutfile>         read ROM layout from <layoutfile>\n"
+	       "      --ifd                         read ROM layout from the Intel flash descriptor\n"
+	       "                                    and skip regions the host can't access\n"
+	       "      --fmap                        read ROM layout from the FMAP of the image\n"
+	       "                                    or the flash chip\n"
 	       " -i | --image <name>                only flash image <name> from flash layout\n"
 	       " -o | --output <logfile>            log output to <logfile>\n"
 	       " -L | --list-supported              print supported devices\n"
@@ -63,7 +84,8 @@ static void cli_classic_usage(const char *name)
 #endif
 	       " -p | --programmer <name>[:<param>] specify the programmer device. One of\n");
 	list_programmers_linebreak(4, 80, 0);
-	printf(".\n\nYou can specify one of -h, -R, -L, "
+	printf(".\n\nGiving -p multiple times handles the targets of all programmers in parallel.\n"
+	       "You can specify one of -h, -R, -L, "
 #if CONFIG_PRINT_WIKI == 1
 	         "-z, "
 #endif
@@ -77,6 +99,55 @@ static void cli_classic_abort_usage(void)
 	exit(1);
 }
 
+/*
+ * Returns true if the image is read to stdout with "-r -". Everything printed has to go to stderr then, starting
+ * with the banner, so this is checked with a quick scan before the real option parsing.
+ */
+static bool image_to_stdout(int argc, char *argv[], const char *optstring, const struct option *long_options)
+{
+	const struct option *lopt;
+	const char *arg, *next, *c, *eq;
+	size_t namelen;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		next = i + 1 < argc ? argv[i + 1] : "";
+		if (arg[0] != '-' || !strcmp(arg, "-"))
+			continue;
+		if (!strcmp(arg, "--"))
+			break;
+		if (arg[1] == '-') {
+			eq = strchr(arg, '=');
+			namelen = eq ? (size_t)(eq - arg - 2) : strlen(arg + 2);
+			for (lopt = long_options; lopt->name; lopt++) {
+				if (strlen(lopt->name) != namelen || strncmp(lopt->name, arg + 2, namelen))
+					continue;
+				if (lopt->val == 'r')
+					return !strcmp(eq ? eq + 1 : next, "-");
+				/* Skip the argument of the option. */
+				if (lopt->has_arg == required_argument && !eq)
+					i++;
+				break;
+			}
+			continue;
+		}
+		/* Short options can be grouped, the first one with an argument takes the rest of the group. */
+		for (c = arg + 1; *c; c++) {
+			const char *o = strchr(optstring, *c);
+
+			if (!o || o[1] != ':')
+				continue;
+			if (*c == 'r')
+				return !strcmp(c[1] ? c + 1 : next, "-");
+			if (!c[1])
+				i++;
+			break;
+		}
+	}
+	return false;
+}
+
 static int check_filename(char *filename, char *type)
 {
 	if (!filename || (filename[0] == '\0')) {
@@ -84,11 +155,81 @@ static int check_filename(char *filename, char *type)
 		return 1;
 	}
 	/* Not an error, but maybe the user intended to specify a CLI option instead of a file name. */
-	if (filename[0] == '-')
+	if (filename[0] == '-' && filename[1] != '\0')
 		fprintf(stderr, "Warning: Supplied %s file name starts with -\n", type);
 	return 0;
 }
 
+#ifdef HAVE_GANG_MODE
+/* Write end of the pipe a gang mode child closes once it is done with initialization and probing. */
+static int gang_fd = -1;
+
+/* Let the next gang target start. Programmer initialization and probing are serialized because multiple
+ * instances of the same programmer would race on device enumeration otherwise. */
+static void gang_release(void)
+{
+	if (gang_fd < 0)
+		return;
+	close(gang_fd);
+	gang_fd = -1;
+}
+
+/* Fork a child process for each target. In a child, the index of its target is returned. In the parent, all
+ * children are waited for, the per-target results are reported and -1 is returned with the combined result
+ * stored in @ret. */
+static int gang_run(int num_targets, const enum programmer *progs, char *const *pparams, int *ret)
+{
+	pid_t pids[MAX_GANG_TARGETS];
+	const char *results[MAX_GANG_TARGETS];
+	int i, started, status, failed = 0;
+	char c;
+
+	for (started = 0; started < num_targets; started++) {
+		int fds[2];
+
+		if (pipe(fds)) {
+			msg_gerr("Creating a pipe failed: %s\n", strerror(errno));
+			break;
+		}
+		pids[started] = fork();
+		if (pids[started] < 0) {
+			msg_gerr("Starting target %i failed: %s\n", started, strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+		if (pids[started] == 0) {
+			close(fds[0]);
+			gang_fd = fds[1];
+			return started;
+		}
+		close(fds[1]);
+		/* Block until the child has probed its chip or terminated. */
+		while (read(fds[0], &c, 1) < 0 && errno == EINTR)
+			;
+		close(fds[0]);
+	}
+
+	for (i = 0; i < started; i++) {
+		while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR)
+			;
+		results[i] = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? "OK" : "FAILED";
+	}
+	for (; i < num_targets; i++)
+		results[i] = "NOT STARTED";
+
+	msg_ginfo("\nResults:\n");
+	for (i = 0; i < num_targets; i++) {
+		if (strcmp(results[i], "OK"))
+			failed++;
+		msg_ginfo("Target %i (%s%s%s): %s\n", i, programmer_table[progs[i]].name, pparams[i] ? ":" : "",
+			  pparams[i] ? pparams[i] : "", results[i]);
+	}
+	*ret = failed ? 1 : 0;
+	return -1;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	const struct flashchip *chip = NULL;
@@ -102,17 +243,22 @@ int main(int argc, char *argv[])
 	int list_supported_wiki = 0;
 #endif
 	int read_it = 0, write_it = 0, erase_it = 0, verify_it = 0;
-	int dont_verify_it = 0, list_supported = 0, operation_specified = 0;
+	int dont_verify_it = 0, verify_all = 0, list_supported = 0, operation_specified = 0;
+	int ifd_layout = 0, fmap_layout = 0;
 	enum programmer prog = PROGRAMMER_INVALID;
+	enum programmer progs[MAX_GANG_TARGETS];
+	char *pparams[MAX_GANG_TARGETS] = {NULL};
+	int num_targets = 0;
 	int ret = 0;
 
-	static const char optstring[] = "r:Rw:v:nVEfc:l:i:p:Lzho:";
+	static const char optstring[] = "r:Rw:v:nAVEfc:l:i:p:Lzho:";
 	static const struct option long_options[] = {
 		{"read",		1, NULL, 'r'},
 		{"write",		1, NULL, 'w'},
 		{"erase",		0, NULL, 'E'},
 		{"verify",		1, NULL, 'v'},
 		{"noverify",		0, NULL, 'n'},
+		{"verify-all",		0, NULL, 'A'},
 		{"chip",		1, NULL, 'c'},
 		{"verbose",		0, NULL, 'V'},
 		{"force",		0, NULL, 'f'},
@@ -124,6 +270,11 @@ int main(int argc, char *argv[])
 		{"help",		0, NULL, 'h'},
 		{"version",		0, NULL, 'R'},
 		{"output",		1, NULL, 'o'},
+		{"read-window",		1, NULL, 'W'},
+		{"stats",		1, NULL, 'S'},
+		{"erase-verify",	1, NULL, 'e'},
+		{"ifd",			0, NULL, 'I'},
+		{"fmap",		0, NULL, 'M'},
 		{NULL,			0, NULL, 0},
 	};
 
@@ -134,7 +285,10 @@ int main(int argc, char *argv[])
 #endif /* !STANDALONE */
 	char *tempstr = NULL;
 	char *pparam = NULL;
+	char *statsfile = NULL;
 
+	if (image_to_stdout(argc, argv, optstring, long_options))
+		set_msg_stderr_only(true);
 	print_version();
 	print_banner();
 
@@ -178,15 +332,26 @@ int main(int argc, char *argv[])
 				cli_classic_abort_usage();
 			}
 			filename = strdup(optarg);
-			verify_it = 1;
+			verify_it = VERIFY_FULL;
 			break;
 		case 'n':
 			if (verify_it) {
 				fprintf(stderr, "--verify and --noverify are mutually exclusive. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			if (verify_all) {
+				fprintf(stderr, "--verify-all and --noverify are mutually exclusive. Aborting.\n");
+				cli_classic_abort_usage();
+			}
 			dont_verify_it = 1;
 			break;
+		case 'A':
+			if (dont_verify_it) {
+				fprintf(stderr, "--verify-all and --noverify are mutually exclusive. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			verify_all = 1;
+			break;
 		case 'c':
 			chip_to_probe = strdup(optarg);
 			break;
@@ -214,6 +379,12 @@ int main(int argc, char *argv[])
 			}
 			layoutfile = strdup(optarg);
 			break;
+		case 'I':
+			ifd_layout = 1;
+			break;
+		case 'M':
+			fmap_layout = 1;
+			break;
 		case 'i':
 			tempstr = strdup(optarg);
 			if (register_include_arg(tempstr)) {
@@ -244,14 +415,15 @@ int main(int argc, char *argv[])
 #endif
 			break;
 		case 'p':
-			if (prog != PROGRAMMER_INVALID) {
+			if (num_targets >= MAX_GANG_TARGETS) {
 				fprintf(stderr, "Error: --programmer specified "
-					"more than once. You can separate "
+					"more than %i times. You can separate "
 					"multiple\nparameters for a programmer "
 					"with \",\". Please see the man page "
-					"for details.\n");
+					"for details.\n", MAX_GANG_TARGETS);
 				cli_classic_abort_usage();
 			}
+			pparam = NULL;
 			for (prog = 0; prog < PROGRAMMER_INVALID; prog++) {
 				name = programmer_table[prog].name;
 				namelen = strlen(name);
@@ -284,6 +456,8 @@ int main(int argc, char *argv[])
 				msg_ginfo(".\n");
 				cli_classic_abort_usage();
 			}
+			progs[num_targets] = prog;
+			pparams[num_targets++] = pparam;
 			break;
 		case 'R':
 			/* print_version() is always called during startup. */
@@ -303,6 +477,44 @@ int main(int argc, char *argv[])
 			cli_classic_usage(argv[0]);
 			exit(0);
 			break;
+		case 'W':
+			read_window = strtoul(optarg, &tempstr, 0);
+			if (*tempstr == 'K' || *tempstr == 'k') {
+				read_window *= 1024;
+				tempstr++;
+			} else if (*tempstr == 'M') {
+				read_window *= 1024 * 1024;
+				tempstr++;
+			}
+			if (*tempstr != '\0' || !read_window) {
+				fprintf(stderr, "Error: Invalid read window size \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			tempstr = NULL;
+			break;
+		case 'S':
+			statsfile = strdup(optarg);
+			if (statsfile[0] == '\0') {
+				fprintf(stderr, "No statistics filename specified.\n");
+				cli_classic_abort_usage();
+			}
+			break;
+		case 'e':
+			if (!strcmp(optarg, "auto")) {
+				erase_verify = ERASE_VERIFY_AUTO;
+			} else if (!strcmp(optarg, "full")) {
+				erase_verify = ERASE_VERIFY_FULL;
+			} else if (!strcmp(optarg, "deferred")) {
+				erase_verify = ERASE_VERIFY_DEFERRED;
+			} else if (!strcmp(optarg, "status")) {
+				erase_verify = ERASE_VERIFY_STATUS;
+			} else if (!strcmp(optarg, "sampled")) {
+				erase_verify = ERASE_VERIFY_SAMPLED;
+			} else {
+				fprintf(stderr, "Error: Unknown erase verification policy \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			break;
 		case 'o':
 #ifdef STANDALONE
 			fprintf(stderr, "Log file not supported in standalone mode. Aborting.\n");
@@ -326,12 +538,35 @@ int main(int argc, char *argv[])
 		cli_classic_abort_usage();
 	}
 
+	if (num_targets > 1) {
+#ifdef HAVE_GANG_MODE
+		if (read_it) {
+			fprintf(stderr, "Error: Reading is not supported with multiple programmers.\n");
+			cli_classic_abort_usage();
+		}
+#else
+		fprintf(stderr, "Error: Multiple programmers are not supported on this platform.\n");
+		cli_classic_abort_usage();
+#endif
+	}
+
 	if ((read_it | write_it | verify_it) && check_filename(filename, "image")) {
 		cli_classic_abort_usage();
 	}
 	if (layoutfile && check_filename(layoutfile, "layout")) {
 		cli_classic_abort_usage();
 	}
+	if ((layoutfile != NULL) + ifd_layout + fmap_layout > 1) {
+		fprintf(stderr, "Error: --layout, --ifd and --fmap are mutually exclusive.\n");
+		cli_classic_abort_usage();
+	}
+	if (statsfile) {
+		if (read_it && !strcmp(filename, "-") && !strcmp(statsfile, "-")) {
+			fprintf(stderr, "Error: The image and the statistics can't both be written to stdout.\n");
+			cli_classic_abort_usage();
+		}
+		stats_enable();
+	}
 
 #ifndef STANDALONE
 	if (logfile && check_filename(logfile, "log"))
@@ -368,13 +603,14 @@ int main(int argc, char *argv[])
 		ret = 1;
 		goto out;
 	}
-	if (layoutfile != NULL && !write_it) {
-		msg_gerr("Layout files are currently supported for write operations only.\n");
+	if ((layoutfile != NULL || ifd_layout || fmap_layout) && !write_it) {
+		msg_gerr("Layouts are currently supported for write operations only.\n");
 		ret = 1;
 		goto out;
 	}
 
-	if (process_include_args()) {
+	/* The descriptor or FMAP may be read from the chip, so their regions are processed after probing. */
+	if (!ifd_layout && !fmap_layout && process_include_args()) {
 		ret = 1;
 		goto out;
 	}
@@ -397,6 +633,7 @@ int main(int argc, char *argv[])
 			prog = CONFIG_DEFAULT_PROGRAMMER;
 			/* We need to strdup here because we free(pparam) unconditionally later. */
 			pparam = strdup(CONFIG_DEFAULT_PROGRAMMER_ARGS);
+			pparams[num_targets++] = pparam;
 			msg_pinfo("Using default programmer \"%s\" with arguments \"%s\".\n",
 				  programmer_table[CONFIG_DEFAULT_PROGRAMMER].name, pparam);
 		} else {
@@ -416,6 +653,32 @@ int main(int argc, char *argv[])
 	/* FIXME: Delay calibration should happen in programmer code. */
 	myusec_calibrate_delay();
 
+#ifdef HAVE_GANG_MODE
+	/* Each target gets its own process because programmer drivers keep their state in globals. */
+	char gang_prefix[16];
+	if (num_targets > 1) {
+		i = gang_run(num_targets, progs, pparams, &ret);
+		if (i < 0)
+			goto out;
+		prog = progs[i];
+		pparam = pparams[i];
+		snprintf(gang_prefix, sizeof(gang_prefix), "[%i] ", i);
+		set_msg_prefix(gang_prefix);
+		/* Every target writes its own statistics file. */
+		if (statsfile && strcmp(statsfile, "-")) {
+			tempstr = statsfile;
+			statsfile = malloc(strlen(tempstr) + 16);
+			if (!statsfile) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+			sprintf(statsfile, "%s.%i", tempstr, i);
+			free(tempstr);
+			tempstr = NULL;
+		}
+	}
+#endif
+
 	if (programmer_init(prog, pparam)) {
 		msg_perr("Error: Programmer initialization failed.\n");
 		ret = 1;
@@ -425,6 +688,7 @@ int main(int argc, char *argv[])
 	msg_pdbg("The following protocols are supported: %s.\n", tempstr);
 	free(tempstr);
 
+	stats_phase(STATS_PHASE_PROBE);
 	for (j = 0; j < registered_master_count; j++) {
 		startchip = 0;
 		while (chipcount < ARRAY_SIZE(flashes)) {
@@ -435,6 +699,7 @@ int main(int argc, char *argv[])
 			startchip++;
 		}
 	}
+	stats_phase(STATS_PHASE_NONE);
 
 	if (chipcount > 1) {
 		msg_cinfo("Multiple flash chip definitions match the detected chip(s): \"%s\"",
@@ -487,7 +752,9 @@ int main(int argc, char *argv[])
 				goto out_shutdown;
 			}
 			msg_cinfo("Please note that forced reads most likely contain garbage.\n");
+			stats_phase(STATS_PHASE_READ);
 			ret = read_flash_to_file(&flashes[0], filename);
+			stats_phase(STATS_PHASE_NONE);
 			unmap_flash(&flashes[0]);
 			free(flashes[0].chip);
 			goto out_shutdown;
@@ -503,6 +770,9 @@ int main(int argc, char *argv[])
 	}
 
 	fill_flash = &flashes[0];
+#ifdef HAVE_GANG_MODE
+	gang_release();
+#endif
 
 	print_chip_support_status(fill_flash->chip);
 
@@ -527,9 +797,10 @@ int main(int argc, char *argv[])
 		goto out_shutdown;
 	}
 
-	/* Always verify write operations unless -n is used. */
+	/* Always verify write operations unless -n is used. Only the modified ranges are verified unless -A is
+	 * used. */
 	if (write_it && !dont_verify_it)
-		verify_it = 1;
+		verify_it = verify_all ? VERIFY_FULL : VERIFY_WRITTEN;
 
 	/* Map the selected flash chip again. */
 	if (map_flash(fill_flash) != 0) {
@@ -537,16 +808,42 @@ int main(int argc, char *argv[])
 		goto out_shutdown;
 	}
 
+	/* Before anything is read from the chip, layouts included. */
+	if (spi_prepare_4ba(fill_flash)) {
+		msg_cerr("Failed to enable 4-byte addressing. Aborting.\n");
+		unmap_flash(fill_flash);
+		ret = 1;
+		goto out_shutdown;
+	}
+
+	if (ifd_layout)
+#if CONFIG_INTERNAL == 1
+		ret = read_ifd_layout(fill_flash, filename, prog == PROGRAMMER_INTERNAL);
+#else
+		ret = read_ifd_layout(fill_flash, filename, false);
+#endif
+	else if (fmap_layout)
+		ret = read_fmap_layout(fill_flash, filename);
+	if (!ret && (ifd_layout || fmap_layout))
+		ret = process_include_args();
+	if (ret) {
+		unmap_flash(fill_flash);
+		goto out_shutdown;
+	}
+
 	/* FIXME: We should issue an unconditional chip reset here. This can be
 	 * done once we have a .reset function in struct flashchip.
 	 * Give the chip time to settle.
 	 */
 	programmer_delay(100000);
 	ret |= doit(fill_flash, force, filename, read_it, write_it, erase_it, verify_it);
+	stats_phase(STATS_PHASE_NONE);
 
 	unmap_flash(fill_flash);
 out_shutdown:
 	programmer_shutdown();
+	if (statsfile)
+		ret |= stats_write_json(statsfile, chipcount == 1 ? flashes[0].chip->name : chip_to_probe);
 out:
 	for (i = 0; i < chipcount; i++)
 		free(flashes[i].chip);
@@ -554,7 +851,9 @@ out:
 	layout_cleanup();
 	free(filename);
 	free(layoutfile);
-	free(pparam);
+	free(statsfile);
+	for (i = 0; i < num_targets; i++)
+		free(pparams[i]);
 	/* clean up global variables */
 	free((char *)chip_to_probe); /* Silence! Freeing is not modifying contents. */
 	chip_to_probe = NULL;
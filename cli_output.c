@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
@@ -28,6 +29,22 @@
 int verbose_screen = MSG_INFO;
 int verbose_logfile = MSG_DEBUG2;
 
+/* Optional string prepended to every line of output, used to tell apart the messages of parallel targets. */
+static const char *msg_prefix = NULL;
+
+void set_msg_prefix(const char *prefix)
+{
+	msg_prefix = prefix;
+}
+
+/* If set, all messages go to stderr because stdout carries data (e.g. an image read with "-r -"). */
+static bool msg_stderr_only = false;
+
+void set_msg_stderr_only(bool stderr_only)
+{
+	msg_stderr_only = stderr_only;
+}
+
 #ifndef STANDALONE
 static FILE *logfile = NULL;
 
@@ -70,6 +87,56 @@ void start_logging(void)
 }
 #endif /* !STANDALONE */
 
+/* Write @str to @output_type and start every line with msg_prefix. @line_start tracks whether the last string
+ * written to this output ended a line. */
+static void print_prefixed(FILE *output_type, const char *str, bool *line_start)
+{
+	while (*str) {
+		const char *newline = strchr(str, '\n');
+		size_t len = newline ? newline - str + 1 : strlen(str);
+
+		if (*line_start)
+			fputs(msg_prefix, output_type);
+		fwrite(str, 1, len, output_type);
+		*line_start = newline != NULL;
+		str += len;
+	}
+}
+
+static int vprint_prefixed(enum msglevel level, FILE *output_type, const char *fmt, va_list ap)
+{
+	static bool screen_line_start = true;
+	va_list ap2;
+	char *str;
+	int len;
+
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+	if (len < 0)
+		return len;
+	str = malloc(len + 1);
+	if (!str)
+		return -1;
+	vsnprintf(str, len + 1, fmt, ap);
+
+	if (level <= verbose_screen) {
+		print_prefixed(output_type, str, &screen_line_start);
+		if (level != MSG_SPEW)
+			fflush(output_type);
+	}
+#ifndef STANDALONE
+	static bool log_line_start = true;
+	if ((level <= verbose_logfile) && logfile) {
+		print_prefixed(logfile, str, &log_line_start);
+		if (level != MSG_SPEW)
+			fflush(logfile);
+	}
+#endif /* !STANDALONE */
+	free(str);
+	return len;
+}
+
 /* Please note that level is the verbosity, not the importance of the message. */
 int print(enum msglevel level, const char *fmt, ...)
 {
@@ -77,9 +144,16 @@ int print(enum msglevel level, const char *fmt, ...)
 	int ret = 0;
 	FILE *output_type = stdout;
 
-	if (level < MSG_INFO)
+	if (level < MSG_INFO || msg_stderr_only)
 		output_type = stderr;
 
+	if (msg_prefix) {
+		va_start(ap, fmt);
+		ret = vprint_prefixed(level, output_type, fmt, ap);
+		va_end(ap);
+		return ret;
+	}
+
 	if (level <= verbose_screen) {
 		va_start(ap, fmt);
 		ret = vfprintf(output_type, fmt, ap);
@@ -197,7 +197,17 @@ static void LIBUSB_CALL dediprog_bulk_read_cb(struct libusb_transfer *const tran
 	++status->finished_idx;
 }
 
-static int dediprog_bulk_read_poll(const struct dediprog_transfer_status *const status, const int finish)
+static void LIBUSB_CALL dediprog_bulk_write_cb(struct libusb_transfer *const transfer)
+{
+	struct dediprog_transfer_status *const status = (struct dediprog_transfer_status *)transfer->user_data;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+		status->error = 1;
+		msg_perr("SPI bulk write failed!\n");
+	}
+	++status->finished_idx;
+}
+
+static int dediprog_bulk_poll(const struct dediprog_transfer_status *const status, const int finish)
 {
 	if (status->finished_idx >= status->queued_idx)
 		return 0;
@@ -206,7 +216,7 @@ static int dediprog_bulk_read_poll(const struct dediprog_transfer_status *const
 		struct timeval timeout = { 10, 0 };
 		const int ret = libusb_handle_events_timeout(usb_ctx, &timeout);
 		if (ret < 0) {
-			msg_perr("Polling read events failed: %i %s!\n", ret, libusb_error_name(ret));
+			msg_perr("Polling transfer events failed: %i %s!\n", ret, libusb_error_name(ret));
 			return 1;
 		}
 	} while (finish && (status->finished_idx < status->queued_idx));
@@ -215,12 +225,14 @@ static int dediprog_bulk_read_poll(const struct dediprog_transfer_status *const
 
 static int dediprog_read(enum dediprog_cmds cmd, unsigned int value, unsigned int idx, uint8_t *bytes, size_t size)
 {
+	stats_usb_transfer();
 	return libusb_control_transfer(dediprog_handle, REQTYPE_EP_IN, cmd, value, idx,
 				      (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
 }
 
 static int dediprog_write(enum dediprog_cmds cmd, unsigned int value, unsigned int idx, const uint8_t *bytes, size_t size)
 {
+	stats_usb_transfer();
 	return libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, cmd, value, idx,
 				      (unsigned char *)bytes, size, DEFAULT_TIMEOUT);
 }
@@ -474,13 +486,14 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 					 status.queued_idx, libusb_error_name(ret));
 				goto err_free;
 			}
+			stats_usb_transfer();
 			++status.queued_idx;
 		}
-		if (dediprog_bulk_read_poll(&status, 0))
+		if (dediprog_bulk_poll(&status, 0))
 			goto err_free;
 	}
 	/* Wait for transfers to finish. */
-	if (dediprog_bulk_read_poll(&status, 1))
+	if (dediprog_bulk_poll(&status, 1))
 		goto err_free;
 	/* Check if everything has been transmitted. */
 	if ((status.finished_idx < count) || status.error)
@@ -489,7 +502,7 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf, unsigned
 	err = 0;
 
 err_free:
-	dediprog_bulk_read_poll(&status, 1);
+	dediprog_bulk_poll(&status, 1);
 	for (i = 0; i < DEDIPROG_ASYNC_TRANSFERS; ++i)
 		if (transfers[i]) libusb_free_transfer(transfers[i]);
 	return err;
@@ -536,21 +549,31 @@ err:
 	return ret;
 }
 
-/* Bulk write interface, will write multiple chunksize byte chunks aligned to chunksize bytes.
+/* Send one bulk write command, will write multiple chunksize byte chunks aligned to chunksize bytes.
+ * Partial chunks at the edges of the range are padded with 0xff. Programming 0xff leaves a byte unchanged, so
+ * the padding does not touch data outside the range.
  * @chunksize       length of data chunks, only 256 supported by now
  * @start           start address
- * @len             length
+ * @len             length, must not span more than 0xffff chunks
  * @dedi_spi_cmd    dediprog specific write command for spi bus
  * @return          0 on success, 1 on failure
  */
-static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, unsigned int chunksize,
-				   unsigned int start, unsigned int len, uint8_t dedi_spi_cmd)
+static int dediprog_spi_bulk_write_cmd(struct flashctx *flash, const uint8_t *buf, unsigned int chunksize,
+				       unsigned int start, unsigned int len, uint8_t dedi_spi_cmd)
 {
+	int err = 1;
+
 	/* USB transfer size must be 512, other sizes will NOT work at all.
 	 * chunksize is the real data size per USB bulk transfer. The remaining
 	 * space in a USB bulk transfer must be filled with 0xff padding.
 	 */
-	const unsigned int count = len / chunksize;
+	const unsigned int head = start % chunksize;
+	const unsigned int count = (head + len + chunksize - 1) / chunksize;
+
+	struct dediprog_transfer_status status = { 0, 0, 0 };
+	struct libusb_transfer *transfers[DEDIPROG_ASYNC_TRANSFERS] = { NULL, };
+	unsigned char usbbufs[DEDIPROG_ASYNC_TRANSFERS][512];
+	struct libusb_transfer *transfer;
 
 	/*
 	 * We should change this check to
@@ -563,12 +586,6 @@ static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, u
 		return 1;
 	}
 
-	if ((start % chunksize) || (len % chunksize)) {
-		msg_perr("%s: Unaligned start=%i, len=%i! Please report a bug "
-			 "at flashrom@flashrom.org\n", __func__, start, len);
-		return 1;
-	}
-
 	/* No idea if the hardware can handle empty writes, so chicken out. */
 	if (len == 0)
 		return 0;
@@ -576,27 +593,87 @@ static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, u
 	/* Command packet size of protocols: new 10 B, old 5 B. */
 	uint8_t data_packet[is_new_prot() ? 10 : 5];
 	unsigned int value, idx;
-	fill_rw_cmd_payload(data_packet, count, dedi_spi_cmd, &value, &idx, start);
+	fill_rw_cmd_payload(data_packet, count, dedi_spi_cmd, &value, &idx, start - head);
 	int ret = dediprog_write(CMD_WRITE, value, idx, data_packet, sizeof(data_packet));
 	if (ret != sizeof(data_packet)) {
 		msg_perr("Command Write SPI Bulk failed, %s!\n", libusb_error_name(ret));
 		return 1;
 	}
 
+	/* Allocate bulk transfers. */
 	unsigned int i;
-	for (i = 0; i < count; i++) {
-		unsigned char usbbuf[512];
-		memcpy(usbbuf, buf + i * chunksize, chunksize);
-		memset(usbbuf + chunksize, 0xff, sizeof(usbbuf) - chunksize); // fill up with 0xFF
-		int transferred;
-		ret = libusb_bulk_transfer(dediprog_handle, dediprog_out_endpoint, usbbuf, 512, &transferred,
-					   DEFAULT_TIMEOUT);
-		if ((ret < 0) || (transferred != 512)) {
-			msg_perr("SPI bulk write failed, expected %i, got %s!\n", 512, libusb_error_name(ret));
-			return 1;
+	for (i = 0; i < min(DEDIPROG_ASYNC_TRANSFERS, count); ++i) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			msg_perr("Allocating libusb transfer %i failed!\n", i);
+			goto err_free;
+		}
+	}
+
+	/* Keep up to DEDIPROG_ASYNC_TRANSFERS chunks in flight like dediprog_spi_bulk_read() does. A buffer is
+	 * only refilled after the transfer that used it has finished. */
+	while (!status.error && (status.queued_idx < count)) {
+		while ((status.queued_idx < count) &&
+		       ((status.queued_idx - status.finished_idx) < DEDIPROG_ASYNC_TRANSFERS)) {
+			const unsigned int slot = status.queued_idx % DEDIPROG_ASYNC_TRANSFERS;
+			/* Offset of this chunk's data within buf and within the chunk. */
+			const unsigned int chunk_start = status.queued_idx * chunksize;
+			const unsigned int bufoff = chunk_start > head ? chunk_start - head : 0;
+			const unsigned int chunkoff = chunk_start < head ? head - chunk_start : 0;
+			const unsigned int datalen = min(chunksize - chunkoff, len - bufoff);
+
+			memset(usbbufs[slot], 0xff, sizeof(usbbufs[slot]));
+			memcpy(usbbufs[slot] + chunkoff, buf + bufoff, datalen);
+
+			transfer = transfers[slot];
+			libusb_fill_bulk_transfer(transfer, dediprog_handle, dediprog_out_endpoint,
+					usbbufs[slot], sizeof(usbbufs[slot]),
+					dediprog_bulk_write_cb, &status, DEFAULT_TIMEOUT);
+			ret = libusb_submit_transfer(transfer);
+			if (ret < 0) {
+				msg_perr("Submitting SPI bulk write %i failed: %s!\n",
+					 status.queued_idx, libusb_error_name(ret));
+				goto err_free;
+			}
+			stats_usb_transfer();
+			++status.queued_idx;
 		}
+		if (dediprog_bulk_poll(&status, 0))
+			goto err_free;
 	}
+	/* Wait for transfers to finish. */
+	if (dediprog_bulk_poll(&status, 1))
+		goto err_free;
+	/* Check if everything has been transmitted. */
+	if ((status.finished_idx < count) || status.error)
+		goto err_free;
+
+	err = 0;
 
+err_free:
+	dediprog_bulk_poll(&status, 1);
+	for (i = 0; i < DEDIPROG_ASYNC_TRANSFERS; ++i)
+		if (transfers[i]) libusb_free_transfer(transfers[i]);
+	return err;
+}
+
+/* Bulk write interface, splits the range into as many bulk write commands as needed.
+ * The chunk count in a command packet is only 16 bits wide.
+ */
+static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, unsigned int chunksize,
+				   unsigned int start, unsigned int len, uint8_t dedi_spi_cmd)
+{
+	const unsigned int maxlen = 0xffff * chunksize;
+
+	while (len) {
+		const unsigned int cmdlen = min(len, maxlen - start % chunksize);
+
+		if (dediprog_spi_bulk_write_cmd(flash, buf, chunksize, start, cmdlen, dedi_spi_cmd))
+			return 1;
+		buf += cmdlen;
+		start += cmdlen;
+		len -= cmdlen;
+	}
 	return 0;
 }
 
@@ -615,6 +692,11 @@ static int dediprog_spi_write(struct flashctx *flash, const uint8_t *buf,
 			 "we don't know how dediprog\nhandles them.\n");
 		/* Write everything like it was residue. */
 		residue = len;
+	} else if (dedi_spi_cmd == WRITE_MODE_PAGE_PGM) {
+		/* Page program can pad partial pages at both edges, so the whole range is one bulk write. */
+		ret = dediprog_spi_bulk_write(flash, buf, chunksize, start, len, dedi_spi_cmd);
+		dediprog_set_leds(ret ? LED_ERROR : LED_PASS);
+		return ret;
 	}
 
 	if (residue) {
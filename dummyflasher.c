@@ -39,6 +39,10 @@
 #include <sys/stat.h>
 #endif
 
+#if EMULATE_SPI_CHIP
+#include <sys/time.h>
+#endif
+
 #if EMULATE_CHIP
 static uint8_t *flashchip_contents = NULL;
 enum emu_chip {
@@ -47,6 +51,7 @@ enum emu_chip {
 	EMULATE_SST_SST25VF040_REMS,
 	EMULATE_SST_SST25VF032B,
 	EMULATE_MACRONIX_MX25L6436,
+	EMULATE_WINBOND_W25Q256FV,
 };
 static enum emu_chip emu_chip = EMULATE_NONE;
 static char *emu_persistent_image = NULL;
@@ -64,6 +69,31 @@ unsigned char spi_ignorelist[256];
 int spi_blacklist_size = 0;
 int spi_ignorelist_size = 0;
 static uint8_t emu_status = 0;
+static bool emu_4ba_supported = false;
+static bool emu_4ba_mode = false;
+
+/* Optional timing model of the emulated SPI chip and the link to it. */
+enum emu_timing {
+	EMU_TIMING_OFF,		/* Every command completes instantly, WIP is never set. */
+	EMU_TIMING_REALTIME,	/* Transfers and busy times take real time. */
+	EMU_TIMING_VIRTUAL,	/* Time only passes on a virtual clock, delays just advance it. */
+};
+static enum emu_timing emu_timing = EMU_TIMING_OFF;
+static unsigned long emu_spi_clock = 50 * 1000 * 1000;	/* Hz */
+static unsigned long emu_spi_latency = 0;		/* us per transaction */
+/* Typical durations in us, indexed by enum op_timing_type. The chip erase default scales with the size. */
+static unsigned long emu_op_time[NUM_OP_TIMINGS] = {
+	[OP_TIMING_BP]		= 30,
+	[OP_TIMING_PP]		= 700,
+	[OP_TIMING_SE]		= 45000,
+	[OP_TIMING_BE32]	= 120000,
+	[OP_TIMING_BE64]	= 150000,
+};
+static uint64_t emu_clock_ns;		/* virtual time, or the real time the model was started at */
+static uint64_t emu_clock_rest_ns;	/* transfer time not slept yet in real time mode */
+static uint64_t emu_busy_until;
+static uint64_t emu_busy_ns;
+static unsigned long emu_transactions;
 
 /* A legit complete SFDP table based on the MX25L6436E (rev. 1.8) datasheet. */
 static const uint8_t sfdp_table[] = {
@@ -98,6 +128,7 @@ static unsigned int spi_write_256_chunksize = 256;
 
 static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				  const unsigned char *writearr, unsigned char *readarr);
+static int dummy_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
 static void dummy_chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr);
@@ -111,10 +142,12 @@ static void dummy_chip_readn(const struct flashctx *flash, uint8_t *buf, const c
 
 static const struct spi_master spi_master_dummyflasher = {
 	.type		= SPI_CONTROLLER_DUMMY,
+	.features	= SPI_MASTER_FAST_READ | SPI_MASTER_DUAL_OUT | SPI_MASTER_QUAD_OUT |
+			  SPI_MASTER_QUAD_IO | SPI_MASTER_4BA,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
 	.command	= dummy_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= dummy_spi_send_multicommand,
 	.read		= default_spi_read,
 	.write_256	= dummy_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -133,6 +166,178 @@ static const struct par_master par_master_dummy = {
 
 enum chipbustype dummy_buses_supported = BUS_NONE;
 
+#if EMULATE_SPI_CHIP
+static uint64_t emu_real_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+/* Current time of the timing model in ns. */
+static uint64_t emu_now(void)
+{
+	if (emu_timing == EMU_TIMING_REALTIME)
+		return emu_real_ns() - emu_clock_ns;
+	return emu_clock_ns;
+}
+
+static void emu_advance(uint64_t ns)
+{
+	switch (emu_timing) {
+	case EMU_TIMING_VIRTUAL:
+		emu_clock_ns += ns;
+		break;
+	case EMU_TIMING_REALTIME:
+		emu_clock_rest_ns += ns;
+		if (emu_clock_rest_ns >= 1000) {
+			internal_delay(emu_clock_rest_ns / 1000);
+			emu_clock_rest_ns %= 1000;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Let the time to clock out one command pass. Multi-I/O modes transfer the data (and address) faster. */
+static void emu_transfer(unsigned int writecnt, unsigned int readcnt, enum spi_io_mode io_mode,
+			 bool new_transaction)
+{
+	uint64_t cycles, ns;
+
+	if (emu_timing == EMU_TIMING_OFF)
+		return;
+	switch (io_mode) {
+	case SPI_IO_DUAL_OUT:
+		cycles = writecnt * 8 + readcnt * 4;
+		break;
+	case SPI_IO_QUAD_OUT:
+		cycles = writecnt * 8 + readcnt * 2;
+		break;
+	case SPI_IO_QUAD_IO:
+		cycles = 8 + (writecnt ? writecnt - 1 : 0) * 2 + readcnt * 2;
+		break;
+	default:
+		cycles = (uint64_t)(writecnt + readcnt) * 8;
+		break;
+	}
+	ns = cycles * 1000000000 / emu_spi_clock;
+	if (new_transaction) {
+		ns += (uint64_t)emu_spi_latency * 1000;
+		emu_transactions++;
+	}
+	emu_advance(ns);
+}
+
+/* Start a self-timed operation, WIP stays set for its typical duration. */
+static void emu_start_op(enum op_timing_type op, unsigned int len)
+{
+	uint64_t ns;
+
+	if (emu_timing == EMU_TIMING_OFF)
+		return;
+	ns = (uint64_t)emu_op_time[op] * 1000;
+	/* Programming time is roughly proportional to the number of bytes. */
+	if (op == OP_TIMING_PP && len < 256) {
+		ns = ns * len / 256;
+		if (ns < (uint64_t)emu_op_time[OP_TIMING_BP] * 1000)
+			ns = (uint64_t)emu_op_time[OP_TIMING_BP] * 1000;
+	}
+	emu_busy_until = emu_now() + ns;
+	emu_busy_ns += ns;
+	emu_status |= SPI_SR_WIP;
+}
+
+/* Returns true while a self-timed operation is running and clears WIP once it has finished. */
+static bool emu_busy(void)
+{
+	if (emu_timing == EMU_TIMING_OFF)
+		return false;
+	if ((emu_status & SPI_SR_WIP) && emu_now() >= emu_busy_until)
+		emu_status &= ~SPI_SR_WIP;
+	return emu_status & SPI_SR_WIP;
+}
+
+/* Get an optional numeric parameter. Returns 1 if it is invalid. */
+static int emu_get_param(const char *name, unsigned long *val)
+{
+	char *tmp = extract_programmer_param(name);
+	char *endptr;
+
+	if (!tmp)
+		return 0;
+	errno = 0;
+	*val = strtoul(tmp, &endptr, 0);
+	if (*endptr == 'k') {
+		*val *= 1000;
+		endptr++;
+	} else if (*endptr == 'M') {
+		*val *= 1000 * 1000;
+		endptr++;
+	}
+	if (errno || endptr == tmp || *endptr != '\0') {
+		msg_perr("Error: Invalid value for %s: \"%s\"\n", name, tmp);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	return 0;
+}
+
+static int emu_timing_init(void)
+{
+	static const char *const op_params[NUM_OP_TIMINGS] = {
+		[OP_TIMING_BP]		= "tbp",
+		[OP_TIMING_PP]		= "tpp",
+		[OP_TIMING_SE]		= "tse",
+		[OP_TIMING_BE32]	= "tbe32",
+		[OP_TIMING_BE64]	= "tbe64",
+		[OP_TIMING_CE]		= "tce",
+	};
+	char *tmp;
+	int i;
+
+	tmp = extract_programmer_param("timing");
+	if (!tmp || !strcmp(tmp, "off")) {
+		emu_timing = EMU_TIMING_OFF;
+	} else if (!strcmp(tmp, "realtime")) {
+		emu_timing = EMU_TIMING_REALTIME;
+	} else if (!strcmp(tmp, "virtual")) {
+		emu_timing = EMU_TIMING_VIRTUAL;
+	} else {
+		msg_perr("Error: Invalid timing model \"%s\", use off, realtime or virtual.\n", tmp);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+
+	/* Chip erase takes about 2.5 s per MiB. */
+	emu_op_time[OP_TIMING_CE] = (uint64_t)emu_chip_size * 2500000 / (1024 * 1024);
+	if (emu_get_param("spi_clock", &emu_spi_clock) || emu_get_param("spi_latency", &emu_spi_latency))
+		return 1;
+	for (i = 0; i < NUM_OP_TIMINGS; i++) {
+		if (emu_get_param(op_params[i], &emu_op_time[i]))
+			return 1;
+	}
+	if (!emu_spi_clock) {
+		msg_perr("Error: The SPI clock can't be 0.\n");
+		return 1;
+	}
+
+	if (emu_timing == EMU_TIMING_OFF)
+		return 0;
+	emu_clock_ns = emu_timing == EMU_TIMING_REALTIME ? emu_real_ns() : 0;
+	msg_pdbg("Modeling %s timing with a %lu Hz SPI clock and %lu us per transaction.\n",
+		 emu_timing == EMU_TIMING_REALTIME ? "real" : "virtual", emu_spi_clock, emu_spi_latency);
+	msg_pdbg("tBP %lu us, tPP %lu us, tSE %lu us, tBE32 %lu us, tBE64 %lu us, tCE %lu us.\n",
+		 emu_op_time[OP_TIMING_BP], emu_op_time[OP_TIMING_PP], emu_op_time[OP_TIMING_SE],
+		 emu_op_time[OP_TIMING_BE32], emu_op_time[OP_TIMING_BE64], emu_op_time[OP_TIMING_CE]);
+	return 0;
+}
+#endif
+
 static int dummy_shutdown(void *data)
 {
 	msg_pspew("%s\n", __func__);
@@ -146,6 +351,16 @@ static int dummy_shutdown(void *data)
 		}
 		free(flashchip_contents);
 	}
+#endif
+#if EMULATE_SPI_CHIP
+	if (emu_timing != EMU_TIMING_OFF) {
+		const uint64_t now = emu_now();
+
+		msg_pinfo("Modeled time: %" PRIu64 ".%06" PRIu64 " s, the chip was busy for %" PRIu64 ".%06" PRIu64
+			  " s, %lu SPI transactions.\n", now / 1000000000, now / 1000 % 1000000,
+			  emu_busy_ns / 1000000000, emu_busy_ns / 1000 % 1000000, emu_transactions);
+		stats_modeled_time(now);
+	}
 #endif
 	return 0;
 }
@@ -334,6 +549,20 @@ int dummy_init(void)
 		msg_pdbg("Emulating Macronix MX25L6436 SPI flash chip (RDID, "
 			 "SFDP)\n");
 	}
+	if (!strcmp(tmp, "W25Q256FV")) {
+		emu_chip = EMULATE_WINBOND_W25Q256FV;
+		emu_chip_size = 32 * 1024 * 1024;
+		emu_max_byteprogram_size = 256;
+		emu_max_aai_size = 0;
+		emu_jedec_se_size = 4 * 1024;
+		emu_jedec_be_52_size = 32 * 1024;
+		emu_jedec_be_d8_size = 64 * 1024;
+		emu_jedec_ce_60_size = emu_chip_size;
+		emu_jedec_ce_c7_size = emu_chip_size;
+		emu_4ba_supported = true;
+		msg_pdbg("Emulating Winbond W25Q256FV SPI flash chip (RDID, "
+			 "4-byte addressing)\n");
+	}
 #endif
 	if (emu_chip == EMULATE_NONE) {
 		msg_perr("Invalid chip specified for emulation: %s\n", tmp);
@@ -362,6 +591,9 @@ int dummy_init(void)
 		msg_pdbg("Initial status register is set to 0x%02x.\n",
 			 emu_status);
 	}
+
+	if (emu_timing_init())
+		return 1;
 #endif
 
 	msg_pdbg("Filling fake flash chip with 0xff, size %i\n", emu_chip_size);
@@ -415,6 +647,26 @@ void dummy_unmap(void *virt_addr, size_t len)
 	msg_pspew("%s: Unmapping 0x%zx bytes at %p\n", __func__, len, virt_addr);
 }
 
+/*
+ * With the virtual timing model delays only advance the model's clock. Without a timing model the emulated
+ * chip is never busy, so there is nothing to wait for.
+ */
+void dummy_delay(unsigned int usecs)
+{
+#if EMULATE_SPI_CHIP
+	switch (emu_timing) {
+	case EMU_TIMING_OFF:
+		return;
+	case EMU_TIMING_VIRTUAL:
+		emu_clock_ns += (uint64_t)usecs * 1000;
+		return;
+	default:
+		break;
+	}
+#endif
+	internal_delay(usecs);
+}
+
 static void dummy_chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr)
 {
 	msg_pspew("%s: addr=0x%" PRIxPTR ", val=0x%02x\n", __func__, addr, val);
@@ -467,12 +719,32 @@ static void dummy_chip_readn(const struct flashctx *flash, uint8_t *buf, const c
 }
 
 #if EMULATE_SPI_CHIP
+/* Get the address of a command and the number of its address bytes. */
+static unsigned int emu_cmd_addr(const unsigned char *writearr, bool native_4ba, unsigned int *addr_len)
+{
+	if (emu_4ba_supported && (native_4ba || emu_4ba_mode)) {
+		*addr_len = 4;
+		return (uint32_t)writearr[1] << 24 | writearr[2] << 16 | writearr[3] << 8 | writearr[4];
+	}
+	*addr_len = 3;
+	return writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+}
+
+/* Programming can only clear bits, anything else needs an erase first. */
+static void emu_program(unsigned int offs, const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		flashchip_contents[offs + i] &= data[i];
+}
+
 static int emulate_spi_chip_response(unsigned int writecnt,
 				     unsigned int readcnt,
 				     const unsigned char *writearr,
 				     unsigned char *readarr)
 {
-	unsigned int offs, i, toread;
+	unsigned int offs, i, toread, addr_len;
 	static int unsigned aai_offs;
 	const unsigned char sst25vf040_rems_response[2] = {0xbf, 0x44};
 	const unsigned char sst25vf032b_rems_response[2] = {0xbf, 0x4a};
@@ -501,6 +773,12 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		}
 	}
 
+	/* Real chips ignore everything but status register reads while they are busy. */
+	if (emu_busy() && writearr[0] != JEDEC_RDSR && writearr[0] != JEDEC_RDSR2) {
+		msg_perr("Command 0x%02x ignored while the chip is busy!\n", writearr[0]);
+		return 0;
+	}
+
 	if (emu_max_aai_size && (emu_status & SPI_SR_AAI)) {
 		if (writearr[0] != JEDEC_AAI_WORD_PROGRAM &&
 		    writearr[0] != JEDEC_WRDI &&
@@ -580,6 +858,14 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			if (readcnt > 2)
 				readarr[2] = 0x17;
 			break;
+		case EMULATE_WINBOND_W25Q256FV:
+			if (readcnt > 0)
+				readarr[0] = 0xef;
+			if (readcnt > 1)
+				readarr[1] = 0x40;
+			if (readcnt > 2)
+				readarr[2] = 0x19;
+			break;
 		default: /* ignore */
 			break;
 		}
@@ -587,6 +873,16 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 	case JEDEC_RDSR:
 		memset(readarr, emu_status, readcnt);
 		break;
+	case JEDEC_RDSR2:
+		/* There is no emulated second status register. */
+		memset(readarr, 0, readcnt);
+		break;
+	case JEDEC_RDSCUR:
+		if (emu_chip != EMULATE_MACRONIX_MX25L6436)
+			break;
+		/* Emulated erases never fail, so E_FAIL and P_FAIL stay clear. No OTP either. */
+		memset(readarr, 0, readcnt);
+		break;
 	/* FIXME: this should be chip-specific. */
 	case JEDEC_EWSR:
 	case JEDEC_WREN:
@@ -601,26 +897,53 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		emu_status = writearr[1] & ~SPI_SR_WIP;
 		msg_pdbg2("WRSR wrote 0x%02x.\n", emu_status);
 		break;
+	case JEDEC_ENTER_4_BYTE_ADDR_MODE:
+		emu_4ba_mode = emu_4ba_supported;
+		break;
+	case JEDEC_EXIT_4_BYTE_ADDR_MODE:
+		emu_4ba_mode = false;
+		break;
+	case JEDEC_READ_4BA:
+	case JEDEC_FAST_READ_4BA:
+	case JEDEC_FAST_READ_DOUT_4BA:
+	case JEDEC_FAST_READ_QOUT_4BA:
+	case JEDEC_FAST_READ_QIO_4BA:
+		if (!emu_4ba_supported)
+			break;
+		/* fall through */
 	case JEDEC_READ:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+	case JEDEC_FAST_READ:
+	case JEDEC_FAST_READ_DOUT:
+	case JEDEC_FAST_READ_QOUT:
+	case JEDEC_FAST_READ_QIO:
+		/* The bus width does not matter here, mode and dummy bytes are ignored. */
+		offs = emu_cmd_addr(writearr, writearr[0] == JEDEC_READ_4BA || writearr[0] == JEDEC_FAST_READ_4BA ||
+				    writearr[0] == JEDEC_FAST_READ_DOUT_4BA ||
+				    writearr[0] == JEDEC_FAST_READ_QOUT_4BA ||
+				    writearr[0] == JEDEC_FAST_READ_QIO_4BA, &addr_len);
 		/* Truncate to emu_chip_size. */
 		offs %= emu_chip_size;
 		if (readcnt > 0)
 			memcpy(readarr, flashchip_contents + offs, readcnt);
 		break;
+	case JEDEC_BYTE_PROGRAM_4BA:
+		if (!emu_4ba_supported)
+			break;
+		/* fall through */
 	case JEDEC_BYTE_PROGRAM:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_cmd_addr(writearr, writearr[0] == JEDEC_BYTE_PROGRAM_4BA, &addr_len);
 		/* Truncate to emu_chip_size. */
 		offs %= emu_chip_size;
-		if (writecnt < 5) {
+		if (writecnt < 2 + addr_len) {
 			msg_perr("BYTE PROGRAM size too short!\n");
 			return 1;
 		}
-		if (writecnt - 4 > emu_max_byteprogram_size) {
+		if (writecnt - 1 - addr_len > emu_max_byteprogram_size) {
 			msg_perr("Max BYTE PROGRAM size exceeded!\n");
 			return 1;
 		}
-		memcpy(flashchip_contents + offs, writearr + 4, writecnt - 4);
+		emu_program(offs, writearr + 1 + addr_len, writecnt - 1 - addr_len);
+		emu_start_op(writecnt - 1 - addr_len > 1 ? OP_TIMING_PP : OP_TIMING_BP, writecnt - 1 - addr_len);
 		break;
 	case JEDEC_AAI_WORD_PROGRAM:
 		if (!emu_max_aai_size)
@@ -641,8 +964,9 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 				   writearr[3];
 			/* Truncate to emu_chip_size. */
 			aai_offs %= emu_chip_size;
-			memcpy(flashchip_contents + aai_offs, writearr + 4, 2);
+			emu_program(aai_offs, writearr + 4, 2);
 			aai_offs += 2;
+			emu_start_op(OP_TIMING_BP, 2);
 		} else {
 			if (writecnt < JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE) {
 				msg_perr("Continuation AAI WORD PROGRAM size "
@@ -654,35 +978,42 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 					 "too long!\n");
 				return 1;
 			}
-			memcpy(flashchip_contents + aai_offs, writearr + 1, 2);
+			emu_program(aai_offs, writearr + 1, 2);
 			aai_offs += 2;
+			emu_start_op(OP_TIMING_BP, 2);
 		}
 		break;
 	case JEDEC_WRDI:
 		if (emu_max_aai_size)
 			emu_status &= ~SPI_SR_AAI;
 		break;
+	case JEDEC_SE_4BA:
+		if (!emu_4ba_supported)
+			break;
+		/* fall through */
 	case JEDEC_SE:
 		if (!emu_jedec_se_size)
 			break;
-		if (writecnt != JEDEC_SE_OUTSIZE) {
-			msg_perr("SECTOR ERASE 0x20 outsize invalid!\n");
+		offs = emu_cmd_addr(writearr, writearr[0] == JEDEC_SE_4BA, &addr_len);
+		if (writecnt != 1 + addr_len) {
+			msg_perr("SECTOR ERASE 0x%02x outsize invalid!\n", writearr[0]);
 			return 1;
 		}
 		if (readcnt != JEDEC_SE_INSIZE) {
-			msg_perr("SECTOR ERASE 0x20 insize invalid!\n");
+			msg_perr("SECTOR ERASE 0x%02x insize invalid!\n", writearr[0]);
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
 		if (offs & (emu_jedec_se_size - 1))
-			msg_pdbg("Unaligned SECTOR ERASE 0x20: 0x%x\n", offs);
+			msg_pdbg("Unaligned SECTOR ERASE 0x%02x: 0x%x\n", writearr[0], offs);
 		offs &= ~(emu_jedec_se_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_se_size);
+		emu_start_op(OP_TIMING_SE, emu_jedec_se_size);
 		break;
 	case JEDEC_BE_52:
 		if (!emu_jedec_be_52_size)
 			break;
-		if (writecnt != JEDEC_BE_52_OUTSIZE) {
+		offs = emu_cmd_addr(writearr, false, &addr_len);
+		if (writecnt != 1 + addr_len) {
 			msg_perr("BLOCK ERASE 0x52 outsize invalid!\n");
 			return 1;
 		}
@@ -690,28 +1021,33 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("BLOCK ERASE 0x52 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
 		if (offs & (emu_jedec_be_52_size - 1))
 			msg_pdbg("Unaligned BLOCK ERASE 0x52: 0x%x\n", offs);
 		offs &= ~(emu_jedec_be_52_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_be_52_size);
+		emu_start_op(OP_TIMING_BE32, emu_jedec_be_52_size);
 		break;
+	case JEDEC_BE_DC:
+		if (!emu_4ba_supported)
+			break;
+		/* fall through */
 	case JEDEC_BE_D8:
 		if (!emu_jedec_be_d8_size)
 			break;
-		if (writecnt != JEDEC_BE_D8_OUTSIZE) {
-			msg_perr("BLOCK ERASE 0xd8 outsize invalid!\n");
+		offs = emu_cmd_addr(writearr, writearr[0] == JEDEC_BE_DC, &addr_len);
+		if (writecnt != 1 + addr_len) {
+			msg_perr("BLOCK ERASE 0x%02x outsize invalid!\n", writearr[0]);
 			return 1;
 		}
 		if (readcnt != JEDEC_BE_D8_INSIZE) {
-			msg_perr("BLOCK ERASE 0xd8 insize invalid!\n");
+			msg_perr("BLOCK ERASE 0x%02x insize invalid!\n", writearr[0]);
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
 		if (offs & (emu_jedec_be_d8_size - 1))
-			msg_pdbg("Unaligned BLOCK ERASE 0xd8: 0x%x\n", offs);
+			msg_pdbg("Unaligned BLOCK ERASE 0x%02x: 0x%x\n", writearr[0], offs);
 		offs &= ~(emu_jedec_be_d8_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_be_d8_size);
+		emu_start_op(OP_TIMING_BE64, emu_jedec_be_d8_size);
 		break;
 	case JEDEC_CE_60:
 		if (!emu_jedec_ce_60_size)
@@ -727,6 +1063,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* JEDEC_CE_60_OUTSIZE is 1 (no address) -> no offset. */
 		/* emu_jedec_ce_60_size is emu_chip_size. */
 		memset(flashchip_contents, 0xff, emu_jedec_ce_60_size);
+		emu_start_op(OP_TIMING_CE, emu_jedec_ce_60_size);
 		break;
 	case JEDEC_CE_C7:
 		if (!emu_jedec_ce_c7_size)
@@ -742,6 +1079,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* JEDEC_CE_C7_OUTSIZE is 1 (no address) -> no offset. */
 		/* emu_jedec_ce_c7_size is emu_chip_size. */
 		memset(flashchip_contents, 0xff, emu_jedec_ce_c7_size);
+		emu_start_op(OP_TIMING_CE, emu_jedec_ce_c7_size);
 		break;
 	case JEDEC_SFDP:
 		if (emu_chip != EMULATE_MACRONIX_MX25L6436)
@@ -788,10 +1126,8 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 }
 #endif
 
-static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
-				  unsigned int readcnt,
-				  const unsigned char *writearr,
-				  unsigned char *readarr)
+static int dummy_spi_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+			     const unsigned char *writearr, unsigned char *readarr)
 {
 	int i;
 
@@ -809,6 +1145,7 @@ static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	case EMULATE_SST_SST25VF040_REMS:
 	case EMULATE_SST_SST25VF032B:
 	case EMULATE_MACRONIX_MX25L6436:
+	case EMULATE_WINBOND_W25Q256FV:
 		if (emulate_spi_chip_response(writecnt, readcnt, writearr,
 					      readarr)) {
 			msg_pdbg("Invalid command sent to flash chip!\n");
@@ -826,6 +1163,34 @@ static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	return 0;
 }
 
+static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
+				  unsigned int readcnt,
+				  const unsigned char *writearr,
+				  unsigned char *readarr)
+{
+#if EMULATE_SPI_CHIP
+	emu_transfer(writecnt, readcnt, SPI_IO_SINGLE, true);
+#endif
+	return dummy_spi_command(flash, writecnt, readcnt, writearr, readarr);
+}
+
+/* Multi-I/O transfers are emulated like single I/O ones because only the bytes matter. Only the timing model
+ * accounts for the faster transfer. */
+static int dummy_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	const struct spi_command *first = cmds;
+	int result = 0;
+
+	for (; (cmds->writecnt || cmds->readcnt) && !result; cmds++) {
+#if EMULATE_SPI_CHIP
+		emu_transfer(cmds->writecnt, cmds->readcnt, cmds->io_mode, cmds == first);
+#endif
+		result = dummy_spi_command(flash, cmds->writecnt, cmds->readcnt,
+					   cmds->writearr, cmds->readarr);
+	}
+	return result;
+}
+
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
 	return spi_write_chunked(flash, buf, start, len,
@@ -50,7 +50,7 @@ typedef uintptr_t chipaddr;
 /* Types and macros regarding the maximum flash space size supported by generic code. */
 typedef uint32_t chipoff_t; /* Able to store any addressable offset within a supported flash memory. */
 typedef uint32_t chipsize_t; /* Able to store the number of bytes of any supported flash memory. */
-#define FL_MAX_CHIPOFF_BITS (24)
+#define FL_MAX_CHIPOFF_BITS (32)
 #define FL_MAX_CHIPOFF ((chipoff_t)(1ULL<<FL_MAX_CHIPOFF_BITS)-1)
 #define PRIxCHIPOFF "06"PRIx32
 #define PRIuCHIPSIZE PRIu32
@@ -81,7 +81,8 @@ enum chipbustype {
  */
 enum write_granularity {
 	/* We assume 256 byte granularity by default. */
-	write_gran_256bytes = 0,/* If less than 256 bytes are written, the unwritten bytes are undefined. */
+	write_gran_256bytes = 0,/* If less than 256 bytes are written, the unwritten bytes are undefined
+				 * (unless the chip has FEATURE_PARTIAL_PAGE). */
 	write_gran_1bit,	/* Each bit can be cleared individually. */
 	write_gran_1byte,	/* A byte can be written once. Further writes to an already written byte cause
 				 * its contents to be either undefined or to stay unchanged. */
@@ -123,6 +124,24 @@ enum write_granularity {
 #define FEATURE_WRSR_EITHER	(FEATURE_WRSR_EWSR | FEATURE_WRSR_WREN)
 #define FEATURE_OTP		(1 << 8)
 #define FEATURE_QPI		(1 << 9)
+#define FEATURE_FAST_READ	(1 << 10)	/* 0x0B */
+#define FEATURE_FAST_READ_DOUT	(1 << 11)	/* 0x3B, 1-1-2 */
+#define FEATURE_FAST_READ_QOUT	(1 << 12)	/* 0x6B, 1-1-4 */
+#define FEATURE_FAST_READ_QIO	(1 << 13)	/* 0xEB, 1-4-4 */
+/* Location of the Quad Enable bit. Quad reads are only used if it is known and set. */
+#define FEATURE_QE_SR1_6	(1 << 14)
+#define FEATURE_QE_SR2_1	(1 << 15)
+/* 4-byte addressing of chips larger than 16 MB, see spi_prepare_4ba() */
+#define FEATURE_4BA_ENTER	(1 << 16)	/* EN4B (0xB7) makes all commands take 4-byte addresses */
+#define FEATURE_4BA_ENTER_WREN	(1 << 17)	/* Like FEATURE_4BA_ENTER but EN4B needs WREN first */
+#define FEATURE_4BA_NATIVE	(1 << 18)	/* 4-byte address variants of all supported read, program and
+						 * erase commands exist (0x13, 0x0C, 0x12, 0x21, 0xDC etc.) */
+/* Chips which record whether the last erase failed, checked after every erase, see spi_check_erase_fail() */
+#define FEATURE_ERASE_FAIL_SCUR	(1 << 19)	/* E_FAIL in the security register (RDSCUR 0x2B, Macronix) */
+#define FEATURE_ERASE_FAIL_FSR	(1 << 20)	/* Erase error in the flag status register (0x70, Micron) */
+#define FEATURE_ERASE_FAIL	(FEATURE_ERASE_FAIL_SCUR | FEATURE_ERASE_FAIL_FSR)
+#define FEATURE_PARTIAL_PAGE	(1 << 21)	/* Page program leaves bytes of the page that are not sent unchanged,
+						 * despite write_gran_256bytes. Only set if the datasheet says so. */
 
 enum test_state {
 	OK = 0,
@@ -144,6 +163,17 @@ enum test_state {
 #define TEST_BAD_PRE	(struct tested){ .probe = BAD, .read = BAD, .erase = BAD, .write = NT }
 #define TEST_BAD_PREW	(struct tested){ .probe = BAD, .read = BAD, .erase = BAD, .write = BAD }
 
+/* Self-timed operations whose duration is listed in the datasheets, see struct flashchip's timing member. */
+enum op_timing_type {
+	OP_TIMING_BP,	/* tBP: byte program */
+	OP_TIMING_PP,	/* tPP: page program */
+	OP_TIMING_SE,	/* tSE: sector erase (usually 4 kB) */
+	OP_TIMING_BE32,	/* tBE1: 32 kB block erase */
+	OP_TIMING_BE64,	/* tBE2: 64 kB block erase */
+	OP_TIMING_CE,	/* tCE: chip erase */
+	NUM_OP_TIMINGS
+};
+
 struct flashctx;
 typedef int (erasefunc_t)(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
 
@@ -208,6 +238,19 @@ struct flashchip {
 		uint16_t max;
 	} voltage;
 	enum write_granularity gran;
+
+	/* Typical and maximum duration of self-timed operations in microseconds, 0 if unknown.
+	 * Used to avoid needless status register polling while the chip is busy. */
+	struct op_timing {
+		unsigned int typ;
+		unsigned int max;
+	} timing[NUM_OP_TIMINGS];
+};
+
+/* A contiguous range of chip addresses. */
+struct flash_range {
+	chipoff_t start;
+	chipsize_t len;
 };
 
 struct flashctx {
@@ -222,6 +265,21 @@ struct flashctx {
 	uintptr_t physical_registers;
 	chipaddr virtual_registers;
 	struct registered_master *mst;
+	/* Read command picked by spi_nbyte_read() for this chip and master, 0 if not yet selected. */
+	uint8_t spi_read_opcode;
+	/* True if the chip was switched to 4-byte addresses with EN4B. */
+	bool in_4ba_mode;
+	/* Ranges erased or written by erase_and_write_flash(). Only these need to be verified afterwards. */
+	struct flash_range *dirty;
+	unsigned int num_dirty;
+	unsigned int max_dirty;
+	/* Checksums of the old contents of each ORIG_SUM_UNIT bytes, taken before erase_and_write_flash() first
+	 * touched them. 0 for untouched units. Used to tell whether a failed write changed anything. */
+	uint64_t *orig_sums;
+	/* If not NULL, the sorted ranges of the chip whose old contents were read before writing. Everything
+	 * else is left alone by erase_and_write_flash(). */
+	struct flash_range *known;
+	unsigned int num_known;
 };
 
 /* Timing used in probe routines. ZERO is -2 to differentiate between an unset
@@ -250,6 +308,16 @@ void chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr,
 int print_supported(void);
 void print_supported_wiki(void);
 
+/* bufcmp.c */
+size_t buf_first_diff(const uint8_t *a, const uint8_t *b, size_t len);
+size_t buf_first_not_ff(const uint8_t *buf, size_t len);
+size_t buf_first_unprogrammable(const uint8_t *have, const uint8_t *want, size_t len);
+size_t buf_count_diff(const uint8_t *a, const uint8_t *b, size_t len);
+size_t buf_count_not_ff(const uint8_t *buf, size_t len);
+const char *bufcmp_impl(void);
+const char *bufcmp_impl_name(unsigned int i);
+int bufcmp_select_impl(const char *name);
+
 /* helpers.c */
 uint32_t address_to_bits(uint32_t addr);
 int bitcount(unsigned long a);
@@ -267,6 +335,7 @@ size_t strnlen(const char *str, size_t n);
 /* flashrom.c */
 extern const char flashrom_version[];
 extern const char *chip_to_probe;
+extern unsigned long read_window;
 int map_flash(struct flashctx *flash);
 void unmap_flash(struct flashctx *flash);
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
@@ -281,6 +350,21 @@ void print_buildinfo(void);
 void print_banner(void);
 void list_programmers_linebreak(int startcol, int cols, int paren);
 int selfcheck(void);
+/* Values of the verify_it argument of doit(). */
+enum verify_mode {
+	VERIFY_OFF = 0,
+	VERIFY_WRITTEN,	/* After writing, re-read only the ranges which were erased or written. */
+	VERIFY_FULL,	/* Always compare the whole chip. */
+};
+/* How erased blocks are checked before they are written. */
+enum erase_verify {
+	ERASE_VERIFY_AUTO = 0,	/* STATUS on chips which report failed erases, FULL otherwise. */
+	ERASE_VERIFY_FULL,	/* Read back every erased block right away. */
+	ERASE_VERIFY_DEFERRED,	/* Check erased blocks together with the data written to them at the end. */
+	ERASE_VERIFY_STATUS,	/* Trust the chip: WIP and, if it has one, its erase failure flag. */
+	ERASE_VERIFY_SAMPLED,	/* Read back a part of every erased block right away. */
+};
+extern enum erase_verify erase_verify;
 int doit(struct flashctx *flash, int force, const char *filename, int read_it, int write_it, int erase_it, int verify_it);
 int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename);
 int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename);
@@ -305,6 +389,8 @@ void print_chip_support_status(const struct flashchip *chip);
 /* cli_output.c */
 extern int verbose_screen;
 extern int verbose_logfile;
+void set_msg_prefix(const char *prefix);
+void set_msg_stderr_only(bool stderr_only);
 #ifndef STANDALONE
 int open_logfile(const char * const filename);
 int close_logfile(void);
@@ -348,20 +434,83 @@ __attribute__((format(printf, 2, 3)));
 int register_include_arg(char *name);
 int process_include_args(void);
 int read_romlayout(const char *name);
+int read_ifd_layout(struct flashctx *flash, const char *filename, bool internal);
+int read_fmap_layout(struct flashctx *flash, const char *filename);
 int normalize_romentries(const struct flashctx *flash);
 int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents);
+int get_included_ranges(struct flash_range **ranges);
 void layout_cleanup(void);
 
 /* spi.c */
+/* Bus width of the transfer phases of a command, named after the opcode-address-data convention. */
+enum spi_io_mode {
+	SPI_IO_SINGLE = 0,	/* 1-1-1 */
+	SPI_IO_DUAL_OUT,	/* 1-1-2: data is read on 2 lines */
+	SPI_IO_QUAD_OUT,	/* 1-1-4: data is read on 4 lines */
+	SPI_IO_QUAD_IO,		/* 1-4-4: everything after the opcode is transferred on 4 lines */
+};
 struct spi_command {
 	unsigned int writecnt;
 	unsigned int readcnt;
 	const unsigned char *writearr;
 	unsigned char *readarr;
+	enum spi_io_mode io_mode;
 };
 int spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
 uint32_t spi_get_valid_read_addr(struct flashctx *flash);
 
+/* spi25.c */
+int spi_prepare_4ba(struct flashctx *flash);
+/* A page program queued by spi_write_batched(). */
+struct spi_batch_page {
+	unsigned int start;	/* Chip address of the first data byte. */
+	unsigned int len;	/* Number of data bytes. */
+	unsigned int wait_us;	/* Time to let the program run before the status is read. */
+	unsigned int cmdlen;	/* Length of the page program command in cmd, opcode and address included. */
+	uint8_t cmd[5 + 256];
+	uint8_t wel_status;	/* Set by the master: status register read right after WREN. */
+	uint8_t status;		/* Set by the master: last status register read after wait_us. */
+};
+/*
+ * Sends WREN, a status register read into wel_status, the page program, a pause of wait_us and a status
+ * register read into status for each of the first pages in @pages, all in as few transactions as possible.
+ * Returns the number of pages sent (at least 1 if @count is not 0) or a negative number upon errors.
+ */
+typedef int (spi_batch_send_func_t)(struct flashctx *flash, struct spi_batch_page *pages, unsigned int count);
+int spi_write_batched(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+		      unsigned int max_pages, spi_batch_send_func_t *send);
+
+/* stats.c */
+enum stats_phase {
+	STATS_PHASE_NONE,
+	STATS_PHASE_PROBE,
+	STATS_PHASE_READ,
+	STATS_PHASE_ERASE,
+	STATS_PHASE_WRITE,
+	STATS_PHASE_VERIFY,
+	NUM_STATS_PHASES
+};
+enum stats_op {
+	STATS_OP_READ,
+	STATS_OP_ERASE,
+	STATS_OP_WRITE,
+	NUM_STATS_OPS
+};
+void stats_enable(void);
+uint64_t stats_now(void);
+void stats_phase(enum stats_phase phase);
+void stats_op(enum stats_op op, unsigned int addr, unsigned int len, uint64_t start);
+uint64_t stats_spi_begin(void);
+void stats_spi_command_end(uint64_t start, unsigned int writecnt, unsigned int readcnt,
+			   const unsigned char *writearr);
+void stats_spi_multicommand_end(uint64_t start, const struct spi_command *cmds);
+void stats_usb_transfer(void);
+void stats_delay(unsigned int usecs);
+void stats_modeled_time(uint64_t ns);
+void stats_wip(enum op_timing_type op, unsigned int polls, unsigned long waited);
+void stats_print_wip(void);
+int stats_write_json(const char *filename, const char *chip);
+
 enum chipbustype get_buses_supported(void);
 #endif				/* !__FLASH_H__ */
@@ -38,9 +38,21 @@
 #endif
 #include "flash.h"
 #include "flashchips.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "hwaccess.h"
 
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if IS_WINDOWS
+#include <io.h>
+#endif
+
 const char flashrom_version[] = FLASHROM_VERSION;
 const char *chip_to_probe = NULL;
 
@@ -56,6 +68,15 @@ struct decode_sizes max_rom_decode;
 /* If nonzero, used as the start address of bottom-aligned flash. */
 unsigned long flashbase;
 
+/* If nonzero, -r streams the chip in windows of this many bytes instead of reading it in one go. */
+unsigned long read_window = 0;
+#define DEFAULT_READ_WINDOW	(1024 * 1024)
+
+/* How erased blocks are checked, see --erase-verify. */
+enum erase_verify erase_verify = ERASE_VERIFY_AUTO;
+/* The policy in effect for the current operation, resolved by doit(). */
+static enum erase_verify erase_check = ERASE_VERIFY_FULL;
+
 /* Is writing allowed with this programmer? */
 int programmer_may_write;
 
@@ -81,7 +102,7 @@ const struct programmer_entry programmer_table[] = {
 		.init			= dummy_init,
 		.map_flash_region	= dummy_map,
 		.unmap_flash_region	= dummy_unmap,
-		.delay			= internal_delay,
+		.delay			= dummy_delay,
 	},
 #endif
 
@@ -581,6 +602,7 @@ void programmer_delay(unsigned int usecs)
 {
 	if (usecs > 0)
 		programmer_table[programmer].delay(usecs);
+	stats_delay(usecs);
 }
 
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start,
@@ -670,52 +692,44 @@ static unsigned int count_usable_erasers(const struct flashctx *flash)
 	return usable_erasefunctions;
 }
 
-static int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int start, unsigned int len)
+/* Read from the chip and account the read in the session statistics. */
+static int read_flash(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
 {
-	int ret = 0, failcount = 0;
-	unsigned int i;
-	for (i = 0; i < len; i++) {
-		if (wantbuf[i] != havebuf[i]) {
-			/* Only print the first failure. */
-			if (!failcount++)
-				msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x,",
-					 start + i, wantbuf[i], havebuf[i]);
-		}
-	}
-	if (failcount) {
-		msg_cerr(" failed byte count from 0x%08x-0x%08x: 0x%x\n",
-			 start, start + len - 1, failcount);
-		ret = -1;
-	}
+	const uint64_t t = stats_now();
+	const int ret = flash->chip->read(flash, buf, start, len);
+
+	stats_op(STATS_OP_READ, start, len, t);
 	return ret;
 }
 
-/* start is an offset to the base address of the flash chip */
-int check_erased_range(struct flashctx *flash, unsigned int start,
-		       unsigned int len)
+static int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int start, unsigned int len)
 {
-	int ret;
-	uint8_t *cmpbuf = malloc(len);
+	const unsigned int first = buf_first_diff(wantbuf, havebuf, len);
 
-	if (!cmpbuf) {
-		msg_gerr("Could not allocate memory!\n");
-		exit(1);
-	}
-	memset(cmpbuf, 0xff, len);
-	ret = verify_range(flash, cmpbuf, start, len);
-	free(cmpbuf);
-	return ret;
+	if (first == len)
+		return 0;
+	/* Only print the first failure. */
+	msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x,", start + first, wantbuf[first], havebuf[first]);
+	msg_cerr(" failed byte count from 0x%08x-0x%08x: 0x%x\n", start, start + len - 1,
+		 (unsigned int)buf_count_diff(wantbuf + first, havebuf + first, len - first));
+	return -1;
 }
 
+/* Chunk size for reading back the chip during verification. */
+#define VERIFY_CHUNK	(1024 * 1024)
+
 /*
- * @cmpbuf	buffer to compare against, cmpbuf[0] is expected to match the
- *		flash content at location start
- * @start	offset to the base address of the flash chip
- * @len		length of the verified area
- * @return	0 for success, -1 for failure
+ * Compare start..start+len-1 of the chip with @cmpbuf, or with the erased state if @cmpbuf is NULL. The chip is
+ * read back in chunks so that verifying a large range does not need another buffer of its size.
+ * Returns 0 if everything matches, -1 otherwise.
  */
-int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start, unsigned int len)
+static int verify_chip_range(struct flashctx *flash, const char *func, const uint8_t *cmpbuf, unsigned int start,
+			     unsigned int len)
 {
+	unsigned int off, chunk, first;
+	unsigned long failcount = 0;
+	int ret = 0;
+
 	if (!len)
 		return -1;
 
@@ -724,48 +738,123 @@ int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int sta
 		return -1;
 	}
 
-	uint8_t *readbuf = malloc(len);
+	if (start + len > flash->chip->total_size * 1024) {
+		msg_gerr("Error: %s called with start 0x%x + len 0x%x >"
+			" total_size 0x%x\n", func, start, len,
+			flash->chip->total_size * 1024);
+		return -1;
+	}
+
+	uint8_t *readbuf = malloc(min(len, VERIFY_CHUNK));
 	if (!readbuf) {
 		msg_gerr("Could not allocate memory!\n");
 		return -1;
 	}
-	int ret = 0;
 
-	if (start + len > flash->chip->total_size * 1024) {
-		msg_gerr("Error: %s called with start 0x%x + len 0x%x >"
-			" total_size 0x%x\n", __func__, start, len,
-			flash->chip->total_size * 1024);
-		ret = -1;
-		goto out_free;
+	for (off = 0; off < len; off += chunk) {
+		chunk = min(len - off, VERIFY_CHUNK);
+		if (read_flash(flash, readbuf, start + off, chunk)) {
+			msg_gerr("Verification impossible because read failed "
+				 "at 0x%x (len 0x%x)\n", start + off, chunk);
+			ret = -1;
+			goto out_free;
+		}
+		if (cmpbuf)
+			first = buf_first_diff(cmpbuf + off, readbuf, chunk);
+		else
+			first = buf_first_not_ff(readbuf, chunk);
+		if (first == chunk)
+			continue;
+		/* Only print the first failure. */
+		if (!failcount)
+			msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x,", start + off + first,
+				 cmpbuf ? cmpbuf[off + first] : 0xff, readbuf[first]);
+		if (cmpbuf)
+			failcount += buf_count_diff(cmpbuf + off + first, readbuf + first, chunk - first);
+		else
+			failcount += buf_count_not_ff(readbuf + first, chunk - first);
 	}
-
-	ret = flash->chip->read(flash, readbuf, start, len);
-	if (ret) {
-		msg_gerr("Verification impossible because read failed "
-			 "at 0x%x (len 0x%x)\n", start, len);
+	if (failcount) {
+		msg_cerr(" failed byte count from 0x%08x-0x%08x: 0x%lx\n", start, start + len - 1, failcount);
 		ret = -1;
-		goto out_free;
 	}
-
-	ret = compare_range(cmpbuf, readbuf, start, len);
 out_free:
 	free(readbuf);
 	return ret;
 }
 
+/* start is an offset to the base address of the flash chip */
+int check_erased_range(struct flashctx *flash, unsigned int start,
+		       unsigned int len)
+{
+	return verify_chip_range(flash, __func__, NULL, start, len);
+}
+
+#define ERASE_SAMPLE_SIZE	256
+#define ERASE_SAMPLE_STRIDE	(4 * 1024)
+
+/*
+ * Check one ERASE_SAMPLE_SIZE chunk out of every ERASE_SAMPLE_STRIDE bytes of an erased block. The position of
+ * the chunk moves with the address, so neighbouring blocks are not all sampled at the same offset.
+ */
+static int check_erased_sampled(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	unsigned int off, chunk, slots;
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = min(len - off, ERASE_SAMPLE_STRIDE);
+		slots = chunk / ERASE_SAMPLE_SIZE;
+		if (slots <= 1) {
+			if (check_erased_range(flash, start + off, chunk))
+				return -1;
+			continue;
+		}
+		if (check_erased_range(flash, start + off + (start + off) / ERASE_SAMPLE_STRIDE * 7 % slots *
+				       ERASE_SAMPLE_SIZE, ERASE_SAMPLE_SIZE))
+			return -1;
+	}
+	return 0;
+}
+
+/* Check an erased block as the erase verification policy of the current operation demands. */
+static int check_erased_block(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	switch (erase_check) {
+	case ERASE_VERIFY_DEFERRED:
+	case ERASE_VERIFY_STATUS:
+		/* Failures the chip reports were already returned by the erase function. */
+		return 0;
+	case ERASE_VERIFY_SAMPLED:
+		return check_erased_sampled(flash, start, len);
+	default:
+		return check_erased_range(flash, start, len);
+	}
+}
+
+/*
+ * @cmpbuf	buffer to compare against, cmpbuf[0] is expected to match the
+ *		flash content at location start
+ * @start	offset to the base address of the flash chip
+ * @len		length of the verified area
+ * @return	0 for success, -1 for failure
+ */
+int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start, unsigned int len)
+{
+	return verify_chip_range(flash, __func__, cmpbuf, start, len);
+}
+
 /* Helper function for need_erase() that focuses on granularities of gran bytes. */
 static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int gran)
 {
-	unsigned int i, j, limit;
+	unsigned int j, limit;
 	for (j = 0; j < len / gran; j++) {
 		limit = min (gran, len - j * gran);
 		/* Are 'have' and 'want' identical? */
-		if (!memcmp(have + j * gran, want + j * gran, limit))
+		if (buf_first_diff(have + j * gran, want + j * gran, limit) == limit)
 			continue;
 		/* have needs to be in erased state. */
-		for (i = 0; i < limit; i++)
-			if (have[j * gran + i] != 0xff)
-				return 1;
+		if (buf_first_not_ff(have + j * gran, limit) < limit)
+			return 1;
 	}
 	return 0;
 }
@@ -791,18 +880,17 @@ int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum
 
 	switch (gran) {
 	case write_gran_1bit:
-		for (i = 0; i < len; i++)
-			if ((have[i] & want[i]) != want[i]) {
-				result = 1;
-				break;
-			}
+		result = buf_first_unprogrammable(have, want, len) < len;
 		break;
 	case write_gran_1byte:
-		for (i = 0; i < len; i++)
-			if ((have[i] != want[i]) && (have[i] != 0xff)) {
+		/* Every byte that changes has to be erased. */
+		for (i = buf_first_diff(have, want, len); i < len; i += buf_first_diff(have + i, want + i, len - i)) {
+			if (have[i] != 0xff) {
 				result = 1;
 				break;
 			}
+			i++;
+		}
 		break;
 	case write_gran_128bytes:
 		result = need_erase_gran_bytes(have, want, len, 128);
@@ -902,10 +990,11 @@ static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, uns
 		 */
 		return 0;
 	}
-	for (i = 0; i < len / stride; i++) {
+	/* Skip all identical units in one go, then extend the write up to the next identical unit. */
+	for (i = buf_first_diff(have, want, len) / stride; i < len / stride; i++) {
 		limit = min(stride, len - i * stride);
 		/* Are 'have' and 'want' identical? */
-		if (memcmp(have + i * stride, want + i * stride, limit)) {
+		if (buf_first_diff(have + i * stride, want + i * stride, limit) != limit) {
 			if (!need_write) {
 				/* First location where have and want differ. */
 				need_write = 1;
@@ -1166,12 +1255,19 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 	enum chipbustype buses_common;
 	char *tmp;
 
+	/* Each ID command is sent to a master only once. A new probe sequence starts with startchip 0. */
+	if (startchip == 0)
+		spi_clear_id_cache();
+
 	for (chip = flashchips + startchip; chip && chip->name; chip++) {
 		if (chip_to_probe && strcmp(chip->name, chip_to_probe) != 0)
 			continue;
 		buses_common = mst->buses_supported & chip->bustype;
 		if (!buses_common)
 			continue;
+		/* Skip chips whose IDs don't match the responses already read from this master. */
+		if (!force && spi_id_cache_excludes(chip))
+			continue;
 		msg_gdbg("Probing for %s %s, %d kB: ", chip->vendor, chip->name, chip->total_size);
 		if (!chip->probe && !force) {
 			msg_gdbg("failed! flashrom has no probe function for this flash chip.\n");
@@ -1186,6 +1282,13 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 		}
 		memcpy(flash->chip, chip, sizeof(struct flashchip));
 		flash->mst = mst;
+		flash->spi_read_opcode = 0;
+		flash->in_4ba_mode = false;
+		flash->dirty = NULL;
+		flash->num_dirty = 0;
+		flash->max_dirty = 0;
+		flash->known = NULL;
+		flash->num_known = 0;
 
 		if (map_flash(flash) != 0)
 			return -1;
@@ -1363,32 +1466,390 @@ out:
 #endif
 }
 
+/*
+ * A chip-sized image. Input images are read into memory, a mapping could change under us if the file is
+ * modified or truncated while we write. Output images are a shared mapping of a temporary file next to the
+ * target if possible, which is filled in place and renamed over the target once complete.
+ */
+struct image_buf {
+	uint8_t *buf;
+	unsigned long size;
+	bool mapped;
+	FILE *file;		/* The temporary output file behind a mapped output image. */
+	char *tmpname;
+};
+
+/* Load @filename which has to be exactly @size bytes long into @img. */
+static int load_image(struct image_buf *img, unsigned long size, const char *filename)
+{
+	img->size = size;
+	img->mapped = false;
+	img->tmpname = NULL;
+	img->buf = malloc(size);
+	if (!img->buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	return read_buf_from_file(img->buf, size, filename);
+}
+
+#if HAVE_MMAP
+/*
+ * Create a temporary file next to @filename for a new image that replaces @filename once it is complete, see
+ * finish_tmp_image(). It gets the permissions of an existing @filename, or those a new file would get.
+ * Returns NULL (with *tmpname set to NULL) if @filename is not a regular file or the temporary file can not
+ * be created. Callers then write @filename directly.
+ */
+static FILE *open_tmp_image(const char *filename, char **tmpname)
+{
+	struct stat image_stat;
+	FILE *image;
+	mode_t mode;
+	int fd;
+
+	*tmpname = NULL;
+	if (!lstat(filename, &image_stat)) {
+		/* Pipes, devices and symlinks are written directly. */
+		if (!S_ISREG(image_stat.st_mode))
+			return NULL;
+		mode = image_stat.st_mode & 07777;
+	} else {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	}
+	*tmpname = malloc(strlen(filename) + sizeof(".XXXXXX"));
+	if (!*tmpname) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	sprintf(*tmpname, "%s.XXXXXX", filename);
+	fd = mkstemp(*tmpname);
+	if (fd >= 0) {
+		if (!fchmod(fd, mode)) {
+			image = fdopen(fd, "w+b");
+			if (image)
+				return image;
+		}
+		close(fd);
+		unlink(*tmpname);
+	}
+	msg_gwarn("Warning: Creating a temporary file next to \"%s\" failed (%s), writing it directly.\n"
+		  "A failed read will leave it incomplete.\n", filename, strerror(errno));
+	free(*tmpname);
+	*tmpname = NULL;
+	return NULL;
+}
+
+/* Close an image opened by open_tmp_image() and rename it over @filename if @ok is set, otherwise remove it. */
+static int finish_tmp_image(FILE *image, const char *filename, char *tmpname, bool ok)
+{
+	int ret = 0;
+
+	if (ok && fflush(image)) {
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", tmpname, strerror(errno));
+		ret = 1;
+	}
+	if (ok && !ret && fsync(fileno(image))) {
+		msg_gerr("Error: fsyncing file \"%s\" failed: %s\n", tmpname, strerror(errno));
+		ret = 1;
+	}
+	if (fclose(image)) {
+		msg_gerr("Error: closing file \"%s\" failed: %s\n", tmpname, strerror(errno));
+		ret = 1;
+	}
+	if (ok && !ret && rename(tmpname, filename)) {
+		msg_gerr("Error: renaming \"%s\" to \"%s\" failed: %s\n", tmpname, filename, strerror(errno));
+		ret = 1;
+	}
+	/* Do not leave incomplete images behind. */
+	if (!ok || ret)
+		unlink(tmpname);
+	free(tmpname);
+	return ok ? ret : 1;
+}
+#endif
+
+/* Set up @img to be filled with @size bytes which finish_image() will store in @filename. */
+static int create_image(struct image_buf *img, unsigned long size, const char *filename)
+{
+	img->size = size;
+	img->mapped = false;
+	img->tmpname = NULL;
+	if (!filename) {
+		msg_gerr("No filename specified.\n");
+		return 1;
+	}
+#if HAVE_MMAP
+	img->file = open_tmp_image(filename, &img->tmpname);
+	if (img->file) {
+		if (!ftruncate(fileno(img->file), size)) {
+			img->buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(img->file), 0);
+			if (img->buf != MAP_FAILED) {
+				img->mapped = true;
+				return 0;
+			}
+		}
+		msg_gwarn("Warning: Mapping \"%s\" failed (%s), writing \"%s\" directly.\n"
+			  "A failed read will leave it incomplete.\n", img->tmpname, strerror(errno), filename);
+		finish_tmp_image(img->file, filename, img->tmpname, false);
+		img->tmpname = NULL;
+	}
+#endif
+	img->buf = calloc(size, sizeof(char));
+	if (!img->buf) {
+		msg_gerr("Memory allocation failed!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Store an image set up by create_image() in @filename if @ok is set. Returns 0 on success. */
+static int finish_image(struct image_buf *img, const char *filename, bool ok)
+{
+	int ret = 0;
+
+	if (!img->mapped) {
+		if (ok)
+			ret = write_buf_to_file(img->buf, img->size, filename);
+		free(img->buf);
+		return ok ? ret : 1;
+	}
+#if HAVE_MMAP
+	if (ok && msync(img->buf, img->size, MS_SYNC)) {
+		msg_gerr("Error: writing file \"%s\" failed: %s\n", img->tmpname, strerror(errno));
+		ret = 1;
+	}
+	munmap(img->buf, img->size);
+	ret = finish_tmp_image(img->file, filename, img->tmpname, ok && !ret);
+#endif
+	return ret;
+}
+
+static void free_image(struct image_buf *img)
+{
+	if (!img->buf)
+		return;
+#if HAVE_MMAP
+	if (img->mapped)
+		munmap(img->buf, img->size);
+	else
+#endif
+		free(img->buf);
+	img->buf = NULL;
+}
+
+#ifndef __LIBPAYLOAD__
+/*
+ * State shared between read_flash_to_stream() and its writer thread. Windows alternate between the two
+ * buffers: while one is written out, the next one is read from the chip into the other.
+ */
+struct image_stream {
+	FILE *out;
+	uint8_t *buf[2];
+	unsigned long len[2];	/* Bytes queued for writing from buf[i], 0 if the buffer is free. */
+	int error;		/* errno of the first failed write, 0 if none. */
+	bool done;		/* Nothing else will be queued. */
+#if HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+/* Returns 0 or the errno of the failed write. */
+static int stream_write(struct image_stream *stream, int slot)
+{
+	if (fwrite(stream->buf[slot], 1, stream->len[slot], stream->out) != stream->len[slot])
+		return errno ? errno : EIO;
+	return 0;
+}
+
+#if HAVE_PTHREAD
+/* The writer thread must not print anything, errors are reported by the reading side. */
+static void *stream_writer(void *arg)
+{
+	struct image_stream *stream = arg;
+	int slot = 0, err;
+
+	pthread_mutex_lock(&stream->lock);
+	while (1) {
+		while (!stream->len[slot] && !stream->done)
+			pthread_cond_wait(&stream->cond, &stream->lock);
+		if (!stream->len[slot])
+			break;
+		err = stream->error;
+		pthread_mutex_unlock(&stream->lock);
+		/* After an error, queued windows are only dropped so that the reader never waits forever. */
+		if (!err)
+			err = stream_write(stream, slot);
+		pthread_mutex_lock(&stream->lock);
+		if (!stream->error)
+			stream->error = err;
+		stream->len[slot] = 0;
+		pthread_cond_broadcast(&stream->cond);
+		slot ^= 1;
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+#endif
+
+/*
+ * Read the chip in windows of @window bytes and write each one to @filename ("-" for stdout) while the next one
+ * is read. Memory use does not depend on the chip size, and the output can be a pipe.
+ */
+static int read_flash_to_stream(struct flashctx *flash, const char *filename, unsigned long window)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned long off, chunk;
+	struct image_stream stream = { .out = NULL };
+	char *tmpname = NULL;
+	int ret = 0, err = 0, slot = 0;
+
+	if (!strcmp(filename, "-")) {
+#if IS_WINDOWS
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		stream.out = stdout;
+	}
+#if HAVE_MMAP
+	if (!stream.out)
+		stream.out = open_tmp_image(filename, &tmpname);
+#endif
+	if (!stream.out) {
+		stream.out = fopen(filename, "wb");
+		if (!stream.out) {
+			msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+			return 1;
+		}
+	}
+	stream.buf[0] = malloc(window);
+	stream.buf[1] = malloc(window);
+	if (!stream.buf[0] || !stream.buf[1]) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	msg_cdbg("Streaming the chip in windows of %lu bytes.\n", window);
+
+#if HAVE_PTHREAD
+	pthread_t writer;
+	bool threaded;
+
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.cond, NULL);
+	threaded = !pthread_create(&writer, NULL, stream_writer, &stream);
+	if (!threaded)
+		msg_cdbg("Could not start the writer thread, writing synchronously.\n");
+#endif
+	for (off = 0; off < size; off += chunk, slot ^= 1) {
+		chunk = min(window, size - off);
+#if HAVE_PTHREAD
+		if (threaded) {
+			/* Wait until the writer is done with this buffer. */
+			pthread_mutex_lock(&stream.lock);
+			while (stream.len[slot] && !stream.error)
+				pthread_cond_wait(&stream.cond, &stream.lock);
+			err = stream.error;
+			pthread_mutex_unlock(&stream.lock);
+			if (err)
+				break;
+		}
+#endif
+		if (read_flash(flash, stream.buf[slot], off, chunk)) {
+			msg_cerr("Read operation failed at 0x%06lx!\n", off);
+			ret = 1;
+			break;
+		}
+#if HAVE_PTHREAD
+		if (threaded) {
+			pthread_mutex_lock(&stream.lock);
+			stream.len[slot] = chunk;
+			pthread_cond_broadcast(&stream.cond);
+			pthread_mutex_unlock(&stream.lock);
+			continue;
+		}
+#endif
+		stream.len[slot] = chunk;
+		err = stream_write(&stream, slot);
+		stream.len[slot] = 0;
+		if (err)
+			break;
+	}
+#if HAVE_PTHREAD
+	if (threaded) {
+		pthread_mutex_lock(&stream.lock);
+		stream.done = true;
+		pthread_cond_broadcast(&stream.cond);
+		pthread_mutex_unlock(&stream.lock);
+		pthread_join(writer, NULL);
+		err = stream.error;
+	}
+	pthread_cond_destroy(&stream.cond);
+	pthread_mutex_destroy(&stream.lock);
+#endif
+	free(stream.buf[0]);
+	free(stream.buf[1]);
+
+	if (err) {
+		msg_gerr("Error: file %s could not be written completely: %s\n", filename, strerror(err));
+		ret = 1;
+	}
+#if HAVE_MMAP
+	if (tmpname)
+		return finish_tmp_image(stream.out, filename, tmpname, !ret);
+#endif
+	if (stream.out == stdout) {
+		if (fflush(stdout) && !ret) {
+			msg_gerr("Error: writing to stdout failed: %s\n", strerror(errno));
+			ret = 1;
+		}
+	} else if (fclose(stream.out) && !ret) {
+		msg_gerr("Error: closing file \"%s\" failed: %s\n", filename, strerror(errno));
+		ret = 1;
+	}
+	return ret;
+}
+
+/* Returns true if -r has to stream the chip, i.e. if it was asked to or goes to a pipe, device or stdout. */
+static bool read_needs_stream(const char *filename)
+{
+	struct stat image_stat;
+
+	if (read_window || !strcmp(filename, "-"))
+		return true;
+	return !stat(filename, &image_stat) && !S_ISREG(image_stat.st_mode);
+}
+#endif
+
 int read_flash_to_file(struct flashctx *flash, const char *filename)
 {
 	unsigned long size = flash->chip->total_size * 1024;
-	unsigned char *buf = calloc(size, sizeof(char));
+	struct image_buf img;
 	int ret = 0;
 
 	msg_cinfo("Reading flash... ");
-	if (!buf) {
-		msg_gerr("Memory allocation failed!\n");
+	if (!flash->chip->read) {
+		msg_cerr("No read function available for this flash chip.\n");
 		msg_cinfo("FAILED.\n");
 		return 1;
 	}
-	if (!flash->chip->read) {
-		msg_cerr("No read function available for this flash chip.\n");
-		ret = 1;
-		goto out_free;
+#ifndef __LIBPAYLOAD__
+	if (filename && read_needs_stream(filename)) {
+		ret = read_flash_to_stream(flash, filename, read_window ? read_window : DEFAULT_READ_WINDOW);
+		msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+		return ret;
+	}
+#endif
+	if (create_image(&img, size, filename)) {
+		msg_cinfo("FAILED.\n");
+		return 1;
 	}
-	if (flash->chip->read(flash, buf, 0, size)) {
+	if (read_flash(flash, img.buf, 0, size)) {
 		msg_cerr("Read operation failed!\n");
 		ret = 1;
-		goto out_free;
 	}
 
-	ret = write_buf_to_file(buf, size, filename);
-out_free:
-	free(buf);
+	ret = finish_image(&img, filename, !ret);
 	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
 	return ret;
 }
@@ -1459,100 +1920,9 @@ static int selfcheck_eraseblocks(const struct flashchip *chip)
 	return ret;
 }
 
-static int erase_and_write_block_helper(struct flashctx *flash,
-					unsigned int start, unsigned int len,
-					uint8_t *curcontents,
-					uint8_t *newcontents,
-					int (*erasefn) (struct flashctx *flash,
-							unsigned int addr,
-							unsigned int len))
+static int check_block_eraser(const struct flashctx *flash, int k, int log)
 {
-	unsigned int starthere = 0, lenhere = 0;
-	int ret = 0, skip = 1, writecount = 0;
-	enum write_granularity gran = flash->chip->gran;
-
-	/* curcontents and newcontents are opaque to walk_eraseregions, and
-	 * need to be adjusted here to keep the impression of proper abstraction
-	 */
-	curcontents += start;
-	newcontents += start;
-	msg_cdbg(":");
-	if (need_erase(curcontents, newcontents, len, gran)) {
-		msg_cdbg("E");
-		ret = erasefn(flash, start, len);
-		if (ret)
-			return ret;
-		if (check_erased_range(flash, start, len)) {
-			msg_cerr("ERASE FAILED!\n");
-			return -1;
-		}
-		/* Erase was successful. Adjust curcontents. */
-		memset(curcontents, 0xff, len);
-		skip = 0;
-	}
-	/* get_next_write() sets starthere to a new value after the call. */
-	while ((lenhere = get_next_write(curcontents + starthere,
-					 newcontents + starthere,
-					 len - starthere, &starthere, gran))) {
-		if (!writecount++)
-			msg_cdbg("W");
-		/* Needs the partial write function signature. */
-		ret = flash->chip->write(flash, newcontents + starthere,
-				   start + starthere, lenhere);
-		if (ret)
-			return ret;
-		starthere += lenhere;
-		skip = 0;
-	}
-	if (skip)
-		msg_cdbg("S");
-	else
-		all_skipped = false;
-	return ret;
-}
-
-static int walk_eraseregions(struct flashctx *flash, int erasefunction,
-			     int (*do_something) (struct flashctx *flash,
-						  unsigned int addr,
-						  unsigned int len,
-						  uint8_t *param1,
-						  uint8_t *param2,
-						  int (*erasefn) (
-							struct flashctx *flash,
-							unsigned int addr,
-							unsigned int len)),
-			     void *param1, void *param2)
-{
-	int i, j;
-	unsigned int start = 0;
-	unsigned int len;
-	struct block_eraser eraser = flash->chip->block_erasers[erasefunction];
-
-	for (i = 0; i < NUM_ERASEREGIONS; i++) {
-		/* count==0 for all automatically initialized array
-		 * members so the loop below won't be executed for them.
-		 */
-		len = eraser.eraseblocks[i].size;
-		for (j = 0; j < eraser.eraseblocks[i].count; j++) {
-			/* Print this for every block except the first one. */
-			if (i || j)
-				msg_cdbg(", ");
-			msg_cdbg("0x%06x-0x%06x", start,
-				     start + len - 1);
-			if (do_something(flash, start, len, param1, param2,
-					 eraser.block_erase)) {
-				return 1;
-			}
-			start += len;
-		}
-	}
-	msg_cdbg("\n");
-	return 0;
-}
-
-static int check_block_eraser(const struct flashctx *flash, int k, int log)
-{
-	struct block_eraser eraser = flash->chip->block_erasers[k];
+	struct block_eraser eraser = flash->chip->block_erasers[k];
 
 	if (!eraser.block_erase && !eraser.eraseblocks[0].count) {
 		if (log)
@@ -1575,38 +1945,626 @@ static int check_block_eraser(const struct flashctx *flash, int k, int log)
 	return 0;
 }
 
-int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t *newcontents)
+#define ORIG_SUM_UNIT	4096
+
+/* 64-bit FNV-1a with the lowest bit forced to 1 so that 0 can mark units which were never touched. */
+static uint64_t orig_sum(const uint8_t *buf, unsigned int len)
 {
-	int k, ret = 1;
-	uint8_t *curcontents;
-	unsigned long size = flash->chip->total_size * 1024;
-	unsigned int usable_erasefunctions = count_usable_erasers(flash);
+	uint64_t sum = 0xcbf29ce484222325ULL;
+	unsigned int i;
 
-	msg_cinfo("Erasing and writing flash chip... ");
-	curcontents = malloc(size);
-	if (!curcontents) {
+	for (i = 0; i < len; i++)
+		sum = (sum ^ buf[i]) * 0x100000001b3ULL;
+	return sum | 1;
+}
+
+/*
+ * Record that the range start..start+len-1 is about to be erased or written. @old points to its current
+ * contents inside a whole-chip buffer. The first time a unit is touched, a checksum of its old contents is
+ * kept, so no second copy of the old contents is needed.
+ */
+static void mark_dirty(struct flashctx *flash, const uint8_t *old, unsigned int start, unsigned int len)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	struct flash_range *last;
+	unsigned int u, ustart;
+
+	if (!flash->orig_sums) {
+		flash->orig_sums = calloc(size / ORIG_SUM_UNIT + 1, sizeof(*flash->orig_sums));
+		if (!flash->orig_sums) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+	}
+	for (u = start / ORIG_SUM_UNIT; u <= (start + len - 1) / ORIG_SUM_UNIT; u++) {
+		if (flash->orig_sums[u])
+			continue;
+		ustart = u * ORIG_SUM_UNIT;
+		/* @old - start is the beginning of the whole-chip buffer. */
+		flash->orig_sums[u] = orig_sum(old - start + ustart, min(ORIG_SUM_UNIT, size - ustart));
+	}
+
+	if (flash->num_dirty) {
+		/* Most ranges directly follow or overlap the previous one. */
+		last = &flash->dirty[flash->num_dirty - 1];
+		if (start >= last->start && start <= last->start + last->len) {
+			if (start + len > last->start + last->len)
+				last->len = start + len - last->start;
+			return;
+		}
+	}
+	if (flash->num_dirty == flash->max_dirty) {
+		unsigned int max_dirty = flash->max_dirty ? flash->max_dirty * 2 : 64;
+		struct flash_range *tmp = realloc(flash->dirty, max_dirty * sizeof(*tmp));
+
+		if (!tmp) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		flash->dirty = tmp;
+		flash->max_dirty = max_dirty;
+	}
+	flash->dirty[flash->num_dirty].start = start;
+	flash->dirty[flash->num_dirty].len = len;
+	flash->num_dirty++;
+}
+
+static void clear_dirty(struct flashctx *flash)
+{
+	free(flash->dirty);
+	flash->dirty = NULL;
+	flash->num_dirty = 0;
+	flash->max_dirty = 0;
+	free(flash->orig_sums);
+	flash->orig_sums = NULL;
+}
+
+/*
+ * After a failed erase_and_write_flash(), check whether the chip still holds its old contents. Only the units
+ * that were touched are read back and compared with their checksums. Returns 0 if nothing changed, 1 if
+ * something did and -1 if reading failed.
+ */
+static int orig_contents_changed(struct flashctx *flash)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	unsigned int u, ustart, ulen;
+	uint8_t *buf;
+	int ret = 0;
+
+	if (!flash->orig_sums)
+		return 0;
+	buf = malloc(ORIG_SUM_UNIT);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	for (u = 0; u * ORIG_SUM_UNIT < size; u++) {
+		if (!flash->orig_sums[u])
+			continue;
+		ustart = u * ORIG_SUM_UNIT;
+		ulen = min(ORIG_SUM_UNIT, size - ustart);
+		if (read_flash(flash, buf, ustart, ulen)) {
+			ret = -1;
+			break;
+		}
+		if (orig_sum(buf, ulen) != flash->orig_sums[u]) {
+			ret = 1;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+static int compare_flash_ranges(const void *a, const void *b)
+{
+	const struct flash_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/* Sort @ranges and merge overlapping or adjacent ones. Returns the new number of ranges. */
+static unsigned int merge_ranges(struct flash_range *ranges, unsigned int count)
+{
+	unsigned int i, n = 0;
+
+	if (!count)
+		return 0;
+	qsort(ranges, count, sizeof(*ranges), compare_flash_ranges);
+	for (i = 1; i < count; i++) {
+		struct flash_range *cur = &ranges[n];
+		const struct flash_range *next = &ranges[i];
+
+		if (next->start <= cur->start + cur->len) {
+			if (next->start + next->len > cur->start + cur->len)
+				cur->len = next->start + next->len - cur->start;
+		} else {
+			ranges[++n] = *next;
+		}
+	}
+	return n + 1;
+}
+
+/* Returns true if the old contents of start..start+len-1 are known. */
+static bool range_known(const struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	unsigned int i;
+
+	if (!flash->known)
+		return true;
+	for (i = 0; i < flash->num_known; i++) {
+		const struct flash_range *range = &flash->known[i];
+
+		if (start >= range->start && start + len <= range->start + range->len)
+			return true;
+	}
+	return false;
+}
+
+/* Compare the ranges touched by the last erase_and_write_flash() call with @cmpbuf. */
+static int verify_dirty_ranges(struct flashctx *flash, const uint8_t *cmpbuf)
+{
+	unsigned long total = 0;
+	unsigned int i;
+	int ret = 0;
+
+	flash->num_dirty = merge_ranges(flash->dirty, flash->num_dirty);
+	for (i = 0; i < flash->num_dirty; i++)
+		total += flash->dirty[i].len;
+	msg_cdbg("Verifying %u modified range%s (%lu bytes)... ", flash->num_dirty,
+		 flash->num_dirty == 1 ? "" : "s", total);
+	for (i = 0; i < flash->num_dirty; i++) {
+		const struct flash_range *range = &flash->dirty[i];
+
+		msg_cdbg2("0x%06x-0x%06x ", range->start, range->start + range->len - 1);
+		if (verify_range(flash, cmpbuf + range->start, range->start, range->len))
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Decide how erased blocks are checked. Reading them back is only skipped by default on chips which report
+ * failed erases themselves, which is as safe as the read-back.
+ */
+static enum erase_verify resolve_erase_verify(const struct flashctx *flash)
+{
+	const bool reports_failure = flash->chip->feature_bits & FEATURE_ERASE_FAIL;
+
+	switch (erase_verify) {
+	case ERASE_VERIFY_AUTO:
+		return reports_failure ? ERASE_VERIFY_STATUS : ERASE_VERIFY_FULL;
+	case ERASE_VERIFY_STATUS:
+		if (!reports_failure)
+			msg_cwarn("Warning: This chip can not report failed erases, erased blocks are not checked.\n");
+		/* fall through */
+	default:
+		return erase_verify;
+	}
+}
+
+/*
+ * The erase planner arranges all usable erase functions of a chip in layers, finest first. Every block of a
+ * layer covers a contiguous run of blocks of the layer below, so the layers form a tree with the coarsest
+ * eraser (usually chip erase) at its root. For each block the planner decides whether erasing it as a whole
+ * is cheaper than handling the blocks below it individually, based on the difference between the current
+ * and the desired contents.
+ */
+struct erase_block {
+	unsigned int start;
+	unsigned int len;
+	unsigned int first_sub;	/* Index of the first covered block in the layer below. */
+	unsigned int num_sub;	/* Number of covered blocks in the layer below. */
+	bool need_erase;	/* At least some part of the block can not be written without erasing. */
+	unsigned long nonff;	/* Number of bytes in the desired contents which are not 0xff. */
+	uint64_t cost;		/* Cheapest estimated erase+write time in microseconds. */
+	bool selected;		/* Erase the whole block with the eraser of its layer. */
+};
+
+struct erase_layer {
+	int eraser;		/* Index into flash->chip->block_erasers[]. */
+	unsigned int block_count;
+	struct erase_block *blocks;
+};
+
+/* Rough timing model of NOR flash used to compare erase plans: every erase has a fixed setup cost plus a
+ * size-dependent part, and programming is proportional to the number of bytes sent to the chip. */
+#define ERASE_COST_BASE_US	40000
+#define ERASE_COST_PER_KB_US	2000
+#define PROGRAM_COST_PER_KB_US	3000
+
+static uint64_t erase_cost(unsigned int len)
+{
+	return ERASE_COST_BASE_US + (uint64_t)len * ERASE_COST_PER_KB_US / 1024;
+}
+
+static uint64_t program_cost(unsigned long len)
+{
+	return (uint64_t)len * PROGRAM_COST_PER_KB_US / 1024;
+}
+
+static void free_erase_layers(struct erase_layer *layers, int num_layers)
+{
+	int i;
+
+	for (i = 0; i < num_layers; i++)
+		free(layers[i].blocks);
+}
+
+/* Fill in the blocks of eraser k. */
+static void fill_erase_layer(const struct flashctx *flash, int k, struct erase_layer *layer)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, count = 0, start = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++)
+		count += eraser->eraseblocks[i].count;
+	layer->blocks = calloc(count, sizeof(struct erase_block));
+	if (!layer->blocks) {
 		msg_gerr("Out of memory!\n");
 		exit(1);
 	}
-	/* Copy oldcontents to curcontents to avoid clobbering oldcontents. */
-	memcpy(curcontents, oldcontents, size);
+	layer->eraser = k;
+	layer->block_count = count;
+	count = 0;
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		for (j = 0; j < eraser->eraseblocks[i].count; j++) {
+			layer->blocks[count].start = start;
+			layer->blocks[count].len = eraser->eraseblocks[i].size;
+			start += eraser->eraseblocks[i].size;
+			count++;
+		}
+	}
+}
+
+/* Link the blocks of @upper to the blocks of @lower they cover. Returns 0 if every block boundary of @upper
+ * is also a block boundary of @lower, 1 otherwise. */
+static int link_erase_layers(const struct erase_layer *lower, struct erase_layer *upper)
+{
+	unsigned int i, j = 0;
+
+	for (i = 0; i < upper->block_count; i++) {
+		struct erase_block *block = &upper->blocks[i];
+		unsigned int end = block->start + block->len;
+
+		if (j >= lower->block_count || lower->blocks[j].start != block->start)
+			return 1;
+		block->first_sub = j;
+		while (j < lower->block_count && lower->blocks[j].start + lower->blocks[j].len <= end)
+			j++;
+		block->num_sub = j - block->first_sub;
+		if (!block->num_sub || lower->blocks[j - 1].start + lower->blocks[j - 1].len != end)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns 1 if erasers a and b have the same block layout. */
+static int same_erase_layout(const struct flashctx *flash, int a, int b)
+{
+	return !memcmp(flash->chip->block_erasers[a].eraseblocks, flash->chip->block_erasers[b].eraseblocks,
+		       sizeof(flash->chip->block_erasers[a].eraseblocks));
+}
+
+/*
+ * Arrange the usable erasers which are not in @disabled into layers, finest first. Erasers whose block
+ * boundaries do not nest with those of the finer layers are skipped and marked in @skipped (if not NULL), as
+ * are erasers with the same layout as an already chosen one. Both serve as fallback: once the erasers they
+ * conflict with are disabled, they are picked up by the next call.
+ * Returns the number of layers.
+ */
+static int build_erase_layers(const struct flashctx *flash, const bool *disabled, struct erase_layer *layers,
+			      bool *skipped)
+{
+	int num_layers = 0;
+	int k, l;
+	bool used[NUM_ERASEFUNCTIONS] = { false };
+
+	while (num_layers < NUM_ERASEFUNCTIONS) {
+		unsigned int count, best_count = 0;
+		int best = -1;
+
+		/* Pick the unused eraser with the most (i.e. smallest) blocks. */
+		for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+			if (used[k] || disabled[k] || check_block_eraser(flash, k, 0))
+				continue;
+			count = 0;
+			for (l = 0; l < NUM_ERASEREGIONS; l++)
+				count += flash->chip->block_erasers[k].eraseblocks[l].count;
+			if (count > best_count) {
+				best_count = count;
+				best = k;
+			}
+		}
+		if (best < 0)
+			break;
+		used[best] = true;
+
+		for (l = 0; l < num_layers; l++) {
+			if (same_erase_layout(flash, layers[l].eraser, best))
+				break;
+		}
+		if (l < num_layers) {
+			msg_cdbg2("Erase function %i has the same layout as erase function %i.\n",
+				  best, layers[l].eraser);
+			continue;
+		}
+
+		fill_erase_layer(flash, best, &layers[num_layers]);
+		if (num_layers && link_erase_layers(&layers[num_layers - 1], &layers[num_layers])) {
+			msg_cdbg2("Erase function %i does not nest with erase function %i.\n",
+				  best, layers[num_layers - 1].eraser);
+			if (skipped)
+				skipped[best] = true;
+			free(layers[num_layers].blocks);
+			continue;
+		}
+		num_layers++;
+	}
+	return num_layers;
+}
+
+/*
+ * Decide bottom-up which blocks are to be erased. A block of the finest layer is erased if its contents can
+ * not be written without erasing. A coarser block is erased as a whole if that is estimated to be cheaper
+ * than the best combination for the blocks it covers.
+ */
+static void plan_erase_layers(const struct flashctx *flash, struct erase_layer *layers, int num_layers,
+			      const uint8_t *curcontents, const uint8_t *newcontents)
+{
+	enum write_granularity gran = flash->chip->gran;
+	unsigned int i, j;
+	unsigned long diff;
+	int l;
+
+	for (i = 0; i < layers[0].block_count; i++) {
+		struct erase_block *block = &layers[0].blocks[i];
+		const uint8_t *have = curcontents + block->start;
+		const uint8_t *want = newcontents + block->start;
+
+		block->nonff = buf_count_not_ff(want, block->len);
+		diff = buf_count_diff(have, want, block->len);
+		block->need_erase = need_erase(have, want, block->len, gran);
+		block->selected = block->need_erase;
+		if (block->need_erase)
+			block->cost = erase_cost(block->len) + program_cost(block->nonff);
+		else
+			block->cost = program_cost(diff);
+	}
+
+	for (l = 1; l < num_layers; l++) {
+		for (i = 0; i < layers[l].block_count; i++) {
+			struct erase_block *block = &layers[l].blocks[i];
+			const struct erase_block *sub = &layers[l - 1].blocks[block->first_sub];
+			uint64_t subcost = 0, wholecost;
+
+			block->nonff = 0;
+			block->need_erase = false;
+			for (j = 0; j < block->num_sub; j++) {
+				block->nonff += sub[j].nonff;
+				block->need_erase |= sub[j].need_erase;
+				subcost += sub[j].cost;
+			}
+			wholecost = erase_cost(block->len) + program_cost(block->nonff);
+			/* Erasing is pointless if the whole block can be written without it, and impossible if
+			 * we do not know what to write back to parts of it. */
+			block->selected = block->need_erase && wholecost < subcost &&
+					  range_known(flash, block->start, block->len);
+			block->cost = block->selected ? wholecost : subcost;
+		}
+	}
+}
+
+/* Erase all blocks selected by the plan below (and including) block @idx of layer @l. */
+static int erase_planned_block(struct flashctx *flash, const struct erase_layer *layers, int l,
+			       unsigned int idx, uint8_t *curcontents, int *failed_eraser)
+{
+	const struct erase_block *block = &layers[l].blocks[idx];
+	unsigned int i;
+	uint64_t t;
+	int ret;
+
+	if (!block->need_erase)
+		return 0;
+	if (block->selected) {
+		msg_cdbg("E");
+		/* A failed erase may have changed the block as well. */
+		mark_dirty(flash, curcontents + block->start, block->start, block->len);
+		t = stats_now();
+		ret = flash->chip->block_erasers[layers[l].eraser].block_erase(flash, block->start, block->len);
+		stats_op(STATS_OP_ERASE, block->start, block->len, t);
+		if (!ret && check_erased_block(flash, block->start, block->len)) {
+			msg_cerr("ERASE FAILED!\n");
+			ret = -1;
+		}
+		if (ret) {
+			*failed_eraser = layers[l].eraser;
+			return ret;
+		}
+		/* Erase was successful. Adjust curcontents. */
+		memset(curcontents + block->start, 0xff, block->len);
+		all_skipped = false;
+		return 0;
+	}
+	for (i = 0; i < block->num_sub; i++) {
+		ret = erase_planned_block(flash, layers, l - 1, block->first_sub + i, curcontents,
+					  failed_eraser);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Matching stretches shorter than this are written along with their neighbours by get_next_partial_write(). */
+#define PARTIAL_WRITE_MIN_GAP	16
+
+/*
+ * Like get_next_write(), but for chips that allow leaving out any bytes of a write unit (FEATURE_PARTIAL_PAGE).
+ * Finds the next run within the first @len bytes that needs writing, without matching bytes at either end.
+ * Short matching stretches inside the run are kept, because another write command costs more than
+ * programming a few bytes again.
+ * @first_start is incremented by the offset of the run.
+ * @return	length of the run, 0 if nothing needs to be written
+ */
+static unsigned int get_next_partial_write(const uint8_t *have, const uint8_t *want, unsigned int len,
+					   unsigned int *first_start)
+{
+	unsigned int start, end, gap = 0;
+
+	start = buf_first_diff(have, want, len);
+	for (end = start; end < len && gap < PARTIAL_WRITE_MIN_GAP; end++)
+		gap = have[end] == want[end] ? gap + 1 : 0;
+	*first_start += start;
+	return end - start - gap;
+}
+
+/* Write everything that differs between curcontents and newcontents in the range start..start+len-1. */
+static int write_range(struct flashctx *flash, unsigned int start, unsigned int len,
+		       uint8_t *curcontents, uint8_t *newcontents)
+{
+	unsigned int starthere = 0, lenhere = 0;
+	int ret, writecount = 0;
+	enum write_granularity gran = flash->chip->gran;
+	const bool partial = flash->chip->feature_bits & FEATURE_PARTIAL_PAGE;
+	uint64_t t;
+
+	curcontents += start;
+	newcontents += start;
+	/* get_next_(partial_)write() sets starthere to a new value after the call. Runs of bytes which already
+	 * hold the wanted value, e.g. 0xff padding in a freshly erased page, are only left out of whole units
+	 * unless the chip can program parts of a unit. */
+	while ((lenhere = partial ?
+			  get_next_partial_write(curcontents + starthere, newcontents + starthere,
+						 len - starthere, &starthere) :
+			  get_next_write(curcontents + starthere, newcontents + starthere,
+					 len - starthere, &starthere, gran))) {
+		if (!writecount++)
+			msg_cdbg("W");
+		mark_dirty(flash, curcontents + starthere, start + starthere, lenhere);
+		/* Needs the partial write function signature. */
+		t = stats_now();
+		ret = flash->chip->write(flash, newcontents + starthere, start + starthere, lenhere);
+		stats_op(STATS_OP_WRITE, start + starthere, lenhere, t);
+		if (ret)
+			return ret;
+		/* Write was successful. Adjust curcontents. */
+		memcpy(curcontents + starthere, newcontents + starthere, lenhere);
+		starthere += lenhere;
+		all_skipped = false;
+	}
+	return 0;
+}
+
+/*
+ * Erase and write the chip according to a plan spanning all usable erasers. Returns 0 on success. If an erase
+ * failed, @failed_eraser is set to the eraser that failed, otherwise (i.e. if writing failed) it is set to -1.
+ */
+static int erase_and_write_planned(struct flashctx *flash, struct erase_layer *layers, int num_layers,
+				   uint8_t *curcontents, uint8_t *newcontents, int *failed_eraser)
+{
+	const struct erase_layer *top = &layers[num_layers - 1];
+	unsigned int i;
+	uint64_t cost = 0;
+	int l, ret;
+
+	plan_erase_layers(flash, layers, num_layers, curcontents, newcontents);
+	for (i = 0; i < top->block_count; i++)
+		cost += top->blocks[i].cost;
+	msg_cdbg("Erase plan uses erase function%s", num_layers > 1 ? "s" : "");
+	for (l = 0; l < num_layers; l++)
+		msg_cdbg(" %i", layers[l].eraser);
+	msg_cdbg(", estimated time %llu ms.\n", (unsigned long long)cost / 1000);
+
+	*failed_eraser = -1;
+
+	/* Erase everything selected below a top-level block before writing it because the erase of a coarse
+	 * block would destroy data written to any of its sub-blocks. */
+	for (i = 0; i < top->block_count; i++) {
+		const struct erase_block *block = &top->blocks[i];
+
+		if (i)
+			msg_cdbg(", ");
+		msg_cdbg("0x%06x-0x%06x:", block->start, block->start + block->len - 1);
+		if (!block->need_erase &&
+		    buf_first_diff(curcontents + block->start, newcontents + block->start, block->len) == block->len) {
+			msg_cdbg("S");
+			continue;
+		}
+		ret = erase_planned_block(flash, layers, num_layers - 1, i, curcontents, failed_eraser);
+		if (ret)
+			return ret;
+		ret = write_range(flash, block->start, block->len, curcontents, newcontents);
+		if (ret)
+			return ret;
+	}
+	msg_cdbg("\n");
+	return 0;
+}
+
+/* Copy the parts of @curcontents whose old contents were not known to @newcontents. */
+static void keep_unknown_contents(const struct flashctx *flash, const uint8_t *curcontents, uint8_t *newcontents)
+{
+	unsigned int i, start = 0;
+	unsigned long size = flash->chip->total_size * 1024;
+
+	for (i = 0; i <= flash->num_known; i++) {
+		unsigned long end = i < flash->num_known ? flash->known[i].start : size;
+
+		memcpy(newcontents + start, curcontents + start, end - start);
+		if (i < flash->num_known)
+			start = flash->known[i].start + flash->known[i].len;
+	}
+}
+
+/*
+ * Erase and write the chip so that it holds @newcontents. @curcontents has to hold the old contents and is
+ * updated to the chip contents as they are known while erasing and writing, so it must not be used as a
+ * reference for the old contents afterwards (orig_contents_changed() checks those).
+ */
+int erase_and_write_flash(struct flashctx *flash, uint8_t *curcontents, uint8_t *newcontents)
+{
+	int k, l, ret = 1;
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned int usable_erasefunctions = count_usable_erasers(flash);
+	struct erase_layer layers[NUM_ERASEFUNCTIONS];
+	bool disabled[NUM_ERASEFUNCTIONS] = { false };
+	bool skipped[NUM_ERASEFUNCTIONS] = { false }, reported[NUM_ERASEFUNCTIONS] = { false };
+	int num_layers, failed_eraser;
+
+	msg_cinfo("Erasing and writing flash chip... ");
+	clear_dirty(flash);
 
 	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
 		if (k != 0)
 			msg_cinfo("Looking for another erase function.\n");
-		if (!usable_erasefunctions) {
+		num_layers = build_erase_layers(flash, disabled, layers, skipped);
+		if (!num_layers) {
 			msg_cinfo("No usable erase functions left.\n");
 			break;
 		}
-		msg_cdbg("Trying erase function %i... ", k);
-		if (check_block_eraser(flash, k, 1))
-			continue;
-		usable_erasefunctions--;
-		ret = walk_eraseregions(flash, k, &erase_and_write_block_helper,
-					curcontents, newcontents);
+		for (l = 0; l < NUM_ERASEFUNCTIONS; l++) {
+			if (skipped[l] && !reported[l] && !disabled[l]) {
+				msg_cinfo("Erase function %i does not fit the block layout of the others, using it only "
+					  "if they fail.\n", l);
+				reported[l] = true;
+			}
+		}
+		ret = erase_and_write_planned(flash, layers, num_layers, curcontents, newcontents,
+					      &failed_eraser);
+		free_erase_layers(layers, num_layers);
 		/* If everything is OK, don't try another erase function. */
 		if (!ret)
 			break;
+		/* Another erase function won't help if writing failed. */
+		if (failed_eraser < 0) {
+			msg_cerr("Write failed. ");
+			break;
+		}
+		msg_cdbg("Erase function %i failed, not using it again.\n", failed_eraser);
+		disabled[failed_eraser] = true;
+		usable_erasefunctions--;
 		/* Write/erase failed, so try to find out what the current chip
 		 * contents are. If no usable erase functions remain, we can
 		 * skip this: the next iteration will break immediately anyway.
@@ -1617,7 +2575,7 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 		 * in non-verbose mode.
 		 */
 		msg_cinfo("Reading current flash chip contents... ");
-		if (flash->chip->read(flash, curcontents, 0, size)) {
+		if (read_flash(flash, curcontents, 0, size)) {
 			/* Now we are truly screwed. Read failed as well. */
 			msg_cerr("Can't read anymore! Aborting.\n");
 			/* We have no idea about the flash chip contents, so
@@ -1625,10 +2583,15 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 			 */
 			break;
 		}
+		/* Now that the whole chip is known, leave the parts that were not read before untouched. */
+		if (flash->known) {
+			keep_unknown_contents(flash, curcontents, newcontents);
+			free(flash->known);
+			flash->known = NULL;
+			flash->num_known = 0;
+		}
 		msg_cinfo("done. ");
 	}
-	/* Free the scratchpad. */
-	free(curcontents);
 
 	if (ret) {
 		msg_cerr("FAILED!\n");
@@ -1637,9 +2600,65 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 			msg_cinfo("\nWarning: Chip content is identical to the requested image.\n");
 		msg_cinfo("Erase/write done.\n");
 	}
+	if (flash->chip->bustype == BUS_SPI)
+		stats_print_wip();
 	return ret;
 }
 
+/*
+ * Read the parts of the chip covering the included layout regions into @oldcontents and remember them as the
+ * known contents. The regions are extended to whole blocks of the finest usable eraser because the rest of
+ * such a block has to be written back after erasing it.
+ * Returns 0 on success, 1 if reading failed and -1 if the whole chip has to be read instead.
+ */
+static int read_included_blocks(struct flashctx *flash, uint8_t *oldcontents)
+{
+	struct erase_layer layers[NUM_ERASEFUNCTIONS];
+	bool disabled[NUM_ERASEFUNCTIONS] = { false };
+	struct flash_range *ranges;
+	unsigned long total = 0;
+	unsigned int i, j, count;
+	int num_layers;
+
+	count = get_included_ranges(&ranges);
+	if (!count)
+		return -1;
+	num_layers = build_erase_layers(flash, disabled, layers, NULL);
+	if (!num_layers) {
+		free(ranges);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		unsigned int start = ranges[i].start, end = ranges[i].start + ranges[i].len;
+
+		for (j = 0; j < layers[0].block_count; j++) {
+			const struct erase_block *block = &layers[0].blocks[j];
+
+			if (block->start <= ranges[i].start && block->start + block->len > ranges[i].start)
+				start = block->start;
+			if (block->start < ranges[i].start + ranges[i].len && block->start + block->len >= end)
+				end = block->start + block->len;
+		}
+		ranges[i].start = start;
+		ranges[i].len = end - start;
+	}
+	free_erase_layers(layers, num_layers);
+	count = merge_ranges(ranges, count);
+
+	for (i = 0; i < count; i++) {
+		msg_cdbg2("Reading 0x%06x-0x%06x... ", ranges[i].start, ranges[i].start + ranges[i].len - 1);
+		if (read_flash(flash, oldcontents + ranges[i].start, ranges[i].start, ranges[i].len)) {
+			free(ranges);
+			return 1;
+		}
+		total += ranges[i].len;
+	}
+	msg_cdbg("read %lu bytes around the included regions... ", total);
+	flash->known = ranges;
+	flash->num_known = count;
+	return 0;
+}
+
 static void nonfatal_help_message(void)
 {
 	msg_gerr("Good, writing to the flash chip apparently didn't do anything.\n");
@@ -1972,6 +2991,26 @@ int chip_safety_check(const struct flashctx *flash, int force, int read_it, int
 	return 0;
 }
 
+/*
+ * With deferred erase checks the erased blocks are compared with @newcontents after writing. The final verify
+ * covers them already, this is for operations without one.
+ */
+static int check_deferred_erase(struct flashctx *flash, const uint8_t *newcontents)
+{
+	int ret;
+
+	if (erase_check != ERASE_VERIFY_DEFERRED)
+		return 0;
+	msg_cinfo("Checking erased blocks... ");
+	ret = verify_dirty_ranges(flash, newcontents);
+	if (ret) {
+		emergency_help_message();
+		return ret;
+	}
+	msg_cinfo("done.\n");
+	return 0;
+}
+
 /* This function signature is horrible. We need to design a better interface,
  * but right now it allows us to split off the CLI code.
  * Besides that, the function itself is a textbook example of abysmal code flow.
@@ -1981,9 +3020,10 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 {
 	uint8_t *oldcontents;
 	uint8_t *newcontents;
-	int ret = 0;
+	struct image_buf newimage = { .buf = NULL };
+	int ret = 0, changed;
 	unsigned long size = flash->chip->total_size * 1024;
-	int read_all_first = 1; /* FIXME: Make this configurable. */
+	bool read_all_first = true;
 
 	if (chip_safety_check(flash, force, read_it, write_it, erase_it, verify_it)) {
 		msg_cerr("Aborting.\n");
@@ -2001,82 +3041,98 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	if (flash->chip->unlock)
 		flash->chip->unlock(flash);
 
+	erase_check = resolve_erase_verify(flash);
+
 	if (read_it) {
+		stats_phase(STATS_PHASE_READ);
 		return read_flash_to_file(flash, filename);
 	}
 
-	oldcontents = malloc(size);
+	/* Assume worst case: All bits are 0. calloc() leaves the parts that are never read untouched, so they
+	 * take no memory. */
+	oldcontents = calloc(size, 1);
 	if (!oldcontents) {
 		msg_gerr("Out of memory!\n");
 		exit(1);
 	}
-	/* Assume worst case: All bits are 0. */
-	memset(oldcontents, 0x00, size);
-	newcontents = malloc(size);
-	if (!newcontents) {
-		msg_gerr("Out of memory!\n");
-		exit(1);
-	}
-	/* Assume best case: All bits should be 1. */
-	memset(newcontents, 0xff, size);
-	/* Side effect of the assumptions above: Default write action is erase
-	 * because newcontents looks like a completely erased chip, and
-	 * oldcontents being completely 0x00 means we have to erase everything
-	 * before we can write.
-	 */
 
 	if (erase_it) {
+		newcontents = malloc(size);
+		if (!newcontents) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		newimage.buf = newcontents;
+		/* Assume best case: All bits should be 1. */
+		memset(newcontents, 0xff, size);
+		/* Side effect of the assumptions above: Default write action is erase
+		 * because newcontents looks like a completely erased chip, and
+		 * oldcontents being completely 0x00 means we have to erase everything
+		 * before we can write.
+		 */
+
 		/* FIXME: Do we really want the scary warning if erase failed?
 		 * After all, after erase the chip is either blank or partially
 		 * blank or it has the old contents. A blank chip won't boot,
 		 * so if the user wanted erase and reboots afterwards, the user
 		 * knows very well that booting won't work.
 		 */
+		stats_phase(STATS_PHASE_ERASE);
 		if (erase_and_write_flash(flash, oldcontents, newcontents)) {
 			emergency_help_message();
 			ret = 1;
+		} else if (check_deferred_erase(flash, newcontents)) {
+			ret = 1;
 		}
 		goto out;
 	}
 
-	if (write_it || verify_it) {
-		if (read_buf_from_file(newcontents, size, filename)) {
-			ret = 1;
-			goto out;
-		}
+	/* Writing and verifying both need the image. */
+	ret = load_image(&newimage, size, filename);
+	newcontents = newimage.buf;
+	if (ret)
+		goto out;
 
 #if CONFIG_INTERNAL == 1
-		if (programmer == PROGRAMMER_INTERNAL && cb_check_image(newcontents, size) < 0) {
-			if (force_boardmismatch) {
-				msg_pinfo("Proceeding anyway because user forced us to.\n");
-			} else {
-				msg_perr("Aborting. You can override this with "
-					 "-p internal:boardmismatch=force.\n");
-				ret = 1;
-				goto out;
-			}
+	if (programmer == PROGRAMMER_INTERNAL && cb_check_image(newcontents, size) < 0) {
+		if (force_boardmismatch) {
+			msg_pinfo("Proceeding anyway because user forced us to.\n");
+		} else {
+			msg_perr("Aborting. You can override this with "
+				 "-p internal:boardmismatch=force.\n");
+			ret = 1;
+			goto out;
 		}
-#endif
 	}
+#endif
 
 	/* Read the whole chip to be able to check whether regions need to be
 	 * erased and to give better diagnostics in case write fails.
-	 * The alternative is to read only the regions which are to be
-	 * preserved, but in that case we might perform unneeded erase which
-	 * takes time as well.
+	 * If only some layout regions are to be written and the whole chip
+	 * does not need to be verified afterwards, it is enough to read the
+	 * erase blocks around them. Everything else is left alone then.
 	 */
-	if (read_all_first) {
-		msg_cinfo("Reading old flash chip contents... ");
-		if (flash->chip->read(flash, oldcontents, 0, size)) {
-			ret = 1;
+	stats_phase(write_it ? STATS_PHASE_READ : STATS_PHASE_VERIFY);
+	msg_cinfo("Reading old flash chip contents... ");
+	if (write_it && verify_it != VERIFY_FULL) {
+		ret = read_included_blocks(flash, oldcontents);
+		if (ret > 0) {
 			msg_cinfo("FAILED.\n");
 			goto out;
 		}
+		read_all_first = ret < 0;
+		ret = 0;
+	}
+	if (read_all_first && read_flash(flash, oldcontents, 0, size)) {
+		ret = 1;
+		msg_cinfo("FAILED.\n");
+		goto out;
 	}
 	msg_cinfo("done.\n");
 
-	/* Build a new image taking the given layout into account. */
-	if (build_new_image(flash, read_all_first, oldcontents, newcontents)) {
+	/* Build a new image taking the given layout into account. Outside of the known parts, both images
+	 * stay zero-filled and are thus considered equal. */
+	if (build_new_image(flash, true, oldcontents, newcontents)) {
 		msg_gerr("Could not prepare the data to be written, aborting.\n");
 		ret = 1;
 		goto out;
@@ -2084,14 +3140,17 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 
 	// ////////////////////////////////////////////////////////////
 
+	if (write_it)
+		stats_phase(STATS_PHASE_WRITE);
 	if (write_it && erase_and_write_flash(flash, oldcontents, newcontents)) {
 		msg_cerr("Uh oh. Erase/write failed. ");
 		if (read_all_first) {
 			msg_cerr("Checking if anything has changed.\n");
 			msg_cinfo("Reading current flash chip contents... ");
-			if (!flash->chip->read(flash, newcontents, 0, size)) {
+			changed = orig_contents_changed(flash);
+			if (changed >= 0) {
 				msg_cinfo("done.\n");
-				if (!memcmp(oldcontents, newcontents, size)) {
+				if (!changed) {
 					nonfatal_help_message();
 					ret = 1;
 					goto out;
@@ -2109,14 +3168,23 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 		goto out;
 	}
 
+	if (write_it && !verify_it && check_deferred_erase(flash, newcontents)) {
+		ret = 1;
+		goto out;
+	}
+
 	/* Verify only if we either did not try to write (verify operation) or actually changed something. */
 	if (verify_it && (!write_it || !all_skipped)) {
+		stats_phase(STATS_PHASE_VERIFY);
 		msg_cinfo("Verifying flash... ");
 
 		if (write_it) {
 			/* Work around chips which need some time to calm down. */
 			programmer_delay(1000*1000);
-			ret = verify_range(flash, newcontents, 0, size);
+			if (verify_it == VERIFY_FULL)
+				ret = verify_range(flash, newcontents, 0, size);
+			else
+				ret = verify_dirty_ranges(flash, newcontents);
 			/* If we tried to write, and verification now fails, we
 			 * might have an emergency situation.
 			 */
@@ -2130,7 +3198,11 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	}
 
 out:
+	clear_dirty(flash);
+	free(flash->known);
+	flash->known = NULL;
+	flash->num_known = 0;
 	free(oldcontents);
-	free(newcontents);
+	free_image(&newimage);
 	return ret;
 }
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include "flash.h"
+#include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
 #include <ftdi.h>
@@ -88,6 +89,20 @@ const struct dev_entry devs_ft2232spi[] = {
 #define BITMODE_BITBANG_NORMAL	1
 #define BITMODE_BITBANG_SPI	2
 
+/* Clock n x 8 bits without transferring data. Only available on the high-speed chips. */
+#ifndef CLK_BYTES
+#define CLK_BYTES	0x8f
+#endif
+
+/* Number of bytes the MPSSE engine may return in one batch before the host reads them. The engine stops
+ * processing commands while its receive buffer is full, so a batch that asks for more could never be written
+ * completely. The high-speed chips have 4 kB buffers, the FT2232D only 128 B; leave some headroom. */
+#define FT2232H_BATCH_READ	3072
+#define FT2232_BATCH_READ	64
+
+/* Maximum number of pages ft2232_spi_write_256() queues in one batch. */
+#define FT2232_BATCH_PAGES	16
+
 /* The variables cs_bits and pindir store the values for the "set data bits low byte" MPSSE command that
  * sets the initial state and the direction of the I/O pins. The pin offsets are as follows:
  * SCK is bit 0.
@@ -102,6 +117,14 @@ const struct dev_entry devs_ft2232spi[] = {
 static uint8_t cs_bits = 0x08;
 static uint8_t pindir = 0x0b;
 static struct ftdi_context ftdic_context;
+/* Set for the high-speed chips (FT2232H, FT4232H, FT232H). */
+static bool hispeed = false;
+/* SPI clock in kHz. */
+static unsigned int spi_khz;
+
+/* The MPSSE command stream of the current batch. It never shrinks because realloc() calls are expensive. */
+static unsigned char *mpsse_buf = NULL;
+static unsigned int mpsse_bufsize = 0;
 
 static const char *get_ft2232_devicename(int ft2232_vid, int ft2232_type)
 {
@@ -127,6 +150,7 @@ static int send_buf(struct ftdi_context *ftdic, const unsigned char *buf,
 		    int size)
 {
 	int r;
+	stats_usb_transfer();
 	r = ftdi_write_data(ftdic, (unsigned char *) buf, size);
 	if (r < 0) {
 		msg_perr("ftdi_write_data: %d, %s\n", r, ftdi_get_error_string(ftdic));
@@ -141,6 +165,7 @@ static int get_buf(struct ftdi_context *ftdic, const unsigned char *buf,
 	int r;
 
 	while (size > 0) {
+		stats_usb_transfer();
 		r = ftdi_read_data(ftdic, (unsigned char *) buf, size);
 		if (r < 0) {
 			msg_perr("ftdi_read_data: %d, %s\n", r, ftdi_get_error_string(ftdic));
@@ -156,15 +181,18 @@ static int ft2232_spi_send_command(struct flashctx *flash,
 				   unsigned int writecnt, unsigned int readcnt,
 				   const unsigned char *writearr,
 				   unsigned char *readarr);
+static int ft2232_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
+static int ft2232_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 
 static const struct spi_master spi_master_ft2232 = {
 	.type		= SPI_CONTROLLER_FT2232,
+	.features	= SPI_MASTER_FAST_READ | SPI_MASTER_4BA,
 	.max_data_read	= 64 * 1024,
 	.max_data_write	= 256,
 	.command	= ft2232_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= ft2232_spi_send_multicommand,
 	.read		= default_spi_read,
-	.write_256	= default_spi_write_256,
+	.write_256	= ft2232_spi_write_256,
 	.write_aai	= default_spi_write_aai,
 };
 
@@ -360,6 +388,7 @@ int ft2232_spi_init(void)
 		msg_pdbg("FTDI chip type %d is not high-speed.\n", ftdic->type);
 		clock_5x = 0;
 	}
+	hispeed = clock_5x;
 
 	if (ftdi_usb_reset(ftdic) < 0) {
 		msg_perr("Unable to reset FTDI device (%s).\n", ftdi_get_error_string(ftdic));
@@ -400,6 +429,7 @@ int ft2232_spi_init(void)
 
 	msg_pdbg("MPSSE clock: %f MHz, divisor: %u, SPI clock: %f MHz\n",
 		 mpsse_clk, divisor, (double)(mpsse_clk / divisor));
+	spi_khz = mpsse_clk * 1000 / divisor;
 
 	/* Disconnect TDI/DO to TDO/DI for loopback. */
 	msg_pdbg("No loopback of TDI/DO TDO/DI\n");
@@ -429,92 +459,196 @@ ftdi_err:
 	return ret;
 }
 
-/* Returns 0 upon success, a negative number upon errors. */
-static int ft2232_spi_send_command(struct flashctx *flash,
-				   unsigned int writecnt, unsigned int readcnt,
-				   const unsigned char *writearr,
-				   unsigned char *readarr)
+/* Make room for @size bytes in mpsse_buf. Returns 0 upon success. */
+static int mpsse_reserve(unsigned int size)
 {
-	struct ftdi_context *ftdic = &ftdic_context;
-	static unsigned char *buf = NULL;
-	/* failed is special. We use bitwise ops, but it is essentially bool. */
-	int i = 0, ret = 0, failed = 0;
-	int bufsize;
-	static int oldbufsize = 0;
-
-	if (writecnt > 65536 || readcnt > 65536)
-		return SPI_INVALID_LENGTH;
-
-	/* buf is not used for the response from the chip. */
-	bufsize = max(writecnt + 9, 260 + 9);
-	/* Never shrink. realloc() calls are expensive. */
-	if (bufsize > oldbufsize) {
-		buf = realloc(buf, bufsize);
-		if (!buf) {
-			msg_perr("Out of memory!\n");
-			/* TODO: What to do with buf? */
-			return SPI_GENERIC_ERROR;
-		}
-		oldbufsize = bufsize;
+	unsigned char *tmp;
+
+	if (size <= mpsse_bufsize)
+		return 0;
+	tmp = realloc(mpsse_buf, size);
+	if (!tmp) {
+		msg_perr("Out of memory!\n");
+		return 1;
 	}
+	mpsse_buf = tmp;
+	mpsse_bufsize = size;
+	return 0;
+}
+
+/* Append the MPSSE commands for one CS#-framed SPI command at offset @i of mpsse_buf.
+ * Returns the new length of the stream. mpsse_buf must have room for writecnt + 12 more bytes. */
+static unsigned int mpsse_append_command(unsigned int i, const struct spi_command *cmd)
+{
+	unsigned char *buf = mpsse_buf;
 
-	/*
-	 * Minimize USB transfers by packing as many commands as possible
-	 * together. If we're not expecting to read, we can assert CS#, write,
-	 * and deassert CS# all in one shot. If reading, we do three separate
-	 * operations.
-	 */
-	msg_pspew("Assert CS#\n");
 	buf[i++] = SET_BITS_LOW;
 	buf[i++] = 0 & ~cs_bits; /* assertive */
 	buf[i++] = pindir;
-
-	if (writecnt) {
+	if (cmd->writecnt) {
 		buf[i++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-		buf[i++] = (writecnt - 1) & 0xff;
-		buf[i++] = ((writecnt - 1) >> 8) & 0xff;
-		memcpy(buf + i, writearr, writecnt);
-		i += writecnt;
+		buf[i++] = (cmd->writecnt - 1) & 0xff;
+		buf[i++] = ((cmd->writecnt - 1) >> 8) & 0xff;
+		memcpy(buf + i, cmd->writearr, cmd->writecnt);
+		i += cmd->writecnt;
 	}
-
-	/*
-	 * Optionally terminate this batch of commands with a
-	 * read command, then do the fetch of the results.
-	 */
-	if (readcnt) {
+	if (cmd->readcnt) {
 		buf[i++] = MPSSE_DO_READ;
-		buf[i++] = (readcnt - 1) & 0xff;
-		buf[i++] = ((readcnt - 1) >> 8) & 0xff;
-		ret = send_buf(ftdic, buf, i);
-		failed = ret;
-		/* We can't abort here, we still have to deassert CS#. */
-		if (ret)
-			msg_perr("send_buf failed before read: %i\n", ret);
-		i = 0;
-		if (ret == 0) {
-			/*
-			 * FIXME: This is unreliable. There's no guarantee that
-			 * we read the response directly after sending the read
-			 * command. We may be scheduled out etc.
-			 */
-			ret = get_buf(ftdic, readarr, readcnt);
-			failed |= ret;
-			/* We can't abort here either. */
-			if (ret)
-				msg_perr("get_buf failed: %i\n", ret);
-		}
+		buf[i++] = (cmd->readcnt - 1) & 0xff;
+		buf[i++] = ((cmd->readcnt - 1) >> 8) & 0xff;
 	}
-
-	msg_pspew("De-assert CS#\n");
 	buf[i++] = SET_BITS_LOW;
 	buf[i++] = cs_bits;
 	buf[i++] = pindir;
-	ret = send_buf(ftdic, buf, i);
-	failed |= ret;
+	return i;
+}
+
+/* Send the first @len bytes of mpsse_buf and fetch the responses to the @count commands in @cmds.
+ * Returns 0 upon success, a negative number upon errors. */
+static int mpsse_send_batch(unsigned int len, const struct spi_command *cmds, unsigned int count)
+{
+	struct ftdi_context *ftdic = &ftdic_context;
+	unsigned int i;
+
+	/* Flush the results to the host right away instead of waiting for the latency timer. */
+	mpsse_buf[len++] = SEND_IMMEDIATE;
+	msg_pspew("Sending %u commands in %u MPSSE bytes\n", count, len);
+	if (send_buf(ftdic, mpsse_buf, len)) {
+		msg_perr("send_buf failed\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (!cmds[i].readcnt)
+			continue;
+		if (get_buf(ftdic, cmds[i].readarr, cmds[i].readcnt)) {
+			msg_perr("get_buf failed\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pack as many commands as possible into one MPSSE stream so they cost a single USB round trip. A batch is
+ * only cut when the responses would not fit into the chip's receive buffer anymore. A single command reading
+ * more than that is fine because only CS# deassertion follows its read.
+ * Returns 0 upon success, a negative number upon errors.
+ */
+static int ft2232_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	const unsigned int max_read = hispeed ? FT2232H_BATCH_READ : FT2232_BATCH_READ;
+	struct spi_command *first = cmds, *cmd;
+	unsigned int len = 0, readcnt = 0;
+	int ret;
+
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; cmd++) {
+		if (cmd->io_mode != SPI_IO_SINGLE)
+			return SPI_INVALID_OPCODE;
+		if (cmd->writecnt > 65536 || cmd->readcnt > 65536)
+			return SPI_INVALID_LENGTH;
+		if (readcnt && readcnt + cmd->readcnt > max_read) {
+			ret = mpsse_send_batch(len, first, cmd - first);
+			if (ret)
+				return ret;
+			first = cmd;
+			len = readcnt = 0;
+		}
+		/* Room for the command, CS# handling, the read opcode and SEND_IMMEDIATE. */
+		if (mpsse_reserve(len + cmd->writecnt + 13))
+			return SPI_GENERIC_ERROR;
+		len = mpsse_append_command(len, cmd);
+		readcnt += cmd->readcnt;
+	}
+	if (!len)
+		return 0;
+	return mpsse_send_batch(len, first, cmd - first);
+}
+
+/* Returns 0 upon success, a negative number upon errors. */
+static int ft2232_spi_send_command(struct flashctx *flash,
+				   unsigned int writecnt, unsigned int readcnt,
+				   const unsigned char *writearr,
+				   unsigned char *readarr)
+{
+	struct spi_command cmds[] = {
+	{
+		.writecnt	= writecnt,
+		.writearr	= writearr,
+		.readcnt	= readcnt,
+		.readarr	= readarr,
+	}, {
+		.writecnt	= 0,
+		.writearr	= NULL,
+		.readcnt	= 0,
+		.readarr	= NULL,
+	}};
+
+	return ft2232_spi_send_multicommand(flash, cmds);
+}
+
+/* Number of status bytes read continuously after the pause of each page in a batch. */
+static unsigned int batch_polls;
+
+/*
+ * Queue the pages of spi_write_batched() in one MPSSE stream. After the page program of each page, SCK is
+ * clocked with CS# deasserted for the wait time, then the status register is read continuously for half the
+ * typical program time of a full page. The last byte read counts.
+ */
+static int ft2232_spi_send_batch(struct flashctx *flash, struct spi_batch_page *pages, unsigned int count)
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	struct spi_command cmds[4 * FT2232_BATCH_PAGES];
+	uint8_t status[FT2232H_BATCH_READ];
+	unsigned int mpsse_len = 0, n, i;
+	int ret;
+
+	/* The WREN check and the polling of each page have to fit into the receive buffer. */
+	count = min(count, min(FT2232H_BATCH_READ / (batch_polls + 1), FT2232_BATCH_PAGES));
+	for (n = 0; n < count; n++) {
+		struct spi_batch_page *page = &pages[n];
+		const unsigned int idle = min(max(page->wait_us * spi_khz / 8000, 1), 65536);
+
+		cmds[4 * n] = (struct spi_command){ .writecnt = 1, .writearr = wren };
+		cmds[4 * n + 1] = (struct spi_command){ .writecnt = 1, .writearr = rdsr,
+							.readcnt = 1, .readarr = &page->wel_status };
+		cmds[4 * n + 2] = (struct spi_command){ .writecnt = page->cmdlen, .writearr = page->cmd };
+		cmds[4 * n + 3] = (struct spi_command){ .writecnt = 1, .writearr = rdsr,
+							.readcnt = batch_polls, .readarr = status + n * batch_polls };
+
+		/* Room for four commands, the idle clocks and SEND_IMMEDIATE. */
+		if (mpsse_reserve(mpsse_len + page->cmdlen + 4 * 12 + 3 + 1))
+			return SPI_GENERIC_ERROR;
+		for (i = 0; i < 3; i++)
+			mpsse_len = mpsse_append_command(mpsse_len, &cmds[4 * n + i]);
+		/* Programming starts when CS# is deasserted. */
+		mpsse_buf[mpsse_len++] = CLK_BYTES;
+		mpsse_buf[mpsse_len++] = (idle - 1) & 0xff;
+		mpsse_buf[mpsse_len++] = ((idle - 1) >> 8) & 0xff;
+		mpsse_len = mpsse_append_command(mpsse_len, &cmds[4 * n + 3]);
+	}
+
+	ret = mpsse_send_batch(mpsse_len, cmds, 4 * n);
 	if (ret)
-		msg_perr("send_buf failed at end: %i\n", ret);
+		return ret;
+	for (i = 0; i < n; i++)
+		pages[i].status = status[i * batch_polls + batch_polls - 1];
+	return n;
+}
+
+/* Program pages with as few USB round trips as possible, see spi_write_batched(). */
+static int ft2232_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int typ = flash->chip->timing[OP_TIMING_PP].typ ? : 700;
+
+	/* Clocking without data is not available on the FT2232D and its receive buffer is too small for the
+	 * status polling. */
+	if (!hispeed)
+		return default_spi_write_256(flash, buf, start, len);
 
-	return failed ? -1 : 0;
+	/* Number of status bytes clocked in half of the typical program time of a full page. */
+	batch_polls = max(min(typ / 2 * spi_khz / 8000, FT2232H_BATCH_READ / 2), 1);
+	return spi_write_batched(flash, buf, start, len, FT2232_BATCH_PAGES, ft2232_spi_send_batch);
 }
 
 #endif
@@ -178,6 +178,10 @@ uint32_t ichspi_bbar = 0;
 
 static void *ich_spibar = NULL;
 
+/* Flash region access permissions of the host (FRAP), only valid with a valid descriptor. */
+static uint32_t ich_frap = 0;
+static int ich_frap_valid = 0;
+
 typedef struct _OPCODE {
 	uint8_t opcode;		//This commands spi opcode
 	uint8_t spi_type;	//This commands spi type
@@ -991,6 +995,71 @@ static int run_opcode(const struct flashctx *flash, OPCODE op, uint32_t offset,
 	}
 }
 
+/*
+ * In descriptor mode the BIOS region is also decoded right below 4 GB, ending at 4 GB, where the CPU fetches its
+ * reset vector from. Reading it there takes plain memory loads instead of a register cycle for every 64 bytes.
+ * At most the top 16 MB of the region are decoded, and only as far as FWH_DEC_EN1 enables it.
+ */
+#define ICH_BIOS_WINDOW_MAX	(16 * 1024 * 1024)
+#define ICH_BIOS_WINDOW_CHECK	256
+
+static struct {
+	void *virt;		/* NULL if the window is not used. */
+	uint32_t start;		/* Flash address of the first byte in the window. */
+	uint32_t len;
+	bool checked;		/* The window was compared with a regular read. */
+} bios_window;
+
+static int ich_bios_window_shutdown(void *data)
+{
+	if (bios_window.virt)
+		physunmap(bios_window.virt, bios_window.len);
+	bios_window.virt = NULL;
+	return 0;
+}
+
+/*
+ * Stop using the window once @addr..@addr+@len-1 overlaps it and is about to be written or erased. The prefetch
+ * buffer of the chipset and the CPU caches may still hold the old contents, which would defeat the verification.
+ */
+static void ich_bios_window_modified(unsigned int addr, unsigned int len)
+{
+	if (!bios_window.virt || addr + len <= bios_window.start || addr >= bios_window.start + bios_window.len)
+		return;
+	msg_pdbg("Modifying the flash behind the BIOS window, reading it through the SPI controller from now on.\n");
+	ich_bios_window_shutdown(NULL);
+}
+
+/*
+ * Return the length of the flash range a write opcode without data at @addr may erase, i.e. the largest block
+ * containing @addr of all the block erasers of the chip. Chip erase functions are left out, they are sent
+ * without an address.
+ */
+static unsigned int ich_erase_len(const struct flashctx *flash, unsigned int addr)
+{
+	const unsigned int total_size = flash->chip->total_size * 1024;
+	unsigned int i, j, len = 0;
+
+	for (i = 0; i < NUM_ERASEFUNCTIONS; i++) {
+		const struct block_eraser *eraser = &flash->chip->block_erasers[i];
+		unsigned int start = 0;
+
+		if (!eraser->block_erase || eraser->eraseblocks[0].size >= total_size)
+			continue;
+		for (j = 0; j < NUM_ERASEREGIONS && eraser->eraseblocks[j].size; j++) {
+			const unsigned int size = eraser->eraseblocks[j].size;
+			const unsigned int end = start + size * eraser->eraseblocks[j].count;
+
+			if (addr < end) {
+				len = max(len, start + (addr - start) / size * size + size - addr);
+				break;
+			}
+			start = end;
+		}
+	}
+	return len;
+}
+
 static int ich_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				unsigned int readcnt,
 				const unsigned char *writearr,
@@ -1089,6 +1158,11 @@ static int ich_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 		count = readcnt;
 	}
 
+	if (opcode->spi_type == SPI_OPCODE_TYPE_WRITE_WITH_ADDRESS)
+		ich_bios_window_modified(addr, count ? count : ich_erase_len(flash, addr));
+	else if (cmd == JEDEC_CE_60 || cmd == JEDEC_CE_C7)
+		ich_bios_window_modified(0, flash->chip->total_size * 1024);
+
 	result = run_opcode(flash, *opcode, addr, count, data);
 	if (result) {
 		msg_pdbg("Running OPCODE 0x%02x failed ", opcode->opcode);
@@ -1272,6 +1346,7 @@ static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
 		return -1;
 	}
 
+	ich_bios_window_modified(addr, len);
 	msg_pdbg("Erasing %d bytes starting at 0x%06x.\n", len, addr);
 	ich_hwseq_set_addr(addr);
 
@@ -1345,6 +1420,7 @@ static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned
 		return -1;
 	}
 
+	ich_bios_window_modified(addr, len);
 	msg_pdbg("Writing %d bytes starting at 0x%06x.\n", len, addr);
 	/* clear FDONE, FCERR, AEL by writing 1 to them (if they are set) */
 	REGWRITE16(ICH9_REG_HSFS, REGREAD16(ICH9_REG_HSFS));
@@ -1374,6 +1450,98 @@ static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned
 	return 0;
 }
 
+typedef int (ich_readfn_t)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
+
+/* Map the part of the BIOS region (FREG1) which is decoded below 4 GB. Failing to do so is not an error. */
+static void ich_init_bios_window(void)
+{
+	const uint32_t freg = mmio_readl(ich_spibar + ICH9_REG_FREG0 + 1 * 4);
+	const uint32_t base = ICH_FREG_BASE(freg);
+	const uint32_t limit = ICH_FREG_LIMIT(freg) | 0x0fff;
+	uint32_t len;
+	void *virt;
+
+	if (base > limit || !freg)
+		return;
+	len = min(limit - base + 1, ICH_BIOS_WINDOW_MAX);
+	if (len > ich_bios_decode)
+		len = ich_bios_decode;
+	if (len < 2 * ICH_BIOS_WINDOW_CHECK)
+		return;
+	virt = physmap_ro("BIOS window", (uintptr_t)(0x100000000ULL - len), len);
+	if (virt == ERROR_PTR) {
+		msg_pdbg("Could not map the BIOS window, reading it through the SPI controller.\n");
+		return;
+	}
+	bios_window.virt = virt;
+	bios_window.start = limit + 1 - len;
+	bios_window.len = len;
+	bios_window.checked = false;
+	register_shutdown(ich_bios_window_shutdown, NULL);
+	msg_pdbg("Reading 0x%06x-0x%06x through the BIOS window.\n", bios_window.start, limit);
+}
+
+/*
+ * Compare both ends of the window, the top one holding the reset vector, with what @readfn returns for them
+ * before the window is trusted for the first time. If the BIOS region is decoded elsewhere or only partially,
+ * the window is dropped.
+ */
+static void ich_check_bios_window(struct flashctx *flash, ich_readfn_t *readfn)
+{
+	const uint32_t offsets[] = { 0, bios_window.len - ICH_BIOS_WINDOW_CHECK };
+	uint8_t direct[ICH_BIOS_WINDOW_CHECK], mapped[ICH_BIOS_WINDOW_CHECK];
+	unsigned int i;
+
+	bios_window.checked = true;
+	for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+		mmio_readn(bios_window.virt + offsets[i], mapped, sizeof(mapped));
+		if (readfn(flash, direct, bios_window.start + offsets[i], sizeof(direct)) ||
+		    memcmp(direct, mapped, sizeof(direct))) {
+			msg_pwarn("The BIOS window does not match the flash contents, not using it.\n");
+			ich_bios_window_shutdown(NULL);
+			return;
+		}
+	}
+}
+
+/* Read the part of @start..@start+@len-1 inside the BIOS window from there and the rest with @readfn. */
+static int ich_read_with_window(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+				ich_readfn_t *readfn)
+{
+	unsigned int n;
+
+	if (bios_window.virt && !bios_window.checked && start + len > bios_window.start &&
+	    start < bios_window.start + bios_window.len)
+		ich_check_bios_window(flash, readfn);
+	if (!bios_window.virt || start + len <= bios_window.start || start >= bios_window.start + bios_window.len)
+		return readfn(flash, buf, start, len);
+
+	if (start < bios_window.start) {
+		n = bios_window.start - start;
+		if (readfn(flash, buf, start, n))
+			return 1;
+		buf += n;
+		start += n;
+		len -= n;
+	}
+	n = min(len, bios_window.start + bios_window.len - start);
+	msg_pdbg("Reading %d bytes starting at 0x%06x from the BIOS window.\n", n, start);
+	mmio_readn(bios_window.virt + start - bios_window.start, buf, n);
+	if (n == len)
+		return 0;
+	return readfn(flash, buf + n, start + n, len - n);
+}
+
+static int ich_hwseq_read_windowed(struct flashctx *flash, uint8_t *buf, unsigned int addr, unsigned int len)
+{
+	return ich_read_with_window(flash, buf, addr, len, ich_hwseq_read);
+}
+
+static int ich_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return ich_read_with_window(flash, buf, start, len, default_spi_read);
+}
+
 static int ich_spi_send_multicommand(struct flashctx *flash,
 				     struct spi_command *cmds)
 {
@@ -1439,6 +1607,17 @@ static int ich_spi_send_multicommand(struct flashctx *flash,
 #define ICH_BRWA(x)  ((x >>  8) & 0xff)
 #define ICH_BRRA(x)  ((x >>  0) & 0xff)
 
+/*
+ * Tell whether the host may not read or write flash region @i (in the order of the FREG registers) according
+ * to the FRAP register the chipset enforces. Returns 1 if it may not, 0 if it may and -1 if this is unknown.
+ */
+int ich_region_locked(unsigned int i)
+{
+	if (!ich_frap_valid || i >= 8)
+		return -1;
+	return !((ICH_BRRA(ich_frap) >> i) & 1) || !((ICH_BRWA(ich_frap) >> i) & 1);
+}
+
 /* returns 0 if region is unused or r/w */
 static int ich9_handle_frap(uint32_t frap, int i)
 {
@@ -1547,7 +1726,7 @@ static const struct spi_master spi_master_ich9 = {
 	.max_data_write = 64,
 	.command = ich_spi_send_command,
 	.multicommand = ich_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = ich_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -1556,7 +1735,7 @@ static const struct opaque_master opaque_master_ich_hwseq = {
 	.max_data_read = 64,
 	.max_data_write = 64,
 	.probe = ich_hwseq_probe,
-	.read = ich_hwseq_read,
+	.read = ich_hwseq_read_windowed,
 	.write = ich_hwseq_write,
 	.erase = ich_hwseq_block_erase,
 };
@@ -1568,6 +1747,7 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 	uint32_t tmp;
 	char *arg;
 	int ich_spi_force = 0;
+	int ich_spi_window = 1;
 	int ich_spi_rw_restricted = 0;
 	int desc_valid = 0;
 	struct ich_descriptors desc = {{ 0 }};
@@ -1655,6 +1835,17 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 		}
 		free(arg);
 
+		arg = extract_programmer_param("ich_spi_window");
+		if (arg && !strcmp(arg, "no")) {
+			ich_spi_window = 0;
+			msg_pspew("BIOS window disabled.\n");
+		} else if (arg && strcmp(arg, "yes")) {
+			msg_perr("Unknown argument for ich_spi_window: \"%s\" (not \"yes\" or \"no\").\n", arg);
+			free(arg);
+			return ERROR_FATAL;
+		}
+		free(arg);
+
 		tmp2 = mmio_readw(ich_spibar + ICH9_REG_HSFS);
 		msg_pdbg("0x04: 0x%04x (HSFS)\n", tmp2);
 		prettyprint_ich9_reg_hsfs(tmp2);
@@ -1682,6 +1873,8 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 		if (desc_valid) {
 			tmp = mmio_readl(ich_spibar + ICH9_REG_FRAP);
 			msg_pdbg("0x50: 0x%08x (FRAP)\n", tmp);
+			ich_frap = tmp;
+			ich_frap_valid = 1;
 			msg_pdbg("BMWAG 0x%02x, ", ICH_BMWAG(tmp));
 			msg_pdbg("BMRAG 0x%02x, ", ICH_BMRAG(tmp));
 			msg_pdbg("BRWA 0x%02x, ", ICH_BRWA(tmp));
@@ -1785,6 +1978,9 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 			ich_spi_mode = ich_hwseq;
 		}
 
+		if (desc_valid && ich_spi_window)
+			ich_init_bios_window();
+
 		if (ich_spi_mode == ich_hwseq) {
 			if (!desc_valid) {
 				msg_perr("Hardware sequencing was requested "
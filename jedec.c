@@ -23,10 +23,13 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <stdlib.h>
 #include "flash.h"
 #include "chipdrivers.h"
 
 #define MAX_REFLASH_TRIES 0x10
+/* Number of bytes programmed before they are read back in one go. */
+#define WRITE_RUN_SIZE 4096
 #define MASK_FULL 0xffff
 #define MASK_2AA 0x7ff
 #define MASK_AAA 0xfff
@@ -379,97 +382,100 @@ static int erase_chip_jedec_common(struct flashctx *flash, unsigned int mask)
 	return 0;
 }
 
-static int write_byte_program_jedec_common(const struct flashctx *flash, const uint8_t *src,
-					   chipaddr dst, unsigned int mask)
+/* Program one byte with the JEDEC byte program sequence and wait until the chip is done. */
+static void program_byte_jedec_common(const struct flashctx *flash, uint8_t data, chipaddr dst, unsigned int mask)
 {
-	int tried = 0, failed = 0;
-	chipaddr bios = flash->virtual_memory;
-
-	/* If the data is 0xFF, don't program it and don't complain. */
-	if (*src == 0xFF) {
-		return 0;
-	}
-
-retry:
 	/* Issue JEDEC Byte Program command */
 	start_program_jedec_common(flash, mask);
 
 	/* transfer data from source to destination */
-	chip_writeb(flash, *src, dst);
-	toggle_ready_jedec(flash, bios);
-
-	if (chip_readb(flash, dst) != *src && tried++ < MAX_REFLASH_TRIES) {
-		goto retry;
-	}
+	chip_writeb(flash, data, dst);
+	toggle_ready_jedec(flash, flash->virtual_memory);
+}
 
-	if (tried >= MAX_REFLASH_TRIES)
-		failed = 1;
+/* Program a byte which did not read back correctly again, up to MAX_REFLASH_TRIES times. */
+static int retry_byte_program_jedec_common(const struct flashctx *flash, uint8_t data, chipaddr dst,
+					   unsigned int mask)
+{
+	int tried;
 
-	return failed;
+	for (tried = 0; tried < MAX_REFLASH_TRIES; tried++) {
+		program_byte_jedec_common(flash, data, dst, mask);
+		if (chip_readb(flash, dst) == data)
+			return 0;
+	}
+	return 1;
 }
 
-/* chunksize is 1 */
+/*
+ * chunksize is 1
+ * The bytes are programmed in runs of WRITE_RUN_SIZE and each run is read back at once, which is much faster
+ * than reading every byte right after programming it on most programmers. Only bytes which did not read back
+ * correctly are retried.
+ */
 int write_jedec_1(struct flashctx *flash, const uint8_t *src, unsigned int start,
 		  unsigned int len)
 {
-	int i, failed = 0;
-	chipaddr dst = flash->virtual_memory + start;
-	chipaddr olddst;
-	unsigned int mask;
-
-	mask = getaddrmask(flash->chip);
-
-	olddst = dst;
-	for (i = 0; i < len; i++) {
-		if (write_byte_program_jedec_common(flash, src, dst, mask))
-			failed = 1;
-		dst++, src++;
+	unsigned int i, pos, runlen;
+	int failed = 0;
+	const chipaddr dst = flash->virtual_memory + start;
+	const unsigned int mask = getaddrmask(flash->chip);
+	uint8_t readbuf[WRITE_RUN_SIZE];
+
+	for (pos = 0; pos < len; pos += runlen) {
+		runlen = min(len - pos, WRITE_RUN_SIZE);
+		for (i = pos; i < pos + runlen; i++) {
+			/* If the data is 0xFF, don't program it and don't complain. */
+			if (src[i] != 0xFF)
+				program_byte_jedec_common(flash, src[i], dst + i, mask);
+		}
+		chip_readn(flash, readbuf, dst + pos, runlen);
+		for (i = pos; i < pos + runlen; i++) {
+			if (src[i] != 0xFF && readbuf[i - pos] != src[i] &&
+			    retry_byte_program_jedec_common(flash, src[i], dst + i, mask))
+				failed = 1;
+		}
 	}
 	if (failed)
-		msg_cerr(" writing sector at 0x%" PRIxPTR " failed!\n", olddst);
+		msg_cerr(" writing sector at 0x%" PRIxPTR " failed!\n", dst);
 
 	return failed;
 }
 
-static int write_page_write_jedec_common(struct flashctx *flash, const uint8_t *src,
-					 unsigned int start, unsigned int page_size)
+/* Program a page or a part of it with the JEDEC page write sequence and wait until the chip is done. */
+static void program_page_jedec_common(const struct flashctx *flash, const uint8_t *src, unsigned int start,
+				      unsigned int len, unsigned int mask)
 {
-	int i, tried = 0, failed;
-	const uint8_t *s = src;
-	chipaddr bios = flash->virtual_memory;
-	chipaddr dst = bios + start;
-	chipaddr d = dst;
-	unsigned int mask;
+	const chipaddr dst = flash->virtual_memory + start;
+	unsigned int i;
 
-	mask = getaddrmask(flash->chip);
-
-retry:
 	/* Issue JEDEC Start Program command */
 	start_program_jedec_common(flash, mask);
 
 	/* transfer data from source to destination */
-	for (i = 0; i < page_size; i++) {
+	for (i = 0; i < len; i++) {
 		/* If the data is 0xFF, don't program it */
-		if (*src != 0xFF)
-			chip_writeb(flash, *src, dst);
-		dst++;
-		src++;
+		if (src[i] != 0xFF)
+			chip_writeb(flash, src[i], dst + i);
 	}
 
-	toggle_ready_jedec(flash, dst - 1);
+	toggle_ready_jedec(flash, dst + len - 1);
+}
 
-	dst = d;
-	src = s;
-	failed = verify_range(flash, src, start, page_size);
+/* Program a page which failed verification again, up to MAX_REFLASH_TRIES times. */
+static int retry_page_write_jedec_common(struct flashctx *flash, const uint8_t *src, unsigned int start,
+					 unsigned int len, unsigned int mask)
+{
+	int tried;
 
-	if (failed && tried++ < MAX_REFLASH_TRIES) {
+	for (tried = 0; tried < MAX_REFLASH_TRIES; tried++) {
 		msg_cerr("retrying.\n");
-		goto retry;
-	}
-	if (failed) {
-		msg_cerr(" page 0x%" PRIxPTR " failed!\n", (d - bios) / page_size);
+		program_page_jedec_common(flash, src, start, len, mask);
+		if (!verify_range(flash, src, start, len))
+			return 0;
 	}
-	return failed;
+	msg_cerr(" page 0x%x failed!\n", start / flash->chip->page_size);
+	return 1;
 }
 
 /* chunksize is page_size */
@@ -477,40 +483,73 @@ retry:
  * Write a part of the flash chip.
  * FIXME: Use the chunk code from Michael Karcher instead.
  * This function is a slightly modified copy of spi_write_chunked.
- * Each page is written separately in chunks with a maximum size of chunksize.
+ * Each page is written separately in chunks with a maximum size of chunksize. The pages are programmed in runs
+ * of about WRITE_RUN_SIZE bytes and each run is read back at once, only pages which differ are retried.
  */
 int write_jedec(struct flashctx *flash, const uint8_t *buf, unsigned int start,
 		int unsigned len)
 {
-	unsigned int i, starthere, lenhere;
+	unsigned int i, j, run, starthere, lenhere, runstart, runlen;
+	size_t diff;
+	int ret = 0;
 	/* FIXME: page_size is the wrong variable. We need max_writechunk_size
 	 * in struct flashctx to do this properly. All chips using
 	 * write_jedec have page_size set to max_writechunk_size, so
 	 * we're OK for now.
 	 */
 	unsigned int page_size = flash->chip->page_size;
+	const unsigned int last = (start + len - 1) / page_size;
+	const unsigned int pages_per_run = max(WRITE_RUN_SIZE / page_size, 1);
+	const unsigned int mask = getaddrmask(flash->chip);
+	uint8_t *readbuf;
+
+	readbuf = malloc(pages_per_run * page_size);
+	if (!readbuf) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
 
-	/* Warning: This loop has a very unusual condition and body.
-	 * The loop needs to go through each page with at least one affected
+	/* Warning: These loops have a very unusual condition and body.
+	 * They need to go through each page with at least one affected
 	 * byte. The lowest page number is (start / page_size) since that
 	 * division rounds down. The highest page number we want is the page
 	 * where the last byte of the range lives. That last byte has the
 	 * address (start + len - 1), thus the highest page number is
 	 * (start + len - 1) / page_size. Since we want to include that last
-	 * page as well, the loop condition uses <=.
+	 * page as well, the loop conditions use <=.
 	 */
-	for (i = start / page_size; i <= (start + len - 1) / page_size; i++) {
-		/* Byte position of the first byte in the range in this page. */
-		/* starthere is an offset to the base address of the chip. */
-		starthere = max(start, i * page_size);
-		/* Length of bytes in the range in this page. */
-		lenhere = min(start + len, (i + 1) * page_size) - starthere;
-
-		if (write_page_write_jedec_common(flash, buf + starthere - start, starthere, lenhere))
-			return 1;
+	for (run = start / page_size; run <= last; run += pages_per_run) {
+		runstart = max(start, run * page_size);
+		runlen = min(start + len, (run + pages_per_run) * page_size) - runstart;
+		for (i = run; i < run + pages_per_run && i <= last; i++) {
+			/* Byte position of the first byte in the range in this page. */
+			/* starthere is an offset to the base address of the chip. */
+			starthere = max(start, i * page_size);
+			/* Length of bytes in the range in this page. */
+			lenhere = min(start + len, (i + 1) * page_size) - starthere;
+			program_page_jedec_common(flash, buf + starthere - start, starthere, lenhere, mask);
+		}
+
+		chip_readn(flash, readbuf, flash->virtual_memory + runstart, runlen);
+		for (i = run; i < run + pages_per_run && i <= last; i++) {
+			starthere = max(start, i * page_size);
+			lenhere = min(start + len, (i + 1) * page_size) - starthere;
+			j = starthere - runstart;
+			diff = buf_first_diff(buf + starthere - start, readbuf + j, lenhere);
+			if (diff == lenhere)
+				continue;
+			msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x, ", starthere + (unsigned int)diff,
+				 buf[starthere - start + diff], readbuf[j + diff]);
+			if (retry_page_write_jedec_common(flash, buf + starthere - start, starthere, lenhere, mask)) {
+				ret = 1;
+				goto out;
+			}
+		}
 	}
 
-	return 0;
+out:
+	free(readbuf);
+	return ret;
 }
 
 /* erase chip with block_erase() prototype */
@@ -23,71 +23,183 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
 #include "flash.h"
 #include "programmer.h"
 
-#define MAX_ROMLAYOUT	32
-
 typedef struct {
 	chipoff_t start;
 	chipoff_t end;
 	unsigned int included;
-	char name[256];
+	unsigned int locked;	/* The host may not read or write this region. */
+	char *name;
 } romentry_t;
 
-/* rom_entries store the entries specified in a layout file and associated run-time data */
-static romentry_t rom_entries[MAX_ROMLAYOUT];
+/* rom_entries store the entries specified in a layout file and associated run-time data. The array grows as
+ * needed; max_rom_entries is its allocated size. */
+static romentry_t *rom_entries = NULL;
 static int num_rom_entries = 0; /* the number of successfully parsed rom_entries */
+static int max_rom_entries = 0;
 
 /* include_args holds the arguments specified at the command line with -i. They must be processed at some point
  * so that desired regions are marked as "included" in the rom_entries list. */
-static char *include_args[MAX_ROMLAYOUT];
+static char **include_args = NULL;
 static int num_include_args = 0; /* the number of valid include_args. */
+static int max_include_args = 0;
+
+/*
+ * The included entries sorted by their start address. cover is the entry reaching furthest among this one and
+ * all before it, so the entry containing an address (if any) is found with one binary search even if entries
+ * overlap. The index is rebuilt lazily whenever the set of included entries has changed.
+ */
+struct romentry_index {
+	romentry_t *entry;
+	romentry_t *cover;
+};
+static struct romentry_index *included_index = NULL;
+static int num_included_index = 0;
+static bool included_index_valid = false;
+
+static uint16_t read_le16(const uint8_t *buf, unsigned int offset)
+{
+	return buf[offset] | buf[offset + 1] << 8;
+}
+
+static uint32_t read_le32(const uint8_t *buf, unsigned int offset)
+{
+	return read_le16(buf, offset) | (uint32_t)read_le16(buf, offset + 2) << 16;
+}
+
+/* Grow the array at @array holding @max elements of @size bytes so that it can hold at least @needed ones. */
+static void *grow_array(void *array, int *max, int needed, size_t size)
+{
+	if (needed <= *max)
+		return array;
+	*max = *max ? *max * 2 : 16;
+	if (*max < needed)
+		*max = needed;
+	array = realloc(array, *max * size);
+	if (!array) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	return array;
+}
+
+/* Append a region covering @start to @end named by the @namelen first characters of @name. */
+static romentry_t *add_romentry(chipoff_t start, chipoff_t end, const char *name, size_t namelen)
+{
+	romentry_t *entry;
+
+	rom_entries = grow_array(rom_entries, &max_rom_entries, num_rom_entries + 1, sizeof(*rom_entries));
+	entry = &rom_entries[num_rom_entries];
+	entry->name = malloc(namelen + 1);
+	if (!entry->name) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	memcpy(entry->name, name, namelen);
+	entry->name[namelen] = '\0';
+	entry->start = start;
+	entry->end = end;
+	entry->included = 0;
+	entry->locked = 0;
+	num_rom_entries++;
+	included_index_valid = false;
+	return entry;
+}
 
 #ifndef __LIBPAYLOAD__
-int read_romlayout(const char *name)
+/* Read the whole file @name into a newly allocated, NUL-terminated buffer. Its size is stored at @len. */
+static char *read_whole_file(const char *name, size_t *len)
 {
-	FILE *romlayout;
-	char tempstr[256];
-	int i;
+	FILE *file;
+	char *buf = NULL;
+	size_t size = 0, max = 0;
+
+	file = fopen(name, "rb");
+	if (!file) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	do {
+		if (size == max) {
+			max = max ? max * 2 : 4096;
+			buf = realloc(buf, max + 1);
+			if (!buf) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+		}
+		size += fread(buf + size, 1, max - size, file);
+	} while (size == max);
+	if (ferror(file)) {
+		msg_gerr("Error: reading file \"%s\" failed.\n", name);
+		free(buf);
+		buf = NULL;
+	} else {
+		buf[size] = '\0';
+		*len = size;
+	}
+	(void)fclose(file);
+	return buf;
+}
 
-	romlayout = fopen(name, "r");
+/*
+ * Parse a layout file. Every line holds a region as "startaddr:endaddr name" with hexadecimal addresses.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+int read_romlayout(const char *name)
+{
+	char *buf, *line, *next;
+	size_t len;
+	int i, lineno = 0, ret = 0;
 
-	if (!romlayout) {
+	buf = read_whole_file(name, &len);
+	if (!buf) {
 		msg_gerr("ERROR: Could not open ROM layout (%s).\n",
 			name);
 		return -1;
 	}
+	if (strlen(buf) != len) {
+		msg_gerr("Error parsing layout file: It contains a NUL character.\n");
+		free(buf);
+		return 1;
+	}
 
-	while (!feof(romlayout)) {
-		char *tstr1, *tstr2;
+	for (line = buf; line; line = next) {
+		unsigned long start, end;
+		char *p, *name_start;
 
-		if (num_rom_entries >= MAX_ROMLAYOUT) {
-			msg_gerr("Maximum number of ROM images (%i) in layout "
-				 "file reached.\n", MAX_ROMLAYOUT);
-			(void)fclose(romlayout);
-			return 1;
-		}
-		if (2 != fscanf(romlayout, "%s %s\n", tempstr, rom_entries[num_rom_entries].name))
-			continue;
-#if 0
-		// fscanf does not like arbitrary comments like that :( later
-		if (tempstr[0] == '#') {
+		lineno++;
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		p = line + strspn(line, " \t\r");
+		if (*p == '\0' || *p == '#')
 			continue;
-		}
-#endif
-		tstr1 = strtok(tempstr, ":");
-		tstr2 = strtok(NULL, ":");
-		if (!tstr1 || !tstr2) {
-			msg_gerr("Error parsing layout file. Offending string: \"%s\"\n", tempstr);
-			(void)fclose(romlayout);
-			return 1;
-		}
-		rom_entries[num_rom_entries].start = strtol(tstr1, (char **)NULL, 16);
-		rom_entries[num_rom_entries].end = strtol(tstr2, (char **)NULL, 16);
-		rom_entries[num_rom_entries].included = 0;
-		num_rom_entries++;
+
+		errno = 0;
+		start = strtoul(p, &p, 16);
+		if (*p != ':' || errno)
+			goto parse_error;
+		end = strtoul(p + 1, &p, 16);
+		if (errno || !strchr(" \t", *p) || start > UINT32_MAX || end > UINT32_MAX)
+			goto parse_error;
+		name_start = p + strspn(p, " \t");
+		p = name_start + strcspn(name_start, " \t\r");
+		if (p == name_start || p[strspn(p, " \t\r")] != '\0')
+			goto parse_error;
+		add_romentry(start, end, name_start, p - name_start);
+		continue;
+parse_error:
+		msg_gerr("Error parsing layout file in line %i. Offending string: \"%s\"\n", lineno, line);
+		ret = 1;
+		break;
 	}
+	free(buf);
+	if (ret)
+		return ret;
 
 	for (i = 0; i < num_rom_entries; i++) {
 		msg_gdbg("romlayout %08x - %08x named %s\n",
@@ -95,11 +207,364 @@ int read_romlayout(const char *name)
 			     rom_entries[i].end, rom_entries[i].name);
 	}
 
-	(void)fclose(romlayout);
+	return 0;
+}
+#endif
+
+/* The Intel flash descriptor occupies the first 4 kB of the flash chip. Its signature is found at offset 0 on
+ * ICH8 and at offset 16 on all later chipsets. See ich_descriptors.h for the complete layout. */
+#define IFD_SIZE		4096
+#define IFD_SIGNATURE		0x0ff0a55a
+#define IFD_NUM_REGIONS		5
+
+/* The region names in the order of the FLREG registers. */
+static const char *const ifd_region_names[IFD_NUM_REGIONS] = { "fd", "bios", "me", "gbe", "pd" };
+
+struct ifd_region {
+	chipoff_t start;
+	chipoff_t end;
+	bool used;
+	bool locked;
+};
+
+/*
+ * Decode the regions of the descriptor in @buf and whether the host (the BIOS master) may read and write them
+ * according to FLMSTR1. Returns 0 on success and 1 if @buf contains no valid descriptor.
+ */
+static int parse_ifd(const uint8_t *buf, struct ifd_region regions[IFD_NUM_REGIONS])
+{
+	unsigned int sig, frba, fmba, i;
+	uint32_t flmstr1;
+
+	if (read_le32(buf, 16) == IFD_SIGNATURE)
+		sig = 16;
+	else if (read_le32(buf, 0) == IFD_SIGNATURE)
+		sig = 0;
+	else
+		return 1;
+
+	frba = ((read_le32(buf, sig + 4) >> 16) & 0xff) << 4;
+	fmba = (read_le32(buf, sig + 8) & 0xff) << 4;
+	if (frba + IFD_NUM_REGIONS * 4 > IFD_SIZE || fmba + 4 > IFD_SIZE) {
+		msg_gdbg("Flash descriptor points outside of itself (FRBA 0x%03x, FMBA 0x%03x).\n", frba, fmba);
+		return 1;
+	}
 
+	flmstr1 = read_le32(buf, fmba);
+	for (i = 0; i < IFD_NUM_REGIONS; i++) {
+		const uint32_t flreg = read_le32(buf, frba + i * 4);
+
+		regions[i].start = (flreg << 12) & 0x01fff000;
+		regions[i].end = ((flreg >> 4) & 0x01fff000) | 0xfff;
+		/* Unused regions have a base above their limit. */
+		regions[i].used = regions[i].start <= regions[i].end;
+		regions[i].locked = !(flmstr1 & (1 << (16 + i))) || !(flmstr1 & (1 << (24 + i)));
+	}
 	return 0;
 }
+
+#ifndef __LIBPAYLOAD__
+/* Read the first IFD_SIZE bytes of the image file @filename into @buf. */
+static int read_ifd_from_file(uint8_t *buf, const char *filename)
+{
+	FILE *image;
+	int ret = 0;
+
+	image = fopen(filename, "rb");
+	if (!image) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (fread(buf, 1, IFD_SIZE, image) != IFD_SIZE) {
+		msg_gerr("Error: Failed to read the flash descriptor from \"%s\".\n", filename);
+		ret = 1;
+	}
+	(void)fclose(image);
+	return ret;
+}
+#endif
+
+/*
+ * Set up the layout from the Intel flash descriptor. The descriptor on the chip is preferred because that is
+ * the one the chipset enforces. If it can't be read or is not valid, the one at the start of the image file
+ * @filename is used (if given).
+ * If @internal is set, the chip is accessed through the chipset. Regions the host may not read or write are
+ * then marked as locked; they are skipped by process_include_args() and thus neither read, erased nor
+ * written. The permissions are taken from the chipset's live FRAP register if known, otherwise from the
+ * descriptor on the chip. External programmers access the chip directly, so nothing is locked for them.
+ * Returns 0 on success, 1 on failure.
+ */
+int read_ifd_layout(struct flashctx *flash, const char *filename, bool internal)
+{
+	struct ifd_region regions[IFD_NUM_REGIONS], image_regions[IFD_NUM_REGIONS];
+	uint8_t buf[IFD_SIZE];
+	bool on_chip = false, in_image = false;
+	int i;
+
+	/* The arrays are compared as a whole below, padding included. */
+	memset(regions, 0, sizeof(regions));
+	memset(image_regions, 0, sizeof(image_regions));
+	if (num_rom_entries) {
+		msg_gerr("A layout has already been loaded.\n");
+		return 1;
+	}
+	if (flash->chip->total_size * 1024 < IFD_SIZE) {
+		msg_gerr("The flash chip is too small to contain a flash descriptor.\n");
+		return 1;
+	}
+
+	if (flash->chip->read && !flash->chip->read(flash, buf, 0, IFD_SIZE))
+		on_chip = !parse_ifd(buf, regions);
+	if (!on_chip)
+		msg_gdbg("No valid flash descriptor found on the chip.\n");
+#ifndef __LIBPAYLOAD__
+	if (filename) {
+		if (read_ifd_from_file(buf, filename))
+			return 1;
+		in_image = !parse_ifd(buf, image_regions);
+		if (!in_image)
+			msg_gdbg("No valid flash descriptor found in the image.\n");
+	}
+#endif
+	if (!on_chip && !in_image) {
+		msg_gerr("No valid Intel flash descriptor found.\n");
+		return 1;
+	}
+	if (!on_chip) {
+		/* Without a descriptor on the chip, the chipset does not restrict any access. */
+		msg_ginfo("Using the flash descriptor of the image.\n");
+		for (i = 0; i < IFD_NUM_REGIONS; i++)
+			image_regions[i].locked = false;
+		memcpy(regions, image_regions, sizeof(regions));
+	} else if (in_image && memcmp(regions, image_regions, sizeof(regions))) {
+		msg_gwarn("Warning: The flash descriptor of the image differs from the one on the chip.\n"
+			  "Using the one on the chip.\n");
+	}
+
+	for (i = 0; i < IFD_NUM_REGIONS; i++) {
+		if (!internal)
+			regions[i].locked = false;
+#if CONFIG_INTERNAL == 1 && (defined(__i386__) || defined(__x86_64__))
+		else if (ich_region_locked(i) >= 0)
+			regions[i].locked = ich_region_locked(i);
 #endif
+		if (!regions[i].used)
+			continue;
+		add_romentry(regions[i].start, regions[i].end, ifd_region_names[i],
+			     strlen(ifd_region_names[i]))->locked = regions[i].locked;
+		msg_gdbg("Descriptor region %08x - %08x named %s%s\n", regions[i].start, regions[i].end,
+			 ifd_region_names[i], regions[i].locked ? " (locked)" : "");
+	}
+	return 0;
+}
+
+/*
+ * An FMAP is a header followed by an array of areas, all packed and little-endian:
+ *	header:	char signature[8], uint8_t ver_major, uint8_t ver_minor, uint64_t base, uint32_t size,
+ *		char name[32], uint16_t nareas
+ *	area:	uint32_t offset, uint32_t size, char name[32], uint16_t flags
+ * It may be located anywhere in the image.
+ */
+#define FMAP_SIGNATURE		"__FMAP__"
+#define FMAP_SIGNATURE_LEN	8
+#define FMAP_VER_MAJOR		1
+#define FMAP_NAME_LEN		32
+#define FMAP_HEADER_SIZE	56
+#define FMAP_AREA_SIZE		42
+/* On the chip, the FMAP is only searched for at offsets aligned to this. */
+#define FMAP_CHIP_ALIGN		256
+/* Number of offsets probed with separate reads before the rest of the chip is read and searched at once. */
+#define FMAP_CHIP_MAX_PROBES	64
+
+/*
+ * Check the FMAP header at @hdr found at @offset of a chip or image of @size bytes.
+ * Returns the size of the whole FMAP including its areas, or 0 if it is not a valid header.
+ */
+static unsigned int fmap_check_header(const uint8_t *hdr, unsigned int offset, unsigned int size)
+{
+	unsigned int nareas;
+
+	if (memcmp(hdr, FMAP_SIGNATURE, FMAP_SIGNATURE_LEN) || hdr[8] != FMAP_VER_MAJOR)
+		return 0;
+	nareas = read_le16(hdr, 54);
+	if (!nareas || size - offset < FMAP_HEADER_SIZE + nareas * FMAP_AREA_SIZE)
+		return 0;
+	return FMAP_HEADER_SIZE + nareas * FMAP_AREA_SIZE;
+}
+
+/*
+ * Add the areas of the validated FMAP at @fmap to the layout of a chip of @chip_size bytes.
+ * Returns 0 on success, 1 if an area does not fit on the chip. Nothing is added then.
+ */
+static int add_fmap_areas(const uint8_t *fmap, unsigned int chip_size)
+{
+	const unsigned int nareas = read_le16(fmap, 54);
+	unsigned int i;
+
+	for (i = 0; i < nareas; i++) {
+		const uint8_t *const area = fmap + FMAP_HEADER_SIZE + i * FMAP_AREA_SIZE;
+		const uint32_t offset = read_le32(area, 0), size = read_le32(area, 4);
+
+		if ((uint64_t)offset + size > chip_size) {
+			msg_gerr("Error: FMAP area \"%.*s\" at 0x%08x with size 0x%08x does not fit on the "
+				 "%u kB flash chip.\n", FMAP_NAME_LEN, (const char *)area + 8, offset, size,
+				 chip_size / 1024);
+			return 1;
+		}
+	}
+	for (i = 0; i < nareas; i++) {
+		const uint8_t *const area = fmap + FMAP_HEADER_SIZE + i * FMAP_AREA_SIZE;
+		const char *const name = (const char *)area + 8;
+		const uint32_t offset = read_le32(area, 0), size = read_le32(area, 4);
+
+		if (!size) {
+			msg_gdbg("Ignoring empty FMAP area \"%.*s\".\n", FMAP_NAME_LEN, name);
+			continue;
+		}
+		add_romentry(offset, offset + size - 1, name, strnlen(name, FMAP_NAME_LEN));
+		msg_gdbg("FMAP area %08x - %08x named %s\n", offset, offset + size - 1,
+			 rom_entries[num_rom_entries - 1].name);
+	}
+	return 0;
+}
+
+/*
+ * Read the whole chip and search it for an FMAP at all offsets aligned to FMAP_CHIP_ALIGN, starting at
+ * @offset. Returns 0 if an FMAP was found, 1 if not and -1 on errors.
+ */
+static int read_fmap_from_chip_bulk(struct flashctx *flash, unsigned int offset)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	uint8_t *buf;
+	int ret = 1;
+
+	msg_gdbg("Reading the whole chip to search for an FMAP.\n");
+	buf = malloc(size);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	if (flash->chip->read(flash, buf, 0, size)) {
+		free(buf);
+		return -1;
+	}
+	for (; offset + FMAP_HEADER_SIZE <= size; offset += FMAP_CHIP_ALIGN) {
+		if (!fmap_check_header(buf + offset, offset, size))
+			continue;
+		msg_gdbg("Found an FMAP at 0x%06x on the chip.\n", offset);
+		ret = add_fmap_areas(buf + offset, size) ? -1 : 0;
+		break;
+	}
+	free(buf);
+	return ret;
+}
+
+/*
+ * Search the chip for an FMAP and add its areas to the layout. Aligned offsets are probed coarsest alignment
+ * first (the start of each half, then of each quarter and so on), so only a few bytes are read for a typical
+ * layout. After FMAP_CHIP_MAX_PROBES separate reads, the chip is read once as a whole instead, which is
+ * cheaper than probing the remaining offsets one by one.
+ * Returns 0 if an FMAP was found, 1 if not and -1 on errors.
+ */
+static int read_fmap_from_chip(struct flashctx *flash)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	uint8_t hdr[FMAP_HEADER_SIZE], *fmap;
+	unsigned int stride, offset, len, probes = 0;
+	int ret;
+
+	if (!flash->chip->read)
+		return 1;
+	for (stride = size; stride >= FMAP_CHIP_ALIGN; stride /= 2) {
+		/* Offsets aligned to twice the stride have been checked already (except 0 in the first round). */
+		for (offset = stride == size ? 0 : stride; offset + FMAP_HEADER_SIZE <= size; offset += 2 * stride) {
+			/* All coarser offsets were checked, so a bulk search can skip everything below @stride. */
+			if (++probes > FMAP_CHIP_MAX_PROBES)
+				return read_fmap_from_chip_bulk(flash, stride);
+			if (flash->chip->read(flash, hdr, offset, FMAP_SIGNATURE_LEN))
+				return -1;
+			if (memcmp(hdr, FMAP_SIGNATURE, FMAP_SIGNATURE_LEN))
+				continue;
+			if (flash->chip->read(flash, hdr, offset, FMAP_HEADER_SIZE))
+				return -1;
+			len = fmap_check_header(hdr, offset, size);
+			if (!len)
+				continue;
+			msg_gdbg("Found an FMAP at 0x%06x on the chip.\n", offset);
+			fmap = malloc(len);
+			if (!fmap) {
+				msg_gerr("Out of memory!\n");
+				exit(1);
+			}
+			ret = flash->chip->read(flash, fmap, offset, len) || add_fmap_areas(fmap, size) ? -1 : 0;
+			free(fmap);
+			return ret;
+		}
+	}
+	return 1;
+}
+
+#ifndef __LIBPAYLOAD__
+/* Search the image file @filename for an FMAP at any offset and add its areas to the layout of a chip of
+ * @chip_size bytes. Returns 0 if one was found, 1 if not and -1 on errors. */
+static int read_fmap_from_file(const char *filename, unsigned int chip_size)
+{
+	int ret = 1;
+	unsigned int offset, size;
+	size_t len;
+	uint8_t *buf;
+
+	buf = (uint8_t *)read_whole_file(filename, &len);
+	if (!buf)
+		return -1;
+	if (len > UINT_MAX) {
+		free(buf);
+		return 1;
+	}
+	size = len;
+	for (offset = 0; offset + FMAP_HEADER_SIZE <= size; offset++) {
+		const uint8_t *const hit = memchr(buf + offset, FMAP_SIGNATURE[0], size - offset);
+
+		if (!hit)
+			break;
+		offset = hit - buf;
+		if (offset + FMAP_HEADER_SIZE <= size && fmap_check_header(hit, offset, size)) {
+			msg_gdbg("Found an FMAP at 0x%06x in the image.\n", offset);
+			ret = add_fmap_areas(hit, chip_size) ? -1 : 0;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+#endif
+
+/*
+ * Set up the layout from the FMAP of the image file @filename or, if it has none or no file is given, from the
+ * one on the chip. The image is searched at any offset, the chip only at multiples of FMAP_CHIP_ALIGN.
+ * Returns 0 on success, 1 on failure.
+ */
+int read_fmap_layout(struct flashctx *flash, const char *filename)
+{
+	int ret;
+
+	if (num_rom_entries) {
+		msg_gerr("A layout has already been loaded.\n");
+		return 1;
+	}
+#ifndef __LIBPAYLOAD__
+	if (filename) {
+		ret = read_fmap_from_file(filename, flash->chip->total_size * 1024);
+		if (ret <= 0)
+			return ret < 0;
+		msg_gdbg("No FMAP found in the image.\n");
+	}
+#endif
+	ret = read_fmap_from_chip(flash);
+	if (ret > 0)
+		msg_gerr("No valid FMAP found.\n");
+	return ret != 0;
+}
 
 /* returns the index of the entry (or a negative value if it is not found) */
 static int find_include_arg(const char *const name)
@@ -115,11 +580,6 @@ static int find_include_arg(const char *const name)
 /* register an include argument (-i) for later processing */
 int register_include_arg(char *name)
 {
-	if (num_include_args >= MAX_ROMLAYOUT) {
-		msg_gerr("Too many regions included (%i).\n", num_include_args);
-		return 1;
-	}
-
 	if (name == NULL) {
 		msg_gerr("<NULL> is a bad region name.\n");
 		return 1;
@@ -130,6 +590,7 @@ int register_include_arg(char *name)
 		return 1;
 	}
 
+	include_args = grow_array(include_args, &max_include_args, num_include_args + 1, sizeof(*include_args));
 	include_args[num_include_args] = name;
 	num_include_args++;
 	return 0;
@@ -155,6 +616,25 @@ static int find_romentry(char *name)
 	return -1;
 }
 
+/* Exclude included regions the host has no access to. Returns the number of regions still included. */
+static int skip_locked_romentries(void)
+{
+	int i, included = 0;
+
+	for (i = 0; i < num_rom_entries; i++) {
+		if (!rom_entries[i].included)
+			continue;
+		if (rom_entries[i].locked) {
+			msg_ginfo("Skipping region \"%s\" (0x%06x-0x%06x), the host has no access to it.\n",
+				  rom_entries[i].name, rom_entries[i].start, rom_entries[i].end);
+			rom_entries[i].included = 0;
+			continue;
+		}
+		included++;
+	}
+	return included;
+}
+
 /* process -i arguments
  * returns 0 to indicate success, >0 to indicate failure
  */
@@ -163,8 +643,24 @@ int process_include_args(void)
 	int i;
 	unsigned int found = 0;
 
-	if (num_include_args == 0)
+	/* Everything below may change which entries are included. */
+	included_index_valid = false;
+	if (num_include_args == 0) {
+		/* Without -i, a layout with locked regions selects everything the host can access. */
+		for (i = 0; i < num_rom_entries; i++) {
+			if (rom_entries[i].locked)
+				break;
+		}
+		if (i == num_rom_entries)
+			return 0;
+		for (i = 0; i < num_rom_entries; i++)
+			rom_entries[i].included = 1;
+		if (!skip_locked_romentries()) {
+			msg_gerr("None of the regions is accessible.\n");
+			return 1;
+		}
 		return 0;
+	}
 
 	/* User has specified an area, but no layout file is loaded. */
 	if (num_rom_entries == 0) {
@@ -188,49 +684,136 @@ int process_include_args(void)
 	for (i = 1; i < num_include_args; i++)
 		msg_ginfo(", \"%s\"", include_args[i]);
 	msg_ginfo(".\n");
+
+	if (!skip_locked_romentries()) {
+		msg_gerr("None of the requested regions is accessible.\n");
+		return 1;
+	}
 	return 0;
 }
 
 void layout_cleanup(void)
 {
 	int i;
-	for (i = 0; i < num_include_args; i++) {
+	for (i = 0; i < num_include_args; i++)
 		free(include_args[i]);
-		include_args[i] = NULL;
-	}
+	free(include_args);
+	include_args = NULL;
 	num_include_args = 0;
+	max_include_args = 0;
+
+	for (i = 0; i < num_rom_entries; i++)
+		free(rom_entries[i].name);
+	free(rom_entries);
+	rom_entries = NULL;
+	num_rom_entries = 0;
+	max_rom_entries = 0;
+
+	free(included_index);
+	included_index = NULL;
+	num_included_index = 0;
+	included_index_valid = false;
+}
+
+static int compare_romentry_index(const void *a, const void *b)
+{
+	const romentry_t *const ea = ((const struct romentry_index *)a)->entry;
+	const romentry_t *const eb = ((const struct romentry_index *)b)->entry;
+
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	if (ea->end != eb->end)
+		return ea->end < eb->end ? -1 : 1;
+	/* First come, first serve for identical regions. */
+	return ea < eb ? -1 : ea > eb;
+}
+
+static void update_included_index(void)
+{
+	int i, count = 0;
 
+	if (included_index_valid)
+		return;
+	free(included_index);
+	included_index = NULL;
 	for (i = 0; i < num_rom_entries; i++) {
-		rom_entries[i].included = 0;
+		if (rom_entries[i].included)
+			count++;
 	}
-	num_rom_entries = 0;
+	num_included_index = count;
+	included_index_valid = true;
+	if (!count)
+		return;
+
+	included_index = malloc(count * sizeof(*included_index));
+	if (!included_index) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	count = 0;
+	for (i = 0; i < num_rom_entries; i++) {
+		if (rom_entries[i].included)
+			included_index[count++].entry = &rom_entries[i];
+	}
+	qsort(included_index, count, sizeof(*included_index), compare_romentry_index);
+	for (i = 0; i < count; i++) {
+		included_index[i].cover = included_index[i].entry;
+		if (i > 0 && included_index[i - 1].cover->end > included_index[i].entry->end)
+			included_index[i].cover = included_index[i - 1].cover;
+	}
+}
+
+/* Returns the index of the last included entry starting at or before @addr, or -1 if there is none. */
+static int find_included_index(chipoff_t addr)
+{
+	int lo = 0, hi = num_included_index;
+
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+
+		if (included_index[mid].entry->start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
 }
 
-romentry_t *get_next_included_romentry(unsigned int start)
+/* Returns the included entry containing @start, or else the first one beginning after it, or NULL. */
+static romentry_t *get_next_included_romentry(unsigned int start)
 {
 	int i;
-	unsigned int best_start = UINT_MAX;
-	romentry_t *best_entry = NULL;
-	romentry_t *cur;
 
-	/* First come, first serve for overlapping regions. */
-	for (i = 0; i < num_rom_entries; i++) {
-		cur = &rom_entries[i];
-		if (!cur->included)
-			continue;
-		/* Already past the current entry? */
-		if (start > cur->end)
-			continue;
-		/* Inside the current entry? */
-		if (start >= cur->start)
-			return cur;
-		/* Entry begins after start. */
-		if (best_start > cur->start) {
-			best_start = cur->start;
-			best_entry = cur;
-		}
+	update_included_index();
+	i = find_included_index(start);
+	if (i >= 0 && included_index[i].cover->end >= start)
+		return included_index[i].cover;
+	if (i + 1 < num_included_index)
+		return included_index[i + 1].entry;
+	return NULL;
+}
+
+/* Store the address ranges of all included regions in a newly allocated array at @ranges.
+ * Returns the number of ranges. If no region is included, 0 is returned and *ranges is set to NULL. */
+int get_included_ranges(struct flash_range **ranges)
+{
+	int i;
+
+	*ranges = NULL;
+	update_included_index();
+	if (!num_included_index)
+		return 0;
+
+	*ranges = malloc(num_included_index * sizeof(**ranges));
+	if (!*ranges) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	for (i = 0; i < num_included_index; i++) {
+		(*ranges)[i].start = included_index[i].entry->start;
+		(*ranges)[i].len = included_index[i].entry->end - included_index[i].entry->start + 1;
 	}
-	return best_entry;
+	return num_included_index;
 }
 
 /* Validate and - if needed - normalize layout entries. */
@@ -253,8 +836,20 @@ int normalize_romentries(const struct flashctx *flash)
 			ret = 1;
 		}
 	}
+	if (ret)
+		return ret;
 
-	return ret;
+	/* Overlapping regions are written as their union. */
+	update_included_index();
+	for (i = 1; i < num_included_index; i++) {
+		const romentry_t *const prev = included_index[i - 1].cover;
+
+		if (included_index[i].entry->start <= prev->end)
+			msg_gwarn("Warning: Included regions \"%s\" and \"%s\" overlap.\n", prev->name,
+				  included_index[i].entry->name);
+	}
+
+	return 0;
 }
 
 static int copy_old_content(struct flashctx *flash, int oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents, unsigned int start, unsigned int size)
@@ -284,10 +879,10 @@ int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *old
 	romentry_t *entry;
 	unsigned int size = flash->chip->total_size * 1024;
 
-	/* If no regions were specified for inclusion, assume
+	/* If no regions were selected for inclusion, assume
 	 * that the user wants to write the complete new image.
 	 */
-	if (num_include_args == 0)
+	if (!get_next_included_romentry(0))
 		return 0;
 
 	/* Non-included romentries are ignored.
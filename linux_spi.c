@@ -41,13 +41,21 @@
  * HummingBoard
  */
 
+/* Largest number of transfers in one message. Each command takes up to three of them. */
+#define LINUX_SPI_MAX_TRANSFERS	64
+/* Maximum number of pages linux_spi_write_256() sends in one message, each of them takes seven transfers. */
+#define LINUX_SPI_BATCH_PAGES	(LINUX_SPI_MAX_TRANSFERS / 7)
+
 static int fd = -1;
+/* Maximum number of bytes spidev accepts in one message. */
+static size_t max_kernel_buf_size;
 
 static int linux_spi_shutdown(void *data);
 static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  unsigned int readcnt,
 				  const unsigned char *txbuf,
 				  unsigned char *rxbuf);
+static int linux_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len);
 static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf,
@@ -55,15 +63,38 @@ static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 
 static const struct spi_master spi_master_linux = {
 	.type		= SPI_CONTROLLER_LINUX,
-	.max_data_read	= MAX_DATA_UNSPECIFIED, /* TODO? */
-	.max_data_write	= MAX_DATA_UNSPECIFIED, /* TODO? */
+	.features	= SPI_MASTER_FAST_READ | SPI_MASTER_4BA, /* multi-I/O: see linux_spi_init() */
+	.max_data_read	= MAX_DATA_UNSPECIFIED, /* Set in linux_spi_init() */
+	.max_data_write	= MAX_DATA_UNSPECIFIED, /* Set in linux_spi_init() */
 	.command	= linux_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= linux_spi_send_multicommand,
 	.read		= linux_spi_read,
 	.write_256	= linux_spi_write_256,
 	.write_aai	= default_spi_write_aai,
 };
 
+/* Read the size of the spidev transfer buffer, which limits the length of a message. */
+static size_t get_max_kernel_buf_size(void)
+{
+	/* The parameter is only exported if spidev is a module, the default is one page. */
+	const char *name = "/sys/module/spidev/parameters/bufsiz";
+	size_t result = (size_t)getpagesize();
+	unsigned long bufsiz;
+	FILE *fp;
+
+	fp = fopen(name, "rb");
+	if (!fp) {
+		msg_pdbg("Cannot open %s: %s, using the default of %zu bytes.\n", name, strerror(errno), result);
+		return result;
+	}
+	if (fscanf(fp, "%lu", &bufsiz) == 1 && bufsiz > JEDEC_READ_CMD_MAXLEN)
+		result = bufsiz;
+	else
+		msg_pdbg("Cannot parse %s, using the default of %zu bytes.\n", name, result);
+	fclose(fp);
+	return result;
+}
+
 int linux_spi_init(void)
 {
 	char *p, *endp, *dev;
@@ -72,6 +103,8 @@ int linux_spi_init(void)
 	/* SPI mode 0 (beware this also includes: MSB first, CS active low and others */
 	const uint8_t mode = SPI_MODE_0;
 	const uint8_t bits = 8;
+	uint32_t mode32;
+	struct spi_master mst = spi_master_linux;
 
 	p = extract_programmer_param("spispeed");
 	if (p && strlen(p)) {
@@ -127,7 +160,28 @@ int linux_spi_init(void)
 		return 1;
 	}
 
-	register_spi_master(&spi_master_linux);
+	/* The bus widths a device supports are configured by the kernel (e.g. spi-rx-bus-width in the device tree)
+	 * and reported in the upper bits of its mode. */
+	if (ioctl(fd, SPI_IOC_RD_MODE32, &mode32) == -1) {
+		msg_pdbg("%s: failed to read the SPI mode, using single I/O only: %s\n",
+			 __func__, strerror(errno));
+		mode32 = 0;
+	}
+	if (mode32 & (SPI_RX_DUAL | SPI_RX_QUAD))
+		mst.features |= SPI_MASTER_DUAL_OUT;
+	if (mode32 & SPI_RX_QUAD)
+		mst.features |= SPI_MASTER_QUAD_OUT;
+	if ((mode32 & SPI_RX_QUAD) && (mode32 & SPI_TX_QUAD))
+		mst.features |= SPI_MASTER_QUAD_IO;
+	msg_pdbg("Device supports %s reads.\n", (mst.features & SPI_MASTER_QUAD_OUT) ? "quad" :
+		 (mst.features & SPI_MASTER_DUAL_OUT) ? "dual" : "single I/O");
+
+	max_kernel_buf_size = get_max_kernel_buf_size();
+	msg_pdbg("%s: max_kernel_buf_size: %zu\n", __func__, max_kernel_buf_size);
+	mst.max_data_read = max_kernel_buf_size - JEDEC_READ_CMD_MAXLEN;
+	mst.max_data_write = max_kernel_buf_size - (JEDEC_BYTE_PROGRAM_4BA_OUTSIZE - 1);
+
+	register_spi_master(&mst);
 
 	return 0;
 }
@@ -141,55 +195,169 @@ static int linux_spi_shutdown(void *data)
 	return 0;
 }
 
-static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
-				  unsigned int readcnt,
-				  const unsigned char *txbuf,
-				  unsigned char *rxbuf)
+/* Append the transfers of @cmd to @msg, which holds @n transfers so far. Returns the new number of transfers. */
+static unsigned int linux_spi_add_transfers(struct spi_ioc_transfer *msg, unsigned int n,
+					    const struct spi_command *cmd)
 {
-	int iocontrol_code;
-	struct spi_ioc_transfer msg[2] = {
-		{
-			.tx_buf = (uint64_t)(uintptr_t)txbuf,
-			.len = writecnt,
-		},
-		{
-			.rx_buf = (uint64_t)(uintptr_t)rxbuf,
-			.len = readcnt,
-		},
-	};
+	/* The first write transfer carries the opcode only for quad I/O (1-4-4) commands. */
+	unsigned int opcnt = cmd->io_mode == SPI_IO_QUAD_IO ? 1 : cmd->writecnt;
+	unsigned int rx_nbits = cmd->io_mode == SPI_IO_DUAL_OUT ? 2 :
+				cmd->io_mode == SPI_IO_SINGLE ? 1 : 4;
 
-	if (fd == -1)
-		return -1;
-	/* The implementation currently does not support requests that
-	   don't start with sending a command. */
-	if (writecnt == 0)
-		return SPI_INVALID_LENGTH;
-
-	/* Just submit the first (write) request in case there is nothing
-	   to read. Otherwise submit both requests. */
-	if (readcnt == 0)
-		iocontrol_code = SPI_IOC_MESSAGE(1);
-	else
-		iocontrol_code = SPI_IOC_MESSAGE(2);
+	memset(&msg[n], 0, 3 * sizeof(*msg));
+	msg[n].tx_buf = (uint64_t)(uintptr_t)cmd->writearr;
+	msg[n].len = opcnt;
+	n++;
+	if (cmd->writecnt > opcnt) {
+		msg[n].tx_buf = (uint64_t)(uintptr_t)(cmd->writearr + opcnt);
+		msg[n].len = cmd->writecnt - opcnt;
+		msg[n].tx_nbits = 4;
+		n++;
+	}
+	if (cmd->readcnt) {
+		msg[n].rx_buf = (uint64_t)(uintptr_t)cmd->readarr;
+		msg[n].len = cmd->readcnt;
+		msg[n].rx_nbits = rx_nbits;
+		n++;
+	}
+	/* Deassert CS# before the next command of the same message. */
+	msg[n - 1].cs_change = 1;
+	return n;
+}
 
-	if (ioctl(fd, iocontrol_code, msg) == -1) {
+/* Send the @n transfers in @msg as one message. */
+static int linux_spi_send_message(struct spi_ioc_transfer *msg, unsigned int n)
+{
+	/* On the last transfer, cs_change would keep CS# asserted after the message. */
+	msg[n - 1].cs_change = 0;
+	if (ioctl(fd, SPI_IOC_MESSAGE(n), msg) == -1) {
 		msg_cerr("%s: ioctl: %s\n", __func__, strerror(errno));
 		return -1;
 	}
 	return 0;
 }
 
+/* Send as many commands as the kernel buffer allows in one message, each framed by its own CS# assertion. */
+static int linux_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	struct spi_ioc_transfer msg[LINUX_SPI_MAX_TRANSFERS];
+	unsigned int n = 0;
+	size_t total = 0;
+	int ret;
+
+	if (fd == -1)
+		return -1;
+
+	for (; cmds->writecnt || cmds->readcnt; cmds++) {
+		size_t len = cmds->writecnt + cmds->readcnt;
+
+		/* The implementation currently does not support requests that
+		   don't start with sending a command. */
+		if (cmds->writecnt == 0 || len > max_kernel_buf_size)
+			return SPI_INVALID_LENGTH;
+		if (cmds->io_mode == SPI_IO_QUAD_IO && cmds->writecnt < 1)
+			return -1;
+		if (n + 3 > LINUX_SPI_MAX_TRANSFERS || total + len > max_kernel_buf_size) {
+			ret = linux_spi_send_message(msg, n);
+			if (ret)
+				return ret;
+			n = 0;
+			total = 0;
+		}
+		n = linux_spi_add_transfers(msg, n, cmds);
+		total += len;
+	}
+	if (!n)
+		return 0;
+	return linux_spi_send_message(msg, n);
+}
+
+static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
+				  unsigned int readcnt,
+				  const unsigned char *txbuf,
+				  unsigned char *rxbuf)
+{
+	struct spi_command cmds[] = {
+	{
+		.writecnt	= writecnt,
+		.writearr	= txbuf,
+		.readcnt	= readcnt,
+		.readarr	= rxbuf,
+	}, {
+		.writecnt	= 0,
+		.writearr	= NULL,
+		.readcnt	= 0,
+		.readarr	= NULL,
+	}};
+
+	return linux_spi_send_multicommand(flash, cmds);
+}
+
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len)
 {
-	return spi_read_chunked(flash, buf, start, len,
-				(unsigned int)getpagesize());
+	/* Reads may cross page boundaries, so use the largest messages the kernel accepts. */
+	const unsigned int max_data = flash->mst->spi.max_data_read;
+	unsigned int toread;
+	int ret;
+
+	for (; len; len -= toread, buf += toread, start += toread) {
+		toread = min(max_data, len);
+		ret = spi_nbyte_read(flash, start, buf, toread);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Queue the pages of spi_write_batched() in one message, as many as the kernel buffer allows. The pause after
+ * each page program is an empty transfer of its own because programming starts when CS# is deasserted.
+ */
+static int linux_spi_send_batch(struct flashctx *flash, struct spi_batch_page *pages, unsigned int count)
+{
+	static const unsigned char wren[] = { JEDEC_WREN };
+	static const unsigned char rdsr[] = { JEDEC_RDSR };
+	struct spi_ioc_transfer msg[LINUX_SPI_MAX_TRANSFERS];
+	unsigned int nmsg = 0, n;
+	size_t total = 0;
+	int ret;
+
+	count = min(count, LINUX_SPI_BATCH_PAGES);
+	for (n = 0; n < count; n++) {
+		struct spi_batch_page *page = &pages[n];
+		struct spi_command cmd = { .writecnt = 1, .writearr = wren };
+
+		if (n && total + page->cmdlen + 5 > max_kernel_buf_size)
+			break;
+		nmsg = linux_spi_add_transfers(msg, nmsg, &cmd);
+		cmd = (struct spi_command){ .writecnt = 1, .writearr = rdsr, .readcnt = 1,
+					    .readarr = &page->wel_status };
+		nmsg = linux_spi_add_transfers(msg, nmsg, &cmd);
+		cmd = (struct spi_command){ .writecnt = page->cmdlen, .writearr = page->cmd };
+		nmsg = linux_spi_add_transfers(msg, nmsg, &cmd);
+		memset(&msg[nmsg], 0, sizeof(*msg));
+		msg[nmsg].delay_usecs = min(page->wait_us, 65535);
+		msg[nmsg].cs_change = 1;
+		nmsg++;
+		cmd = (struct spi_command){ .writecnt = 1, .writearr = rdsr, .readcnt = 1,
+					    .readarr = &page->status };
+		nmsg = linux_spi_add_transfers(msg, nmsg, &cmd);
+		total += page->cmdlen + 5;
+	}
+
+	ret = linux_spi_send_message(msg, nmsg);
+	if (ret)
+		return ret;
+	return n;
 }
 
+/* Program pages with one message per batch, see spi_write_batched(). */
 static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
-	return spi_write_chunked(flash, buf, start, len,
-				((unsigned int)getpagesize()) - 4);
+	if (fd == -1)
+		return -1;
+	return spi_write_batched(flash, buf, start, len, LINUX_SPI_BATCH_PAGES, linux_spi_send_batch);
 }
 
 #endif // CONFIG_LINUX_SPI == 1
@@ -289,6 +289,7 @@ void board_handle_before_laptop(void);
 int board_flash_enable(const char *vendor, const char *model, const char *cb_vendor, const char *cb_model);
 
 /* chipset_enable.c */
+extern uint32_t ich_bios_decode;
 int chipset_flash_enable(void);
 
 /* processor_enable.c */
@@ -385,6 +386,7 @@ void rmmio_vall(void *addr);
 int dummy_init(void);
 void *dummy_map(const char *descr, uintptr_t phys_addr, size_t len);
 void dummy_unmap(void *virt_addr, size_t len);
+void dummy_delay(unsigned int usecs);
 #endif
 
 /* nic3com.c */
@@ -605,8 +607,16 @@ enum spi_controller {
 #define MAX_DATA_UNSPECIFIED 0
 #define MAX_DATA_READ_UNLIMITED 64 * 1024
 #define MAX_DATA_WRITE_UNLIMITED 256
+/* Optional capabilities of a SPI master. Multi-I/O transfers are requested through spi_command.io_mode, hence
+ * masters announcing them have to implement their own multicommand function. */
+#define SPI_MASTER_FAST_READ	(1 << 0)	/* Can send the dummy byte of JEDEC_FAST_READ */
+#define SPI_MASTER_DUAL_OUT	(1 << 1)	/* SPI_IO_DUAL_OUT */
+#define SPI_MASTER_QUAD_OUT	(1 << 2)	/* SPI_IO_QUAD_OUT */
+#define SPI_MASTER_QUAD_IO	(1 << 3)	/* SPI_IO_QUAD_IO */
+#define SPI_MASTER_4BA		(1 << 4)	/* Can send 4-byte addresses and access more than 16 MB */
 struct spi_master {
 	enum spi_controller type;
+	unsigned int features;
 	unsigned int max_data_read; // (Ideally,) maximum data read size in one go (excluding opcode+address).
 	unsigned int max_data_write; // (Ideally,) maximum data write size in one go (excluding opcode+address).
 	int (*command)(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
@@ -655,6 +665,7 @@ enum ich_chipset {
 #if CONFIG_INTERNAL == 1
 extern uint32_t ichspi_bbar;
 int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_generation);
+int ich_region_locked(unsigned int i);
 int via_init_spi(struct pci_dev *dev, uint32_t mmio_base);
 
 /* amd_imc.c */
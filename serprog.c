@@ -43,9 +43,15 @@
 #include "programmer.h"
 #include "chipdrivers.h"
 #include "serprog.h"
+#include "spi.h"
 
 #define MSGHEADER "serprog: "
 
+/* Number of S_CMD_O_SPIOP_STREAM chunks requested ahead of the one being received. */
+#define SP_STREAM_CREDITS	8
+/* Timeout for S_CMD_O_SPIOP_PROGRAM, generous compared to the few ms a page program takes. */
+#define SP_PROGRAM_TIMEOUT_US	100000
+
 /*
  * FIXME: This prototype was added to help reduce diffs for the shutdown
  * registration patch, which shifted many lines of code to place
@@ -305,14 +311,17 @@ static int serprog_spi_send_command(struct flashctx *flash,
 				    unsigned char *readarr);
 static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
 			    unsigned int start, unsigned int len);
+static int serprog_spi_write_256(struct flashctx *flash, const uint8_t *buf,
+				 unsigned int start, unsigned int len);
 static struct spi_master spi_master_serprog = {
 	.type		= SPI_CONTROLLER_SERPROG,
+	.features	= SPI_MASTER_FAST_READ | SPI_MASTER_4BA,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= serprog_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
 	.read		= serprog_spi_read,
-	.write_256	= default_spi_write_256,
+	.write_256	= serprog_spi_write_256,
 	.write_aai	= default_spi_write_aai,
 };
 
@@ -512,6 +521,10 @@ int serprog_init(void)
 			spi_master_serprog.max_data_read = v;
 			msg_pdbg(MSGHEADER "Maximum read-n length is %d\n", v);
 		}
+		if (sp_check_commandavail(S_CMD_O_SPIOP_STREAM))
+			msg_pdbg(MSGHEADER "Streamed SPI reads supported\n");
+		if (sp_check_commandavail(S_CMD_O_SPIOP_PROGRAM))
+			msg_pdbg(MSGHEADER "SPI program with on-device polling supported\n");
 		spispeed = extract_programmer_param("spispeed");
 		if (spispeed && strlen(spispeed)) {
 			uint32_t f_spi_req, f_spi;
@@ -900,6 +913,18 @@ void serprog_delay(unsigned int usecs)
 	sp_prev_was_write = 0;
 }
 
+/* Immediate SPI operations must not overtake buffered parallel operations. */
+static int sp_execute_opbuf_before_spi(void)
+{
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int serprog_spi_send_command(struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
@@ -908,12 +933,8 @@ static int serprog_spi_send_command(struct flashctx *flash,
 	unsigned char *parmbuf;
 	int ret;
 	msg_pspew("%s, writecnt=%i, readcnt=%i\n", __func__, writecnt, readcnt);
-	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
-		if (sp_execute_opbuf() != 0) {
-			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
-			return 1;
-		}
-	}
+	if (sp_execute_opbuf_before_spi())
+		return 1;
 
 	parmbuf = malloc(writecnt + 6);
 	if (!parmbuf) {
@@ -933,6 +954,67 @@ static int serprog_spi_send_command(struct flashctx *flash,
 	return ret;
 }
 
+/* Read @len bytes with a single S_CMD_O_SPIOP_STREAM transaction. Chunks are requested by sending credits so
+ * that the device never has to buffer more than one chunk. */
+static int sp_spi_stream_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int chunk = min(spi_master_serprog.max_data_read, (1 << 24) - 1);
+	const unsigned int nchunks = (len + chunk - 1) / chunk;
+	unsigned char credits[SP_STREAM_CREDITS];
+	unsigned char parmbuf[10 + JEDEC_READ_CMD_MAXLEN];
+	enum spi_io_mode io_mode;
+	unsigned int i, requested;
+
+	const int slen = spi_prepare_read_cmd(flash, start, parmbuf + 10, &io_mode);
+	if (slen < 0)
+		return slen;
+	if (sp_execute_opbuf_before_spi())
+		return 1;
+
+	parmbuf[0] = (slen >> 0) & 0xFF;
+	parmbuf[1] = (slen >> 8) & 0xFF;
+	parmbuf[2] = (slen >> 16) & 0xFF;
+	parmbuf[3] = (len >> 0) & 0xFF;
+	parmbuf[4] = (len >> 8) & 0xFF;
+	parmbuf[5] = (len >> 16) & 0xFF;
+	parmbuf[6] = (len >> 24) & 0xFF;
+	parmbuf[7] = (chunk >> 0) & 0xFF;
+	parmbuf[8] = (chunk >> 8) & 0xFF;
+	parmbuf[9] = (chunk >> 16) & 0xFF;
+	msg_pspew("%s: start=0x%x len=0x%x in %u chunks\n", __func__, start, len, nchunks);
+	if (sp_docommand(S_CMD_O_SPIOP_STREAM, 10 + slen, parmbuf, 0, NULL)) {
+		msg_perr(MSGHEADER "Error: NAK to streamed SPI read\n");
+		return 1;
+	}
+
+	memset(credits, S_ACK, sizeof(credits));
+	requested = min(nchunks, SP_STREAM_CREDITS);
+	if (serialport_write(credits, requested) != 0) {
+		msg_perr(MSGHEADER "Error: cannot send stream credits\n");
+		goto err_sync;
+	}
+	for (i = 0; i < nchunks; i++) {
+		if (serialport_read(buf + i * chunk, min(chunk, len - i * chunk)) != 0) {
+			msg_perr(MSGHEADER "Error: cannot read streamed data\n");
+			goto err_sync;
+		}
+		if (requested < nchunks) {
+			if (serialport_write(credits, 1) != 0) {
+				msg_perr(MSGHEADER "Error: cannot send stream credits\n");
+				goto err_sync;
+			}
+			requested++;
+		}
+	}
+	return 0;
+
+err_sync:
+	/* The device may still be streaming or waiting for credits. The NOPs sent by sp_synchronize() abort the
+	 * transaction and the leftover data is flushed. */
+	sp_synchronize();
+	return 1;
+}
+
 /* FIXME: This function is optimized so that it does not split each transaction
  * into chip page_size long blocks unnecessarily like spi_read_chunked. This has
  * the advantage that it is much faster for most chips, but breaks those with
@@ -942,6 +1024,10 @@ static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
 {
 	unsigned int i, cur_len;
 	const unsigned int max_read = spi_master_serprog.max_data_read;
+
+	if (sp_check_commandavail(S_CMD_O_SPIOP_STREAM))
+		return sp_spi_stream_read(flash, buf, start, len);
+
 	for (i = 0; i < len; i += cur_len) {
 		int ret;
 		cur_len = min(max_read, (len - i));
@@ -952,6 +1038,65 @@ static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
 	return 0;
 }
 
+/* Program up to one page and let the device wait for completion, saving the round-trips of the WREN command and
+ * of every status register poll. */
+static int sp_spi_program(struct flashctx *flash, const uint8_t *buf, unsigned int addr, unsigned int len)
+{
+	unsigned char parmbuf[7 + JEDEC_BYTE_PROGRAM_4BA_OUTSIZE - 1 + 256];
+	const unsigned int timeout = SP_PROGRAM_TIMEOUT_US;
+	unsigned char status;
+
+	const int hdr_len = spi_prepare_program_cmd(flash, addr, parmbuf + 7);
+	if (hdr_len < 0)
+		return hdr_len;
+	const unsigned int slen = hdr_len + len;
+	memcpy(parmbuf + 7 + hdr_len, buf, len);
+
+	parmbuf[0] = (slen >> 0) & 0xFF;
+	parmbuf[1] = (slen >> 8) & 0xFF;
+	parmbuf[2] = (slen >> 16) & 0xFF;
+	parmbuf[3] = (timeout >> 0) & 0xFF;
+	parmbuf[4] = (timeout >> 8) & 0xFF;
+	parmbuf[5] = (timeout >> 16) & 0xFF;
+	parmbuf[6] = (timeout >> 24) & 0xFF;
+	if (sp_docommand(S_CMD_O_SPIOP_PROGRAM, 7 + slen, parmbuf, 1, &status)) {
+		msg_perr(MSGHEADER "Error: programming 0x%06x (len=%u) failed or timed out\n", addr, len);
+		return 1;
+	}
+	msg_pspew("%s: addr=0x%06x len=%u status=0x%02x\n", __func__, addr, len, status);
+	return 0;
+}
+
+static int serprog_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	unsigned char hdr[JEDEC_BYTE_PROGRAM_4BA_OUTSIZE];
+	unsigned int max_data, pos, cur_len;
+	int hdr_len;
+
+	if (!sp_check_commandavail(S_CMD_O_SPIOP_PROGRAM) || page_size > 256)
+		return default_spi_write_256(flash, buf, start, len);
+
+	/* The opcode and address count towards the device's write-n limit as well. */
+	hdr_len = spi_prepare_program_cmd(flash, start, hdr);
+	if (hdr_len < 0)
+		return hdr_len;
+	if (spi_master_serprog.max_data_write <= (unsigned int)hdr_len)
+		return default_spi_write_256(flash, buf, start, len);
+	max_data = min(spi_master_serprog.max_data_write - hdr_len, 256);
+	if (sp_execute_opbuf_before_spi())
+		return 1;
+
+	/* Never cross a page boundary within one program command. */
+	for (pos = 0; pos < len; pos += cur_len) {
+		cur_len = min(page_size - (start + pos) % page_size, len - pos);
+		cur_len = min(cur_len, max_data);
+		if (sp_spi_program(flash, buf + pos, start + pos, cur_len))
+			return 1;
+	}
+	return 0;
+}
+
 void *serprog_map(const char *descr, uintptr_t phys_addr, size_t len)
 {
 	/* Serprog transmits 24 bits only and assumes the underlying implementation handles any remaining bits
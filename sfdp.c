@@ -125,6 +125,34 @@ static int sfdp_add_uniform_eraser(struct flashchip *chip, uint8_t opcode, uint3
 	return 1;
 }
 
+static uint32_t sfdp_read_dword(const uint8_t *buf, unsigned int index)
+{
+	uint32_t tmp32;
+
+	tmp32 =  ((unsigned int)buf[(4 * index) + 0]);
+	tmp32 |= ((unsigned int)buf[(4 * index) + 1]) << 8;
+	tmp32 |= ((unsigned int)buf[(4 * index) + 2]) << 16;
+	tmp32 |= ((unsigned int)buf[(4 * index) + 3]) << 24;
+	return tmp32;
+}
+
+/* Check a 16-bit fast read descriptor (dummy clocks in bits 0-4, mode clocks in bits 5-7, opcode in bits 8-15)
+ * against the opcode and the sum of mode and dummy clocks flashrom uses. */
+static bool sfdp_check_fast_read(uint32_t desc, uint8_t opcode, unsigned int clocks, const char *mode)
+{
+	uint8_t desc_opcode = (desc >> 8) & 0xff;
+	unsigned int desc_clocks = (desc & 0x1f) + ((desc >> 5) & 0x7);
+
+	msg_cdbg2("  %s Fast Read opcode is 0x%02x with %u mode and dummy clocks", mode, desc_opcode,
+		  desc_clocks);
+	if (desc_opcode != opcode || desc_clocks != clocks) {
+		msg_cdbg2(" (unsupported).\n");
+		return false;
+	}
+	msg_cdbg2(".\n");
+	return true;
+}
+
 static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 {
 	uint8_t opcode_4k_erase = 0xFF;
@@ -135,7 +163,7 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	int j;
 
 	msg_cdbg("Parsing JEDEC flash parameter table... ");
-	if (len != 9 * 4 && len != 4 * 4) {
+	if (len < 9 * 4 && len != 4 * 4) {
 		msg_cdbg("%s: len out of spec\n", __func__);
 		return 1;
 	}
@@ -223,8 +251,6 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	if (opcode_4k_erase != 0xFF)
 		sfdp_add_uniform_eraser(chip, opcode_4k_erase, 4 * 1024);
 
-	/* FIXME: double words 3-7 contain unused fast read information */
-
 	if (len == 4 * 4) {
 		msg_cdbg("  It seems like this chip supports the preliminary "
 			 "Intel version of SFDP, skipping processing of double "
@@ -232,6 +258,42 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 		goto done;
 	}
 
+	/* Fast Read (0x0B) with 8 dummy clocks is supported by all SFDP-compliant chips. The multi-I/O reads are
+	 * only used if they have the usual opcode and number of mode and dummy clocks. */
+	chip->feature_bits |= FEATURE_FAST_READ;
+	tmp32 = sfdp_read_dword(buf, 0);
+	if (tmp32 & (1 << 16)) {
+		if (sfdp_check_fast_read(sfdp_read_dword(buf, 3), 0x3b, 8, "1-1-2"))
+			chip->feature_bits |= FEATURE_FAST_READ_DOUT;
+	}
+	if (tmp32 & (1 << 22)) {
+		if (sfdp_check_fast_read(sfdp_read_dword(buf, 2) >> 16, 0x6b, 8, "1-1-4"))
+			chip->feature_bits |= FEATURE_FAST_READ_QOUT;
+	}
+	if (tmp32 & (1 << 21)) {
+		if (sfdp_check_fast_read(sfdp_read_dword(buf, 2), 0xeb, 6, "1-4-4"))
+			chip->feature_bits |= FEATURE_FAST_READ_QIO;
+	}
+
+	/* 15. double word (JESD216A and later): Quad Enable requirements */
+	if (len >= 15 * 4) {
+		tmp8 = (sfdp_read_dword(buf, 14) >> 20) & 0x7;
+		switch (tmp8) {
+		case 0x2:
+			msg_cdbg2("  Quad Enable is bit 6 of status register 1.\n");
+			chip->feature_bits |= FEATURE_QE_SR1_6;
+			break;
+		case 0x4:
+		case 0x5:
+			msg_cdbg2("  Quad Enable is bit 1 of status register 2.\n");
+			chip->feature_bits |= FEATURE_QE_SR2_1;
+			break;
+		default:
+			msg_cdbg2("  Quad Enable requirements 0x%x not supported, not using quad reads.\n", tmp8);
+			break;
+		}
+	}
+
 	/* 8. double word */
 	for (j = 0; j < 4; j++) {
 		/* 7 double words from the start + 2 bytes for every eraser */
@@ -377,7 +439,7 @@ int probe_spi_sfdp(struct flashctx *flash)
 				msg_cdbg("The chip contains an unknown "
 					  "version of the JEDEC flash "
 					  "parameters table, skipping it.\n");
-			} else if (len != 9 * 4 && len != 4 * 4) {
+			} else if (len < 9 * 4 && len != 4 * 4) {
 				msg_cdbg("Length of the mandatory JEDEC SFDP "
 					 "parameter table is wrong (%d B), "
 					 "skipping it.\n", len);
@@ -34,13 +34,21 @@ int spi_send_command(struct flashctx *flash, unsigned int writecnt,
 		     unsigned int readcnt, const unsigned char *writearr,
 		     unsigned char *readarr)
 {
-	return flash->mst->spi.command(flash, writecnt, readcnt, writearr,
-				       readarr);
+	uint64_t start = stats_spi_begin();
+	int ret = flash->mst->spi.command(flash, writecnt, readcnt, writearr,
+					  readarr);
+
+	stats_spi_command_end(start, writecnt, readcnt, writearr);
+	return ret;
 }
 
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
 {
-	return flash->mst->spi.multicommand(flash, cmds);
+	uint64_t start = stats_spi_begin();
+	int ret = flash->mst->spi.multicommand(flash, cmds);
+
+	stats_spi_multicommand_end(start, cmds);
+	return ret;
 }
 
 int default_spi_send_command(struct flashctx *flash, unsigned int writecnt,
@@ -69,6 +77,10 @@ int default_spi_send_multicommand(struct flashctx *flash,
 {
 	int result = 0;
 	for (; (cmds->writecnt || cmds->readcnt) && !result; cmds++) {
+		if (cmds->io_mode != SPI_IO_SINGLE) {
+			msg_cerr("%s: multi-I/O transfers are not supported by this master.\n", __func__);
+			return SPI_INVALID_OPCODE;
+		}
 		result = spi_send_command(flash, cmds->writecnt, cmds->readcnt,
 					  cmds->writearr, cmds->readarr);
 	}
@@ -106,11 +118,14 @@ int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 	unsigned int addrbase = 0;
 
 	/* Check if the chip fits between lowest valid and highest possible
-	 * address. Highest possible address with the current SPI implementation
-	 * means 0xffffff, the highest unsigned 24bit number.
+	 * address. Highest possible address for masters without 4-byte address
+	 * support means 0xffffff, the highest unsigned 24bit number.
+	 * Only the lower 16 MB of larger chips can be reached by such masters
+	 * (see spi_prepare_4ba()), higher addresses are refused.
 	 */
 	addrbase = spi_get_valid_read_addr(flash);
-	if (addrbase + flash->chip->total_size * 1024 > (1 << 24)) {
+	if (!(flash->mst->spi.features & SPI_MASTER_4BA) && flash->chip->total_size <= 16 * 1024 &&
+	    addrbase + flash->chip->total_size * 1024 > (1 << 24)) {
 		msg_perr("Flash chip size exceeds the allowed access window. ");
 		msg_perr("Read will probably fail.\n");
 		/* Try to get the best alignment subject to constraints. */
@@ -178,7 +193,12 @@ int register_spi_master(const struct spi_master *mst)
 			 __func__);
 		return ERROR_FLASHROM_BUG;
 	}
-
+	if ((mst->features & (SPI_MASTER_DUAL_OUT | SPI_MASTER_QUAD_OUT | SPI_MASTER_QUAD_IO)) &&
+	    mst->multicommand == default_spi_send_multicommand) {
+		msg_perr("%s called with multi-I/O support but without a multicommand function to use it. "
+			 "Please report a bug at flashrom@flashrom.org\n", __func__);
+		return ERROR_FLASHROM_BUG;
+	}
 
 	rmst.buses_supported = BUS_SPI;
 	rmst.spi = *mst;
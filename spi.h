@@ -111,6 +111,20 @@
 #define JEDEC_SE_OUTSIZE	0x04
 #define JEDEC_SE_INSIZE		0x00
 
+/* Sector Erase 0x21 with a 4-byte address */
+#define JEDEC_SE_4BA		0x21
+#define JEDEC_SE_4BA_OUTSIZE	0x05
+#define JEDEC_SE_4BA_INSIZE	0x00
+
+/* Block Erase 0xdc with a 4-byte address (64 kB blocks) */
+#define JEDEC_BE_DC		0xdc
+#define JEDEC_BE_DC_OUTSIZE	0x05
+#define JEDEC_BE_DC_INSIZE	0x00
+
+/* Enter and exit 4-byte address mode */
+#define JEDEC_ENTER_4_BYTE_ADDR_MODE	0xB7
+#define JEDEC_EXIT_4_BYTE_ADDR_MODE	0xE9
+
 /* Page Erase 0xDB */
 #define JEDEC_PE		0xDB
 #define JEDEC_PE_OUTSIZE	0x04
@@ -121,10 +135,33 @@
 #define JEDEC_RDSR_OUTSIZE	0x01
 #define JEDEC_RDSR_INSIZE	0x01
 
+/* Read Status Register 2 */
+#define JEDEC_RDSR2		0x35
+#define JEDEC_RDSR2_OUTSIZE	0x01
+#define JEDEC_RDSR2_INSIZE	0x01
+
 /* Status Register Bits */
 #define SPI_SR_WIP	(0x01 << 0)
 #define SPI_SR_WEL	(0x01 << 1)
 #define SPI_SR_AAI	(0x01 << 6)
+/* Quad Enable bit, either bit 6 of status register 1 (e.g. Macronix) or bit 1 of status register 2 (e.g. Winbond) */
+#define SPI_SR1_QE	(0x01 << 6)
+#define SPI_SR2_QE	(0x01 << 1)
+
+/* Read Security Register (Macronix) */
+#define JEDEC_RDSCUR		0x2b
+#define JEDEC_RDSCUR_OUTSIZE	0x01
+#define JEDEC_RDSCUR_INSIZE	0x01
+#define SPI_SCUR_E_FAIL		(0x01 << 6)
+
+/* Read and clear Flag Status Register (Micron) */
+#define JEDEC_RDFSR		0x70
+#define JEDEC_RDFSR_OUTSIZE	0x01
+#define JEDEC_RDFSR_INSIZE	0x01
+#define JEDEC_CLFSR		0x50
+#define JEDEC_CLFSR_OUTSIZE	0x01
+#define JEDEC_CLFSR_INSIZE	0x00
+#define SPI_FSR_ERASE_ERR	(0x01 << 5)
 
 /* Write Status Enable */
 #define JEDEC_EWSR		0x50
@@ -141,11 +178,46 @@
 #define JEDEC_READ_OUTSIZE	0x04
 /*      JEDEC_READ_INSIZE : any length */
 
+/* Read the memory at higher clock rates (1 dummy byte) */
+#define JEDEC_FAST_READ		0x0b
+#define JEDEC_FAST_READ_OUTSIZE	0x05
+/*      JEDEC_FAST_READ_INSIZE : any length */
+
+/* Read the memory with data output on 2 lines (1-1-2, 1 dummy byte) */
+#define JEDEC_FAST_READ_DOUT		0x3b
+#define JEDEC_FAST_READ_DOUT_OUTSIZE	0x05
+/*      JEDEC_FAST_READ_DOUT_INSIZE : any length */
+
+/* Read the memory with data output on 4 lines (1-1-4, 1 dummy byte) */
+#define JEDEC_FAST_READ_QOUT		0x6b
+#define JEDEC_FAST_READ_QOUT_OUTSIZE	0x05
+/*      JEDEC_FAST_READ_QOUT_INSIZE : any length */
+
+/* Read the memory with address and data on 4 lines (1-4-4, 1 mode byte and 2 dummy bytes) */
+#define JEDEC_FAST_READ_QIO		0xeb
+#define JEDEC_FAST_READ_QIO_OUTSIZE	0x07
+/*      JEDEC_FAST_READ_QIO_INSIZE : any length */
+
+/* 4-byte address variants of the read commands above (same number of mode and dummy bytes) */
+#define JEDEC_READ_4BA			0x13
+#define JEDEC_FAST_READ_4BA		0x0c
+#define JEDEC_FAST_READ_DOUT_4BA	0x3c
+#define JEDEC_FAST_READ_QOUT_4BA	0x6c
+#define JEDEC_FAST_READ_QIO_4BA		0xec
+
+/* Longest read command header: opcode, 4 address bytes and up to 3 mode and dummy bytes */
+#define JEDEC_READ_CMD_MAXLEN		0x08
+
 /* Write memory byte */
 #define JEDEC_BYTE_PROGRAM		0x02
 #define JEDEC_BYTE_PROGRAM_OUTSIZE	0x05
 #define JEDEC_BYTE_PROGRAM_INSIZE	0x00
 
+/* Write memory byte with a 4-byte address */
+#define JEDEC_BYTE_PROGRAM_4BA		0x12
+#define JEDEC_BYTE_PROGRAM_4BA_OUTSIZE	0x06
+#define JEDEC_BYTE_PROGRAM_4BA_INSIZE	0x00
+
 /* Write AAI word (SST25VF080B) */
 #define JEDEC_AAI_WORD_PROGRAM			0xad
 #define JEDEC_AAI_WORD_PROGRAM_OUTSIZE		0x06
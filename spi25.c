@@ -115,56 +115,229 @@ int spi_write_disable(struct flashctx *flash)
 	return spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
 }
 
-static int probe_spi_rdid_generic(struct flashctx *flash, int bytes)
-{
-	const struct flashchip *chip = flash->chip;
-	unsigned char readarr[4];
+/* ID commands whose responses are cached while probing a master. */
+enum id_type {
+	ID_RDID,
+	ID_RDID4,
+	ID_REMS,
+	ID_RES1,
+	ID_RES2,
+	ID_RES3,
+	ID_AT25F,
+	NUM_ID_TYPES,
+};
+
+/* Number of response bytes that make up the IDs, indexed by enum id_type. */
+static const unsigned int id_len[NUM_ID_TYPES] = {
+	[ID_RDID]	= JEDEC_RDID_INSIZE,
+	[ID_RDID4]	= 4,
+	[ID_REMS]	= JEDEC_REMS_INSIZE,
+	[ID_RES1]	= 1,
+	[ID_RES2]	= 2,
+	[ID_RES3]	= 3,
+	[ID_AT25F]	= AT25F_RDID_INSIZE,
+};
+
+/* Every ID command is sent at most once per master. Failed commands are remembered as well. Responses that
+ * are all 0xff or all 0x00 are not, a chip in deep power-down looks like that until RES wakes it up. */
+static struct {
+	bool is_cached;
+	int ret;
 	uint32_t id1;
 	uint32_t id2;
+	unsigned char bytes[4];
+} id_cache[NUM_ID_TYPES];
 
-	if (spi_rdid(flash, readarr, bytes)) {
-		return 0;
-	}
+/* Forget all cached ID responses. Must be called before probing a new master. */
+void spi_clear_id_cache(void)
+{
+	memset(id_cache, 0, sizeof(id_cache));
+}
 
-	if (!oddparity(readarr[0]))
-		msg_cdbg("RDID byte 0 parity violation. ");
+static int send_id_command(struct flashctx *flash, enum id_type type, unsigned char *readarr)
+{
+	static const unsigned char at25f_cmd[AT25F_RDID_OUTSIZE] = { AT25F_RDID };
+
+	switch (type) {
+	case ID_RDID:
+		return spi_rdid(flash, readarr, 3);
+	case ID_RDID4:
+		return spi_rdid(flash, readarr, 4);
+	case ID_REMS:
+		return spi_rems(flash, readarr);
+	case ID_RES1:
+		return spi_res(flash, readarr, 1);
+	case ID_RES2:
+		return spi_res(flash, readarr, 2);
+	case ID_RES3:
+		return spi_res(flash, readarr, 3);
+	case ID_AT25F:
+		return spi_send_command(flash, sizeof(at25f_cmd), AT25F_RDID_INSIZE, at25f_cmd, readarr);
+	default:
+		return 1;
+	}
+}
 
-	/* Check if this is a continuation vendor ID.
-	 * FIXME: Handle continuation device IDs.
-	 */
-	if (readarr[0] == 0x7f) {
-		if (!oddparity(readarr[1]))
-			msg_cdbg("RDID byte 1 parity violation. ");
-		id1 = (readarr[0] << 8) | readarr[1];
-		id2 = readarr[2];
-		if (bytes > 3) {
-			id2 <<= 8;
-			id2 |= readarr[3];
+/* Split the raw response to an ID command into manufacturer and model ID the way the chip definitions
+ * expect them. */
+static void decode_ids(enum id_type type, const unsigned char *readarr, uint32_t *id1, uint32_t *id2)
+{
+	switch (type) {
+	case ID_RDID:
+	case ID_RDID4:
+		/* Check if this is a continuation vendor ID.
+		 * FIXME: Handle continuation device IDs.
+		 */
+		if (readarr[0] == 0x7f) {
+			*id1 = (readarr[0] << 8) | readarr[1];
+			*id2 = readarr[2];
+			if (type == ID_RDID4) {
+				*id2 <<= 8;
+				*id2 |= readarr[3];
+			}
+		} else {
+			*id1 = readarr[0];
+			*id2 = (readarr[1] << 8) | readarr[2];
 		}
-	} else {
-		id1 = readarr[0];
-		id2 = (readarr[1] << 8) | readarr[2];
+		break;
+	case ID_RES1:
+		*id1 = 0;
+		*id2 = readarr[0];
+		break;
+	case ID_RES3:
+		*id1 = (readarr[0] << 8) | readarr[1];
+		*id2 = readarr[2];
+		break;
+	default:
+		*id1 = readarr[0];
+		*id2 = readarr[1];
+		break;
 	}
+}
 
-	msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", __func__, id1, id2);
+static bool id_response_blank(enum id_type type)
+{
+	static const unsigned char allff[] = {0xff, 0xff, 0xff, 0xff};
+	static const unsigned char all00[] = {0x00, 0x00, 0x00, 0x00};
 
-	if (id1 == chip->manufacture_id && id2 == chip->model_id)
-		return 1;
+	return !memcmp(id_cache[type].bytes, allff, id_len[type]) ||
+	       !memcmp(id_cache[type].bytes, all00, id_len[type]);
+}
 
-	/* Test if this is a pure vendor match. */
-	if (id1 == chip->manufacture_id && GENERIC_DEVICE_ID == chip->model_id)
-		return 1;
+/* Return the response to ID command @type, sending it only if it has not been sent to this master yet. */
+static const unsigned char *get_id_response(struct flashctx *flash, enum id_type type)
+{
+	if (!id_cache[type].is_cached) {
+		id_cache[type].ret = send_id_command(flash, type, id_cache[type].bytes);
+		if (!id_cache[type].ret)
+			decode_ids(type, id_cache[type].bytes, &id_cache[type].id1, &id_cache[type].id2);
+		id_cache[type].is_cached = id_cache[type].ret || !id_response_blank(type);
+	}
+	return id_cache[type].ret ? NULL : id_cache[type].bytes;
+}
 
-	/* Test if there is any vendor ID. */
-	if (GENERIC_MANUF_ID == chip->manufacture_id && id1 != 0xff && id1 != 0x00)
-		return 1;
+/* Check whether the IDs read with command @type identify @chip. */
+static bool ids_match(enum id_type type, const struct flashchip *chip, uint32_t id1, uint32_t id2)
+{
+	switch (type) {
+	case ID_RDID:
+	case ID_RDID4:
+	case ID_REMS:
+		if (id1 == chip->manufacture_id && id2 == chip->model_id)
+			return true;
+		/* Test if this is a pure vendor match. */
+		if (id1 == chip->manufacture_id && GENERIC_DEVICE_ID == chip->model_id)
+			return true;
+		/* Test if there is any vendor ID. */
+		if (GENERIC_MANUF_ID == chip->manufacture_id && id1 != 0xff && id1 != 0x00)
+			return true;
+		return false;
+	case ID_RES1:
+		return id2 == chip->model_id;
+	default:
+		return id1 == chip->manufacture_id && id2 == chip->model_id;
+	}
+}
 
-	return 0;
+/* Check whether a response was read successfully and is neither all 0xff nor all 0x00. Only those are cached. */
+static bool id_response_usable(enum id_type type)
+{
+	return id_cache[type].is_cached && !id_cache[type].ret;
+}
+
+static enum id_type probe_id_type(int (*probe)(struct flashctx *flash))
+{
+	if (probe == probe_spi_rdid)
+		return ID_RDID;
+	if (probe == probe_spi_rdid4)
+		return ID_RDID4;
+	if (probe == probe_spi_rems)
+		return ID_REMS;
+	if (probe == probe_spi_res1)
+		return ID_RES1;
+	if (probe == probe_spi_res2)
+		return ID_RES2;
+	if (probe == probe_spi_res3)
+		return ID_RES3;
+	if (probe == probe_spi_at25f)
+		return ID_AT25F;
+	return NUM_ID_TYPES;
+}
+
+/* Check whether the ID responses already read from the current master rule out @chip, i.e. its probe function
+ * would return 0 without causing any bus traffic. */
+bool spi_id_cache_excludes(const struct flashchip *chip)
+{
+	enum id_type type = probe_id_type(chip->probe);
+
+	if (type == NUM_ID_TYPES)
+		return false;
+	/* probe_spi_res1() bails out early if RDID or REMS returned something useful. */
+	if (type == ID_RES1 && (id_response_usable(ID_RDID) || id_response_usable(ID_REMS)))
+		return true;
+	if (!id_cache[type].is_cached)
+		return false;
+	if (id_cache[type].ret)
+		return true;
+	return !ids_match(type, chip, id_cache[type].id1, id_cache[type].id2);
+}
+
+static int probe_spi_ids(struct flashctx *flash, enum id_type type, const char *func)
+{
+	const unsigned char *readarr = get_id_response(flash, type);
+	uint32_t id1, id2;
+
+	if (!readarr)
+		return 0;
+	id1 = id_cache[type].id1;
+	id2 = id_cache[type].id2;
+
+	if (type == ID_RES1)
+		msg_cdbg("%s: id 0x%x\n", func, id2);
+	else
+		msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", func, id1, id2);
+
+	return ids_match(type, flash->chip, id1, id2);
+}
+
+static int probe_spi_rdid_generic(struct flashctx *flash, enum id_type type)
+{
+	const unsigned char *readarr = get_id_response(flash, type);
+
+	if (!readarr)
+		return 0;
+
+	if (!oddparity(readarr[0]))
+		msg_cdbg("RDID byte 0 parity violation. ");
+	if (readarr[0] == 0x7f && !oddparity(readarr[1]))
+		msg_cdbg("RDID byte 1 parity violation. ");
+
+	return probe_spi_ids(flash, type, __func__);
 }
 
 int probe_spi_rdid(struct flashctx *flash)
 {
-	return probe_spi_rdid_generic(flash, 3);
+	return probe_spi_rdid_generic(flash, ID_RDID);
 }
 
 int probe_spi_rdid4(struct flashctx *flash)
@@ -183,7 +356,7 @@ int probe_spi_rdid4(struct flashctx *flash)
 #endif
 #endif
 	default:
-		return probe_spi_rdid_generic(flash, 4);
+		return probe_spi_rdid_generic(flash, ID_RDID4);
 	}
 
 	return 0;
@@ -191,139 +364,226 @@ int probe_spi_rdid4(struct flashctx *flash)
 
 int probe_spi_rems(struct flashctx *flash)
 {
-	const struct flashchip *chip = flash->chip;
-	unsigned char readarr[JEDEC_REMS_INSIZE];
-	uint32_t id1, id2;
-
-	if (spi_rems(flash, readarr)) {
-		return 0;
-	}
-
-	id1 = readarr[0];
-	id2 = readarr[1];
-
-	msg_cdbg("%s: id1 0x%x, id2 0x%x\n", __func__, id1, id2);
-
-	if (id1 == chip->manufacture_id && id2 == chip->model_id)
-		return 1;
-
-	/* Test if this is a pure vendor match. */
-	if (id1 == chip->manufacture_id && GENERIC_DEVICE_ID == chip->model_id)
-		return 1;
-
-	/* Test if there is any vendor ID. */
-	if (GENERIC_MANUF_ID == chip->manufacture_id && id1 != 0xff && id1 != 0x00)
-		return 1;
-
-	return 0;
+	return probe_spi_ids(flash, ID_REMS, __func__);
 }
 
 int probe_spi_res1(struct flashctx *flash)
 {
-	static const unsigned char allff[] = {0xff, 0xff, 0xff};
-	static const unsigned char all00[] = {0x00, 0x00, 0x00};
-	unsigned char readarr[3];
-	uint32_t id2;
-
 	/* We only want one-byte RES if RDID and REMS are unusable. */
 
 	/* Check if RDID is usable and does not return 0xff 0xff 0xff or
 	 * 0x00 0x00 0x00. In that case, RES is pointless.
 	 */
-	if (!spi_rdid(flash, readarr, 3) && memcmp(readarr, allff, 3) &&
-	    memcmp(readarr, all00, 3)) {
+	get_id_response(flash, ID_RDID);
+	if (id_response_usable(ID_RDID)) {
 		msg_cdbg("Ignoring RES in favour of RDID.\n");
 		return 0;
 	}
 	/* Check if REMS is usable and does not return 0xff 0xff or
 	 * 0x00 0x00. In that case, RES is pointless.
 	 */
-	if (!spi_rems(flash, readarr) &&
-	    memcmp(readarr, allff, JEDEC_REMS_INSIZE) &&
-	    memcmp(readarr, all00, JEDEC_REMS_INSIZE)) {
+	get_id_response(flash, ID_REMS);
+	if (id_response_usable(ID_REMS)) {
 		msg_cdbg("Ignoring RES in favour of REMS.\n");
 		return 0;
 	}
 
-	if (spi_res(flash, readarr, 1)) {
-		return 0;
-	}
-
-	id2 = readarr[0];
-
-	msg_cdbg("%s: id 0x%x\n", __func__, id2);
-
-	if (id2 != flash->chip->model_id)
-		return 0;
-
-	return 1;
+	return probe_spi_ids(flash, ID_RES1, __func__);
 }
 
 int probe_spi_res2(struct flashctx *flash)
 {
-	unsigned char readarr[2];
-	uint32_t id1, id2;
-
-	if (spi_res(flash, readarr, 2)) {
-		return 0;
-	}
-
-	id1 = readarr[0];
-	id2 = readarr[1];
-
-	msg_cdbg("%s: id1 0x%x, id2 0x%x\n", __func__, id1, id2);
+	return probe_spi_ids(flash, ID_RES2, __func__);
+}
 
-	if (id1 != flash->chip->manufacture_id || id2 != flash->chip->model_id)
-		return 0;
+int probe_spi_res3(struct flashctx *flash)
+{
+	return probe_spi_ids(flash, ID_RES3, __func__);
+}
 
-	return 1;
+/* Only used for some Atmel chips. */
+int probe_spi_at25f(struct flashctx *flash)
+{
+	return probe_spi_ids(flash, ID_AT25F, __func__);
 }
 
-int probe_spi_res3(struct flashctx *flash)
+/**
+ * Wait until the Write-In-Progress bit is cleared after a self-timed operation was started.
+ *
+ * If the chip lists the typical duration of the operation, most of it is slept away before the status register
+ * is read for the first time. After that (or right away if nothing is known) the status register is polled with
+ * exponentially growing delays that are capped at @max_step or 1/8 of the typical duration, whichever is larger.
+ * On programmers where every status register read is a bus round trip this avoids most of the polls a fixed
+ * small step would need.
+ *
+ * @op		index into the chip's timing table, NUM_OP_TIMINGS if there is no matching entry
+ * @len		number of bytes programmed, used to scale tPP for partial pages
+ * @max_step	largest delay in microseconds between two polls if the chip's timing is unknown
+ * @return	0 on success, TIMEOUT_ERROR if the chip is still busy well after the maximum duration
+ */
+int spi_wait_for_wip(struct flashctx *flash, enum op_timing_type op, unsigned int len, unsigned int max_step)
 {
-	unsigned char readarr[3];
-	uint32_t id1, id2;
+	unsigned int typ = 0, limit = 0;
+	unsigned int polls = 1;
+	unsigned long waited = 0;
+	unsigned int step;
+
+	if (op < NUM_OP_TIMINGS) {
+		typ = flash->chip->timing[op].typ;
+		limit = flash->chip->timing[op].max;
+		if (op == OP_TIMING_PP && len && len < flash->chip->page_size) {
+			typ = (unsigned long long)typ * len / flash->chip->page_size;
+			limit = (unsigned long long)limit * len / flash->chip->page_size;
+		}
+	}
 
-	if (spi_res(flash, readarr, 3)) {
-		return 0;
+	if (typ) {
+		waited = typ - typ / 8;
+		programmer_delay(waited);
+		step = max(typ / 16, 1);
+		max_step = max(max_step, typ / 8);
+	} else {
+		step = max(max_step / 8, 1);
 	}
 
-	id1 = (readarr[0] << 8) | readarr[1];
-	id2 = readarr[2];
+	/* FIXME: We assume spi_read_status_register will never fail. */
+	while (spi_read_status_register(flash) & SPI_SR_WIP) {
+		if (limit && waited > 2 * (unsigned long)limit) {
+			msg_cerr("%s: chip still busy after %lu us, giving up.\n", __func__, waited);
+			return TIMEOUT_ERROR;
+		}
+		programmer_delay(step);
+		waited += step;
+		step = min(2 * step, max_step);
+		polls++;
+	}
+	msg_cspew("WIP cleared after %u poll%s (%lu us). ", polls, polls == 1 ? "" : "s", waited);
 
-	msg_cdbg("%s: id1 0x%x, id2 0x%x\n", __func__, id1, id2);
+	stats_wip(op, polls, waited);
+	/* FIXME: Check the status register for errors. */
+	return 0;
+}
 
-	if (id1 != flash->chip->manufacture_id || id2 != flash->chip->model_id)
-		return 0;
+/*
+ * Time in microseconds to wait for a page program, for masters which queue the wait on their own: the typical
+ * time of a full page plus a quarter. Partial pages are not assumed to be faster because much of the time goes
+ * into setting up the program, whatever the length. Chips which do not specify it are assumed to need 700 us
+ * for a full page, a common datasheet value.
+ */
+unsigned int spi_page_program_time(const struct flashctx *flash)
+{
+	const unsigned int typ = flash->chip->timing[OP_TIMING_PP].typ ? : 700;
 
-	return 1;
+	return typ + typ / 4;
 }
 
-/* Only used for some Atmel chips. */
-int probe_spi_at25f(struct flashctx *flash)
+/* Use the native 4-byte address commands instead of the 3-byte ones? */
+static bool spi_use_native_4ba(const struct flashctx *flash)
 {
-	static const unsigned char cmd[AT25F_RDID_OUTSIZE] = { AT25F_RDID };
-	unsigned char readarr[AT25F_RDID_INSIZE];
-	uint32_t id1;
-	uint32_t id2;
+	return (flash->chip->feature_bits & FEATURE_4BA_NATIVE) && flash->chip->total_size > 16 * 1024 &&
+	       (flash->mst->spi.features & SPI_MASTER_4BA);
+}
 
-	if (spi_send_command(flash, sizeof(cmd), sizeof(readarr), cmd, readarr))
-		return 0;
+/**
+ * Store @addr in @cmd_buf right after the opcode.
+ *
+ * @native_4ba	true if the opcode in @cmd_buf always takes a 4-byte address
+ * @return	number of address bytes (3 or 4), or -1 if @addr can not be reached with a 3-byte address
+ */
+static int spi_prepare_address(struct flashctx *flash, uint8_t cmd_buf[], bool native_4ba, unsigned int addr)
+{
+	if (native_4ba || flash->in_4ba_mode) {
+		cmd_buf[1] = (addr >> 24) & 0xff;
+		cmd_buf[2] = (addr >> 16) & 0xff;
+		cmd_buf[3] = (addr >> 8) & 0xff;
+		cmd_buf[4] = (addr >> 0) & 0xff;
+		return 4;
+	}
+	if (addr > 0xffffff) {
+		msg_cerr("%s: Address 0x%x is not reachable with a 3-byte address.\n", __func__, addr);
+		return -1;
+	}
+	cmd_buf[1] = (addr >> 16) & 0xff;
+	cmd_buf[2] = (addr >> 8) & 0xff;
+	cmd_buf[3] = (addr >> 0) & 0xff;
+	return 3;
+}
 
-	id1 = readarr[0];
-	id2 = readarr[1];
+/*
+ * Ask chips which record the outcome of the last erase whether it failed, e.g. because the block is protected or
+ * worn out. Costs one or two commands per erase instead of reading the block back.
+ * Returns 0 if the erase succeeded or the chip can not tell, -1 if the chip reported a failure.
+ */
+static int spi_check_erase_fail(struct flashctx *flash)
+{
+	static const unsigned char rdscur[JEDEC_RDSCUR_OUTSIZE] = { JEDEC_RDSCUR };
+	static const unsigned char rdfsr[JEDEC_RDFSR_OUTSIZE] = { JEDEC_RDFSR };
+	static const unsigned char clfsr[JEDEC_CLFSR_OUTSIZE] = { JEDEC_CLFSR };
+	unsigned char reg;
+
+	if (flash->chip->feature_bits & FEATURE_ERASE_FAIL_SCUR) {
+		if (spi_send_command(flash, sizeof(rdscur), JEDEC_RDSCUR_INSIZE, rdscur, &reg)) {
+			msg_cerr("Reading the security register failed.\n");
+			return -1;
+		}
+		/* E_FAIL is cleared by the next erase. */
+		if (reg & SPI_SCUR_E_FAIL) {
+			msg_cerr("Chip reported an erase failure (security register 0x%02x).\n", reg);
+			return -1;
+		}
+	}
+	if (flash->chip->feature_bits & FEATURE_ERASE_FAIL_FSR) {
+		if (spi_send_command(flash, sizeof(rdfsr), JEDEC_RDFSR_INSIZE, rdfsr, &reg)) {
+			msg_cerr("Reading the flag status register failed.\n");
+			return -1;
+		}
+		if (reg & SPI_FSR_ERASE_ERR) {
+			msg_cerr("Chip reported an erase failure (flag status register 0x%02x).\n", reg);
+			/* The error bits stay set until they are cleared explicitly. */
+			spi_send_command(flash, sizeof(clfsr), JEDEC_CLFSR_INSIZE, clfsr, NULL);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", __func__, id1, id2);
+/* Wait until an erase started with timing class @timing is done and check whether it failed. */
+static int spi_wait_for_erase(struct flashctx *flash, enum op_timing_type timing, unsigned int max_step)
+{
+	int result = spi_wait_for_wip(flash, timing, 0, max_step);
 
-	if (id1 == flash->chip->manufacture_id && id2 == flash->chip->model_id)
-		return 1;
+	if (result)
+		return result;
+	return spi_check_erase_fail(flash);
+}
 
-	return 0;
+/*
+ * Returns the timing class of erasing a block of @blocklen bytes, as given by the chip's block_erasers entry.
+ * The opcode alone does not tell: 0x52 erases 64 kB blocks on some chips and 0x20 erases 64 kB sectors on
+ * Macronix eliteflash, for example.
+ */
+static enum op_timing_type spi_erase_timing(const struct flashctx *flash, unsigned int blocklen)
+{
+	switch (blocklen) {
+	case 4 * 1024:
+		return OP_TIMING_SE;
+	case 32 * 1024:
+		return OP_TIMING_BE32;
+	case 64 * 1024:
+		return OP_TIMING_BE64;
+	}
+	if (blocklen == flash->chip->total_size * 1024)
+		return OP_TIMING_CE;
+	return NUM_OP_TIMINGS;
 }
 
-int spi_chip_erase_60(struct flashctx *flash)
+/* Send WREN and the erase command @op for the @blocklen bytes at @addr, then wait until the erase is done. */
+static int spi_send_erase_cmd(struct flashctx *flash, uint8_t op, bool native_4ba, unsigned int addr,
+			      unsigned int blocklen, unsigned int max_step)
 {
 	int result;
+	unsigned char cmd[1 + 4] = { op };
+	const int addr_len = spi_prepare_address(flash, cmd, native_4ba, addr);
 	struct spi_command cmds[] = {
 	{
 		.writecnt	= JEDEC_WREN_OUTSIZE,
@@ -331,8 +591,8 @@ int spi_chip_erase_60(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_CE_60_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_CE_60 },
+		.writecnt	= 1 + addr_len,
+		.writearr	= cmd,
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -341,25 +601,37 @@ int spi_chip_erase_60(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}};
-	
+
+	if (addr_len < 0)
+		return SPI_INVALID_ADDRESS;
+
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
-		msg_cerr("%s failed during command execution\n",
-			__func__);
+		msg_cerr("Erase command 0x%02x failed during command execution at address 0x%x\n", op, addr);
 		return result;
 	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 1-85 s, so wait in 1 s steps.
-	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	return spi_wait_for_erase(flash, spi_erase_timing(flash, blocklen), max_step);
 }
 
-int spi_chip_erase_62(struct flashctx *flash)
+static int spi_exit_4ba_shutdown(void *data)
 {
+	struct flashctx *flash = data;
+	static const unsigned char cmd[] = { JEDEC_EXIT_4_BYTE_ADDR_MODE };
+
+	if (!flash->in_4ba_mode)
+		return 0;
+	msg_cdbg("Leaving 4-byte address mode.\n");
+	flash->in_4ba_mode = false;
+	return spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
+}
+
+/*
+ * Prepare access to chips larger than 16 MB. Chips with native 4-byte address commands are used as they are,
+ * others are switched to 4-byte address mode with EN4B until the programmer is shut down.
+ */
+int spi_prepare_4ba(struct flashctx *flash)
+{
+	const int feature_bits = flash->chip->feature_bits;
 	int result;
 	struct spi_command cmds[] = {
 	{
@@ -368,8 +640,8 @@ int spi_chip_erase_62(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_CE_62_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_CE_62 },
+		.writecnt	= 1,
+		.writearr	= (const unsigned char[]){ JEDEC_ENTER_4_BYTE_ADDR_MODE },
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -378,24 +650,36 @@ int spi_chip_erase_62(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}};
-	
-	result = spi_send_multicommand(flash, cmds);
+
+	if (flash->chip->bustype != BUS_SPI || flash->chip->total_size <= 16 * 1024 || flash->in_4ba_mode)
+		return 0;
+
+	if (!(flash->mst->spi.features & SPI_MASTER_4BA)) {
+		msg_cwarn("This chip is larger than 16 MB but the programmer can not send 4-byte addresses.\n"
+			  "Only the lower 16 MB can be accessed.\n");
+		return 0;
+	}
+	if (spi_use_native_4ba(flash)) {
+		msg_cdbg("Using native 4-byte address commands.\n");
+		return 0;
+	}
+	if (!(feature_bits & (FEATURE_4BA_ENTER | FEATURE_4BA_ENTER_WREN))) {
+		msg_cwarn("No way to use 4-byte addresses with this chip is known.\n"
+			  "Only the lower 16 MB can be accessed.\n");
+		return 0;
+	}
+
+	msg_cdbg("Entering 4-byte address mode.\n");
+	result = spi_send_multicommand(flash, (feature_bits & FEATURE_4BA_ENTER_WREN) ? cmds : cmds + 1);
 	if (result) {
-		msg_cerr("%s failed during command execution\n",
-			__func__);
+		msg_cerr("%s failed during command execution\n", __func__);
 		return result;
 	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 2-5 s, so wait in 100 ms steps.
-	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	flash->in_4ba_mode = true;
+	return register_shutdown(spi_exit_4ba_shutdown, flash);
 }
 
-int spi_chip_erase_c7(struct flashctx *flash)
+int spi_chip_erase_60(struct flashctx *flash)
 {
 	int result;
 	struct spi_command cmds[] = {
@@ -405,8 +689,8 @@ int spi_chip_erase_c7(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_CE_C7_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_CE_C7 },
+		.writecnt	= JEDEC_CE_60_OUTSIZE,
+		.writearr	= (const unsigned char[]){ JEDEC_CE_60 },
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -415,24 +699,20 @@ int spi_chip_erase_c7(struct flashctx *flash)
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}};
-
+	
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
-		msg_cerr("%s failed during command execution\n", __func__);
+		msg_cerr("%s failed during command execution\n",
+			__func__);
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 1-85 s, so wait in 1 s steps.
+	 * This usually takes 1-85 s, so poll in at most 1 s steps.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	return spi_wait_for_erase(flash, OP_TIMING_CE, 1000 * 1000);
 }
 
-int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
-		       unsigned int blocklen)
+int spi_chip_erase_62(struct flashctx *flash)
 {
 	int result;
 	struct spi_command cmds[] = {
@@ -442,13 +722,8 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BE_52_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_52,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
+		.writecnt	= JEDEC_CE_62_OUTSIZE,
+		.writearr	= (const unsigned char[]){ JEDEC_CE_62 },
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -457,26 +732,20 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}};
-
+	
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
+		msg_cerr("%s failed during command execution\n",
+			__func__);
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
+	 * This usually takes 2-5 s, so poll in at most 100 ms steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	return spi_wait_for_erase(flash, OP_TIMING_CE, 100 * 1000);
 }
 
-/* Block size is usually
- * 32M (one die) for Micron
- */
-int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+int spi_chip_erase_c7(struct flashctx *flash)
 {
 	int result;
 	struct spi_command cmds[] = {
@@ -486,13 +755,8 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BE_C4_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_C4,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
+		.writecnt	= JEDEC_CE_C7_OUTSIZE,
+		.writearr	= (const unsigned char[]){ JEDEC_CE_C7 },
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -504,16 +768,29 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
 
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
+		msg_cerr("%s failed during command execution\n", __func__);
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 240-480 s, so wait in 500 ms steps.
+	 * This usually takes 1-85 s, so poll in at most 1 s steps.
 	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(500 * 1000 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	return spi_wait_for_erase(flash, OP_TIMING_CE, 1000 * 1000);
+}
+
+int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
+		       unsigned int blocklen)
+{
+	/* This usually takes 100-4000 ms, so poll in at most 100 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_52, false, addr, blocklen, 100 * 1000);
+}
+
+/* Block size is usually
+ * 32M (one die) for Micron
+ */
+int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+{
+	/* This usually takes 240-480 s, so poll in at most 500 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_C4, false, addr, blocklen, 500 * 1000);
 }
 
 /* Block size is usually
@@ -524,43 +801,8 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
 int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BE_D8_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_D8,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 100-4000 ms, so poll in at most 100 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_D8, false, addr, blocklen, 100 * 1000);
 }
 
 /* Block size is usually
@@ -569,207 +811,57 @@ int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
 int spi_block_erase_d7(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BE_D7_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_D7,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 100-4000 ms, so poll in at most 100 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_D7, false, addr, blocklen, 100 * 1000);
 }
 
 /* Page erase (usually 256B blocks) */
 int spi_block_erase_db(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_PE_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_PE,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	} };
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This takes up to 20 ms usually (on worn out devices up to the 0.5s range), so wait in 1 ms steps. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This takes up to 20 ms usually (on worn out devices up to the 0.5s range), so poll in at most 1 ms
+	 * steps. */
+	return spi_send_erase_cmd(flash, JEDEC_PE, false, addr, blocklen, 1 * 1000);
 }
 
 /* Sector size is usually 4k, though Macronix eliteflash has 64k */
 int spi_block_erase_20(struct flashctx *flash, unsigned int addr,
 		       unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_SE_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_SE,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
+	/* This usually takes 15-800 ms, so poll in at most 10 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_SE, false, addr, blocklen, 10 * 1000);
+}
 
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 15-800 ms, so wait in 10 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+/* Sector erase with a 4-byte address, sectors are 4k. Masters which can only send 3-byte addresses fall back
+ * to 0x20, which reaches the lower 16 MB. */
+int spi_block_erase_21(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+{
+	const bool native_4ba = spi_use_native_4ba(flash);
+
+	/* This usually takes 15-800 ms, so poll in at most 10 ms steps. */
+	return spi_send_erase_cmd(flash, native_4ba ? JEDEC_SE_4BA : JEDEC_SE, native_4ba, addr, blocklen,
+				  10 * 1000);
 }
 
-int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+/* Block erase with a 4-byte address, blocks are 64k. Falls back to 0xd8 like spi_block_erase_21(). */
+int spi_block_erase_dc(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-/*		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, { */
-		.writecnt	= JEDEC_BE_50_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_50,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
+	const bool native_4ba = spi_use_native_4ba(flash);
 
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 10 ms, so wait in 1 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 100-4000 ms, so poll in at most 100 ms steps. */
+	return spi_send_erase_cmd(flash, native_4ba ? JEDEC_BE_DC : JEDEC_BE_D8, native_4ba, addr, blocklen,
+				  100 * 1000);
 }
 
-int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-/*		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, { */
-		.writecnt	= JEDEC_BE_81_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_81,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
+	/* This usually takes 10 ms, so poll in at most 1 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_50, false, addr, blocklen, 1 * 1000);
+}
 
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 8 ms, so wait in 1 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+{
+	/* This usually takes 8 ms, so poll in at most 1 ms steps. */
+	return spi_send_erase_cmd(flash, JEDEC_BE_81, false, addr, blocklen, 1 * 1000);
 }
 
 int spi_block_erase_60(struct flashctx *flash, unsigned int addr,
@@ -813,6 +905,8 @@ erasefunc_t *spi_get_erasefn_from_opcode(uint8_t opcode)
 		return NULL;
 	case 0x20:
 		return &spi_block_erase_20;
+	case 0x21:
+		return &spi_block_erase_21;
 	case 0x50:
 		return &spi_block_erase_50;
 	case 0x52:
@@ -833,6 +927,8 @@ erasefunc_t *spi_get_erasefn_from_opcode(uint8_t opcode)
 		return &spi_block_erase_d8;
 	case 0xdb:
 		return &spi_block_erase_db;
+	case 0xdc:
+		return &spi_block_erase_dc;
 	default:
 		msg_cinfo("%s: unknown erase opcode (0x%02x). Please report "
 			  "this at flashrom@flashrom.org\n", __func__, opcode);
@@ -843,49 +939,107 @@ erasefunc_t *spi_get_erasefn_from_opcode(uint8_t opcode)
 int spi_byte_program(struct flashctx *flash, unsigned int addr,
 		     uint8_t databyte)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BYTE_PROGRAM,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff),
-					databyte
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
+	return spi_nbyte_program(flash, addr, &databyte, 1);
+}
 
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
+/*
+ * Fill @cmd (at least JEDEC_BYTE_PROGRAM_4BA_OUTSIZE - 1 bytes) with the opcode and address of a page program
+ * command for @addr. Also used by masters which queue page programs on their own.
+ * Returns the number of bytes before the data, or SPI_INVALID_ADDRESS.
+ */
+int spi_prepare_program_cmd(struct flashctx *flash, unsigned int addr, uint8_t *cmd)
+{
+	const bool native_4ba = spi_use_native_4ba(flash);
+	int addr_len;
+
+	cmd[0] = native_4ba ? JEDEC_BYTE_PROGRAM_4BA : JEDEC_BYTE_PROGRAM;
+	addr_len = spi_prepare_address(flash, cmd, native_4ba, addr);
+	if (addr_len < 0)
+		return SPI_INVALID_ADDRESS;
+	return 1 + addr_len;
+}
+
+/* Maximum number of pages spi_write_batched() queues. */
+#define SPI_BATCH_MAX_PAGES	16
+
+/*
+ * Program pages in batches for masters which can queue WREN, page program, a pause and status reads without a
+ * round trip each, see spi_batch_send_func_t. A busy chip ignores WREN and thus the page program after it,
+ * which shows as WIP in the status read right after WREN. Exactly those pages are sent again, after waiting
+ * for the chip, so a page is never programmed twice however long the chip takes.
+ */
+int spi_write_batched(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+		      unsigned int max_pages, spi_batch_send_func_t *send)
+{
+	struct spi_batch_page pages[SPI_BATCH_MAX_PAGES];
+	const unsigned int page_size = flash->chip->page_size;
+	const unsigned int end = start + len;
+	unsigned int queued = 0, sent, kept, i;
+	bool stalled = false, busy;
+	int ret;
+
+	max_pages = min(max(max_pages, 1), SPI_BATCH_MAX_PAGES);
+	while (start < end || queued) {
+		/* Pages which have to be sent again stay at the front of the queue. */
+		for (; queued < max_pages && start < end; queued++) {
+			struct spi_batch_page *page = &pages[queued];
+			const int hdr_len = spi_prepare_program_cmd(flash, start, page->cmd);
+
+			if (hdr_len < 0)
+				return hdr_len;
+			page->start = start;
+			page->len = min(min(end - start, page_size - start % page_size), 256);
+			page->cmdlen = hdr_len + page->len;
+			page->wait_us = spi_page_program_time(flash);
+			memcpy(page->cmd + hdr_len, buf, page->len);
+			buf += page->len;
+			start += page->len;
+		}
+
+		ret = send(flash, pages, queued);
+		if (ret < 0)
+			return ret;
+		sent = ret;
+		busy = pages[sent - 1].status & SPI_SR_WIP;
+
+		for (i = kept = 0; i < sent; i++) {
+			if ((pages[i].wel_status & (SPI_SR_WEL | SPI_SR_WIP)) == SPI_SR_WEL)
+				continue;
+			msg_cspew("Chip busy before page at 0x%06x, sending it again.\n", pages[i].start);
+			if (kept != i)
+				pages[kept] = pages[i];
+			kept++;
+		}
+		/* If not even the first page after waiting for the chip was accepted, it never will be. */
+		if (kept == sent) {
+			if (stalled) {
+				msg_cerr("%s: the chip does not accept write enable at 0x%06x.\n", __func__,
+					 pages[0].start);
+				return SPI_GENERIC_ERROR;
+			}
+			stalled = true;
+		} else {
+			stalled = false;
+		}
+		memmove(&pages[kept], &pages[sent], (queued - sent) * sizeof(*pages));
+		queued -= sent - kept;
+
+		if (kept || busy) {
+			/* The batch already waited for the program time, so poll right away. */
+			ret = spi_wait_for_wip(flash, NUM_OP_TIMINGS, 0, 10);
+			if (ret)
+				return ret;
+		}
 	}
-	return result;
+	return 0;
 }
 
 int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes, unsigned int len)
 {
 	int result;
 	/* FIXME: Switch to malloc based on len unless that kills speed. */
-	unsigned char cmd[JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + 256] = {
-		JEDEC_BYTE_PROGRAM,
-		(addr >> 16) & 0xff,
-		(addr >> 8) & 0xff,
-		(addr >> 0) & 0xff,
-	};
+	unsigned char cmd[JEDEC_BYTE_PROGRAM_4BA_OUTSIZE - 1 + 256];
+	const int hdr_len = spi_prepare_program_cmd(flash, addr, cmd);
 	struct spi_command cmds[] = {
 	{
 		.writecnt	= JEDEC_WREN_OUTSIZE,
@@ -893,7 +1047,7 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + len,
+		.writecnt	= hdr_len + len,
 		.writearr	= cmd,
 		.readcnt	= 0,
 		.readarr	= NULL,
@@ -913,7 +1067,10 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		return 1;
 	}
 
-	memcpy(&cmd[4], bytes, len);
+	if (hdr_len < 0)
+		return hdr_len;
+
+	memcpy(&cmd[hdr_len], bytes, len);
 
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
@@ -923,18 +1080,128 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 	return result;
 }
 
+/* Read commands in order of preference. */
+static const struct spi_read_cmd {
+	uint8_t opcode;
+	uint8_t opcode_4ba;		/* Native 4-byte address variant */
+	enum spi_io_mode io_mode;
+	int chip_feature;		/* Feature bit the chip needs, 0 if supported by all chips */
+	unsigned int master_feature;	/* Capability the master needs, 0 if supported by all masters */
+	unsigned int dummy_len;		/* Mode and dummy bytes after the address */
+	const char *name;
+} spi_read_cmds[] = {
+	{JEDEC_FAST_READ_QIO, JEDEC_FAST_READ_QIO_4BA, SPI_IO_QUAD_IO, FEATURE_FAST_READ_QIO, SPI_MASTER_QUAD_IO,
+	 JEDEC_FAST_READ_QIO_OUTSIZE - 4, "Quad I/O Fast Read"},
+	{JEDEC_FAST_READ_QOUT, JEDEC_FAST_READ_QOUT_4BA, SPI_IO_QUAD_OUT, FEATURE_FAST_READ_QOUT,
+	 SPI_MASTER_QUAD_OUT, JEDEC_FAST_READ_QOUT_OUTSIZE - 4, "Quad Output Fast Read"},
+	{JEDEC_FAST_READ_DOUT, JEDEC_FAST_READ_DOUT_4BA, SPI_IO_DUAL_OUT, FEATURE_FAST_READ_DOUT,
+	 SPI_MASTER_DUAL_OUT, JEDEC_FAST_READ_DOUT_OUTSIZE - 4, "Dual Output Fast Read"},
+	{JEDEC_FAST_READ, JEDEC_FAST_READ_4BA, SPI_IO_SINGLE, FEATURE_FAST_READ, SPI_MASTER_FAST_READ,
+	 JEDEC_FAST_READ_OUTSIZE - 4, "Fast Read"},
+	{JEDEC_READ, JEDEC_READ_4BA, SPI_IO_SINGLE, 0, 0,
+	 JEDEC_READ_OUTSIZE - 4, "Read"},
+};
+
+/* Quad transfers reuse the WP# and HOLD# pins, which only works if the Quad Enable bit is set. We only check it
+ * because setting it is a non-volatile status register write on most chips. */
+static bool spi_quad_enabled(struct flashctx *flash)
+{
+	static const unsigned char cmd[JEDEC_RDSR2_OUTSIZE] = { JEDEC_RDSR2 };
+	unsigned char sr2;
+
+	if (flash->chip->feature_bits & FEATURE_QE_SR1_6)
+		return spi_read_status_register(flash) & SPI_SR1_QE;
+	if (flash->chip->feature_bits & FEATURE_QE_SR2_1) {
+		if (spi_send_command(flash, sizeof(cmd), JEDEC_RDSR2_INSIZE, cmd, &sr2))
+			return false;
+		return sr2 & SPI_SR2_QE;
+	}
+	return false;
+}
+
+/* Select the fastest read command supported by both the chip and the master. The result is cached in @flash. */
+static const struct spi_read_cmd *spi_get_read_cmd(struct flashctx *flash)
+{
+	const struct spi_read_cmd *rc;
+	int quad = -1;
+
+	for (rc = spi_read_cmds; rc < spi_read_cmds + ARRAY_SIZE(spi_read_cmds) - 1; rc++) {
+		if (flash->spi_read_opcode) {
+			if (rc->opcode == flash->spi_read_opcode)
+				return rc;
+			continue;
+		}
+		if (rc->chip_feature && !(flash->chip->feature_bits & rc->chip_feature))
+			continue;
+		if ((flash->mst->spi.features & rc->master_feature) != rc->master_feature)
+			continue;
+		if (rc->io_mode == SPI_IO_QUAD_OUT || rc->io_mode == SPI_IO_QUAD_IO) {
+			if (quad == -1) {
+				quad = spi_quad_enabled(flash);
+				if (!quad)
+					msg_cdbg("Quad Enable bit is not set, not using quad reads.\n");
+			}
+			if (!quad)
+				continue;
+		}
+		break;
+	}
+	if (!flash->spi_read_opcode) {
+		msg_cdbg("Using %s (0x%02x) for reading.\n", rc->name,
+			 spi_use_native_4ba(flash) ? rc->opcode_4ba : rc->opcode);
+		flash->spi_read_opcode = rc->opcode;
+	}
+	return rc;
+}
+
+/*
+ * Fill @cmd (JEDEC_READ_CMD_MAXLEN bytes) with the read command spi_nbyte_read() would send for @address and
+ * store its bus width in @io_mode. Also used by masters which stream long reads on their own.
+ * Returns the number of bytes to send before the data is clocked out, or SPI_INVALID_ADDRESS.
+ */
+int spi_prepare_read_cmd(struct flashctx *flash, unsigned int address, uint8_t *cmd, enum spi_io_mode *io_mode)
+{
+	const struct spi_read_cmd *rc = spi_get_read_cmd(flash);
+	const bool native_4ba = spi_use_native_4ba(flash);
+	int addr_len;
+
+	/* Mode and dummy bytes are sent as 0xff which keeps chips out of their continuous read modes. */
+	memset(cmd, 0xff, JEDEC_READ_CMD_MAXLEN);
+	cmd[0] = native_4ba ? rc->opcode_4ba : rc->opcode;
+	addr_len = spi_prepare_address(flash, cmd, native_4ba, address);
+	if (addr_len < 0)
+		return SPI_INVALID_ADDRESS;
+	*io_mode = rc->io_mode;
+	return 1 + addr_len + rc->dummy_len;
+}
+
 int spi_nbyte_read(struct flashctx *flash, unsigned int address, uint8_t *bytes,
 		   unsigned int len)
 {
-	const unsigned char cmd[JEDEC_READ_OUTSIZE] = {
-		JEDEC_READ,
-		(address >> 16) & 0xff,
-		(address >> 8) & 0xff,
-		(address >> 0) & 0xff,
-	};
+	unsigned char cmd[JEDEC_READ_CMD_MAXLEN];
+	enum spi_io_mode io_mode = SPI_IO_SINGLE;
+	const int writecnt = spi_prepare_read_cmd(flash, address, cmd, &io_mode);
+	struct spi_command cmds[] = {
+	{
+		.writecnt	= writecnt,
+		.writearr	= cmd,
+		.readcnt	= len,
+		.readarr	= bytes,
+		.io_mode	= io_mode,
+	}, {
+		.writecnt	= 0,
+		.writearr	= NULL,
+		.readcnt	= 0,
+		.readarr	= NULL,
+	}};
+
+	if (writecnt < 0)
+		return writecnt;
 
 	/* Send Read */
-	return spi_send_command(flash, sizeof(cmd), len, cmd, bytes);
+	if (io_mode == SPI_IO_SINGLE)
+		return spi_send_command(flash, writecnt, len, cmd, bytes);
+	return spi_send_multicommand(flash, cmds);
 }
 
 /*
@@ -1014,8 +1281,9 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 			rc = spi_nbyte_program(flash, starthere + j, buf + starthere - start + j, towrite);
 			if (rc)
 				break;
-			while (spi_read_status_register(flash) & SPI_SR_WIP)
-				programmer_delay(10);
+			rc = spi_wait_for_wip(flash, OP_TIMING_PP, towrite, 10);
+			if (rc)
+				break;
 		}
 		if (rc)
 			break;
@@ -1040,8 +1308,8 @@ int spi_chip_write_1(struct flashctx *flash, const uint8_t *buf, unsigned int st
 		result = spi_byte_program(flash, i, buf[i - start]);
 		if (result)
 			return 1;
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+		if (spi_wait_for_wip(flash, OP_TIMING_BP, 1, 10))
+			return 1;
 	}
 
 	return 0;
@@ -1130,8 +1398,9 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 		msg_cerr("%s failed during start command execution: %d\n", __func__, result);
 		goto bailout;
 	}
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10);
+	result = spi_wait_for_wip(flash, OP_TIMING_BP, 2, 10);
+	if (result != 0)
+		goto bailout;
 
 	/* We already wrote 2 bytes in the multicommand step. */
 	pos += 2;
@@ -1145,8 +1414,9 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 			msg_cerr("%s failed during followup AAI command execution: %d\n", __func__, result);
 			goto bailout;
 		}
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+		result = spi_wait_for_wip(flash, OP_TIMING_BP, 2, 10);
+		if (result != 0)
+			goto bailout;
 	}
 
 	/* Use WRDI to exit AAI mode. This needs to be done before issuing any other non-AAI command. */
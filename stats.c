@@ -0,0 +1,466 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Counters and timers for the operations of a session: SPI commands per opcode, chip reads, erases and writes
+ * per phase, erases per block and per block size, status register polls, USB transfers and programmer delays. Nothing but the
+ * status register polls is recorded unless stats_enable() was called, and the clock is only read then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#ifndef __LIBPAYLOAD__
+#include <time.h>
+#include <sys/time.h>
+#endif
+#include "flash.h"
+#include "spi.h"
+
+struct op_stats {
+	unsigned long count;
+	uint64_t bytes;
+	uint64_t ns;
+};
+
+struct opcode_stats {
+	unsigned long count;
+	uint64_t written;
+	uint64_t read;
+	uint64_t ns;
+};
+
+struct erase_block_stats {
+	unsigned int len;
+	unsigned long count;
+	uint64_t ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+};
+
+struct erase_stats {
+	unsigned int start;
+	unsigned int len;
+	uint64_t ns;
+};
+
+static bool enabled = false;
+static uint64_t session_start;
+
+static enum stats_phase cur_phase = STATS_PHASE_NONE;
+static uint64_t phase_start;
+static uint64_t phase_ns[NUM_STATS_PHASES];
+/* Operations per phase. The STATS_PHASE_NONE entry collects everything outside of the phases. */
+static struct op_stats ops[NUM_STATS_PHASES][NUM_STATS_OPS];
+
+static struct erase_block_stats erase_blocks[NUM_ERASEFUNCTIONS * NUM_ERASEREGIONS];
+
+/* Every block erase in the order they were issued. */
+static struct erase_stats *erases;
+static unsigned int num_erases;
+static unsigned int max_erases;
+
+/* SPI commands by opcode, the last entry counts commands without any bytes to write. */
+static struct opcode_stats opcodes[256 + 1];
+static unsigned long spi_transactions;
+static unsigned int spi_depth;
+
+static unsigned long usb_transfers;
+static uint64_t delay_us;
+static uint64_t modeled_ns;
+
+/* Status register polls per operation type. The last entry counts operations without timing data in struct
+ * flashchip. These are always collected because they are printed in verbose mode as well. */
+static struct {
+	unsigned long ops;
+	unsigned long polls;
+	uint64_t wait_us;
+} wip[NUM_OP_TIMINGS + 1];
+
+static const char *const phase_names[NUM_STATS_PHASES] = {
+	[STATS_PHASE_NONE]	= "other",
+	[STATS_PHASE_PROBE]	= "probe",
+	[STATS_PHASE_READ]	= "read",
+	[STATS_PHASE_ERASE]	= "erase",
+	[STATS_PHASE_WRITE]	= "write",
+	[STATS_PHASE_VERIFY]	= "verify",
+};
+
+/* The operation whose throughput is reported for a phase. */
+static const enum stats_op phase_main_op[NUM_STATS_PHASES] = {
+	[STATS_PHASE_NONE]	= STATS_OP_READ,
+	[STATS_PHASE_PROBE]	= STATS_OP_READ,
+	[STATS_PHASE_READ]	= STATS_OP_READ,
+	[STATS_PHASE_ERASE]	= STATS_OP_ERASE,
+	[STATS_PHASE_WRITE]	= STATS_OP_WRITE,
+	[STATS_PHASE_VERIFY]	= STATS_OP_READ,
+};
+
+static const char *const op_names[NUM_STATS_OPS] = {
+	[STATS_OP_READ]		= "read",
+	[STATS_OP_ERASE]	= "erase",
+	[STATS_OP_WRITE]	= "write",
+};
+
+static const char *const wip_names[NUM_OP_TIMINGS + 1] = {
+	[OP_TIMING_BP]		= "byte program",
+	[OP_TIMING_PP]		= "page program",
+	[OP_TIMING_SE]		= "sector erase",
+	[OP_TIMING_BE32]	= "32 kB block erase",
+	[OP_TIMING_BE64]	= "64 kB block erase",
+	[OP_TIMING_CE]		= "chip erase",
+	[NUM_OP_TIMINGS]	= "other",
+};
+
+/* Monotonic time in nanoseconds, or 0 if statistics are disabled. */
+uint64_t stats_now(void)
+{
+	if (!enabled)
+		return 0;
+#if defined(__LIBPAYLOAD__)
+	return 0;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+#ifndef __LIBPAYLOAD__
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+static uint64_t since(uint64_t start)
+{
+	uint64_t now = stats_now();
+
+	return now > start ? now - start : 0;
+}
+
+void stats_enable(void)
+{
+	enabled = true;
+	session_start = stats_now();
+	phase_start = session_start;
+}
+
+/* Start a new phase, which ends the current one. */
+void stats_phase(enum stats_phase phase)
+{
+	uint64_t now = stats_now();
+
+	phase_ns[cur_phase] += now - phase_start;
+	phase_start = now;
+	cur_phase = phase;
+}
+
+/* Record a chip level read, erase or write of @len bytes at @addr that started at @start (from stats_now()). */
+void stats_op(enum stats_op op, unsigned int addr, unsigned int len, uint64_t start)
+{
+	struct op_stats *s = &ops[cur_phase][op];
+	struct erase_block_stats *b;
+	uint64_t ns;
+	unsigned int i;
+
+	if (!enabled)
+		return;
+	ns = since(start);
+	s->count++;
+	s->bytes += len;
+	s->ns += ns;
+	if (op != STATS_OP_ERASE)
+		return;
+
+	if (num_erases == max_erases) {
+		unsigned int max = max_erases ? max_erases * 2 : 64;
+		struct erase_stats *tmp = realloc(erases, max * sizeof(*tmp));
+
+		if (!tmp) {
+			msg_gerr("Out of memory!\n");
+			exit(1);
+		}
+		erases = tmp;
+		max_erases = max;
+	}
+	erases[num_erases].start = addr;
+	erases[num_erases].len = len;
+	erases[num_erases].ns = ns;
+	num_erases++;
+
+	for (i = 0; i < ARRAY_SIZE(erase_blocks); i++) {
+		b = &erase_blocks[i];
+		if (b->count && b->len != len)
+			continue;
+		if (!b->count || ns < b->min_ns)
+			b->min_ns = ns;
+		if (ns > b->max_ns)
+			b->max_ns = ns;
+		b->len = len;
+		b->count++;
+		b->ns += ns;
+		break;
+	}
+}
+
+/*
+ * Called before a command is handed to the SPI master. Masters may implement one of spi_send_command() and
+ * spi_send_multicommand() with the other, so only the outermost call is recorded.
+ */
+uint64_t stats_spi_begin(void)
+{
+	spi_depth++;
+	return stats_now();
+}
+
+static void record_spi_command(unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr,
+			       uint64_t ns)
+{
+	struct opcode_stats *s = &opcodes[writecnt ? writearr[0] : 256];
+
+	s->count++;
+	s->written += writecnt;
+	s->read += readcnt;
+	s->ns += ns;
+}
+
+void stats_spi_command_end(uint64_t start, unsigned int writecnt, unsigned int readcnt,
+			   const unsigned char *writearr)
+{
+	if (--spi_depth || !enabled)
+		return;
+	spi_transactions++;
+	record_spi_command(writecnt, readcnt, writearr, since(start));
+}
+
+/*
+ * The time of a multicommand can't be split between its commands. It is accounted to the first command that
+ * is not a Write Enable, which is the one doing the work in all the sequences flashrom sends.
+ */
+void stats_spi_multicommand_end(uint64_t start, const struct spi_command *cmds)
+{
+	uint64_t ns;
+
+	if (--spi_depth || !enabled)
+		return;
+	spi_transactions++;
+	ns = since(start);
+	for (; cmds->writecnt || cmds->readcnt; cmds++) {
+		if (cmds->writecnt && cmds->writearr[0] == JEDEC_WREN && (cmds[1].writecnt || cmds[1].readcnt)) {
+			record_spi_command(cmds->writecnt, cmds->readcnt, cmds->writearr, 0);
+			continue;
+		}
+		record_spi_command(cmds->writecnt, cmds->readcnt, cmds->writearr, ns);
+		ns = 0;
+	}
+}
+
+/* Count one USB transfer (a round trip for control transfers) issued by a programmer. */
+void stats_usb_transfer(void)
+{
+	usb_transfers++;
+}
+
+void stats_delay(unsigned int usecs)
+{
+	delay_us += usecs;
+}
+
+/* Record the duration of the session according to a programmer's timing model, e.g. dummy:timing=virtual. */
+void stats_modeled_time(uint64_t ns)
+{
+	modeled_ns = ns;
+}
+
+/* Record a self-timed operation which needed @polls status register reads and @waited us of delays. */
+void stats_wip(enum op_timing_type op, unsigned int polls, unsigned long waited)
+{
+	wip[op].ops++;
+	wip[op].polls += polls;
+	wip[op].wait_us += waited;
+}
+
+/* Print how many status register polls the operations of this session needed. */
+void stats_print_wip(void)
+{
+	int i;
+
+	for (i = 0; i <= NUM_OP_TIMINGS; i++) {
+		if (!wip[i].ops)
+			continue;
+		msg_gdbg("Status register polls for %s: %lu in %lu operations.\n", wip_names[i],
+			 wip[i].polls, wip[i].ops);
+	}
+}
+
+#ifndef __LIBPAYLOAD__
+static uint64_t bytes_per_s(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (uint64_t)((double)bytes * 1000000000 / ns) : 0;
+}
+
+static void write_op_json(FILE *f, const struct op_stats *s, const char *indent)
+{
+	fprintf(f, "{\n%s  \"count\": %lu,\n%s  \"bytes\": %" PRIu64 ",\n%s  \"time_us\": %" PRIu64 ",\n"
+		"%s  \"bytes_per_s\": %" PRIu64 "\n%s}", indent, s->count, indent, s->bytes, indent, s->ns / 1000,
+		indent, bytes_per_s(s->bytes, s->ns), indent);
+}
+
+/* Write @str as a JSON string. Chip names may contain quotes or backslashes. */
+static void write_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * Write the statistics of the session as JSON to @filename ("-" for stdout) and end the current phase.
+ * @chip is the name of the flash chip, may be NULL.
+ */
+int stats_write_json(const char *filename, const char *chip)
+{
+	struct op_stats total[NUM_STATS_OPS] = { { 0 } };
+	const char *sep = "";
+	FILE *f;
+	int i, j;
+
+	if (!enabled)
+		return 0;
+	stats_phase(STATS_PHASE_NONE);
+
+	if (!strcmp(filename, "-")) {
+		f = stdout;
+	} else {
+		f = fopen(filename, "w");
+		if (!f) {
+			msg_gerr("Error: Opening statistics file \"%s\" failed: %s\n", filename, strerror(errno));
+			return 1;
+		}
+	}
+
+	fprintf(f, "{\n  \"version\": ");
+	write_json_string(f, flashrom_version);
+	if (chip) {
+		fprintf(f, ",\n  \"chip\": ");
+		write_json_string(f, chip);
+	}
+	fprintf(f, ",\n");
+	fprintf(f, "  \"elapsed_us\": %" PRIu64 ",\n", since(session_start) / 1000);
+	if (modeled_ns)
+		fprintf(f, "  \"modeled_us\": %" PRIu64 ",\n", modeled_ns / 1000);
+
+	fprintf(f, "  \"phases\": {");
+	for (i = 0; i < NUM_STATS_PHASES; i++) {
+		const struct op_stats *main_op = &ops[i][phase_main_op[i]];
+
+		for (j = 0; j < NUM_STATS_OPS; j++) {
+			total[j].count += ops[i][j].count;
+			total[j].bytes += ops[i][j].bytes;
+			total[j].ns += ops[i][j].ns;
+		}
+		if (i == STATS_PHASE_NONE || !phase_ns[i])
+			continue;
+		fprintf(f, "%s\n    \"%s\": {\n      \"time_us\": %" PRIu64 ",\n", sep, phase_names[i],
+			phase_ns[i] / 1000);
+		for (j = 0; j < NUM_STATS_OPS; j++)
+			fprintf(f, "      \"%s_bytes\": %" PRIu64 ",\n", op_names[j], ops[i][j].bytes);
+		fprintf(f, "      \"bytes_per_s\": %" PRIu64 "\n    }", bytes_per_s(main_op->bytes, phase_ns[i]));
+		sep = ",";
+	}
+	fprintf(f, "\n  },\n");
+
+	fprintf(f, "  \"operations\": {");
+	for (j = 0; j < NUM_STATS_OPS; j++) {
+		fprintf(f, "%s\n    \"%s\": ", j ? "," : "", op_names[j]);
+		write_op_json(f, &total[j], "    ");
+	}
+	fprintf(f, "\n  },\n");
+
+	fprintf(f, "  \"erase_blocks\": [");
+	for (i = 0; i < ARRAY_SIZE(erase_blocks) && erase_blocks[i].count; i++) {
+		const struct erase_block_stats *b = &erase_blocks[i];
+
+		fprintf(f, "%s\n    { \"size\": %u, \"count\": %lu, \"time_us\": %" PRIu64 ", \"min_us\": %" PRIu64
+			", \"max_us\": %" PRIu64 " }", i ? "," : "", b->len, b->count, b->ns / 1000,
+			b->min_ns / 1000, b->max_ns / 1000);
+	}
+	fprintf(f, "%s],\n", i ? "\n  " : "");
+
+	fprintf(f, "  \"erases\": [");
+	for (i = 0; i < num_erases; i++) {
+		fprintf(f, "%s\n    { \"start\": %u, \"size\": %u, \"time_us\": %" PRIu64 " }", i ? "," : "",
+			erases[i].start, erases[i].len, erases[i].ns / 1000);
+	}
+	fprintf(f, "%s],\n", i ? "\n  " : "");
+
+	fprintf(f, "  \"spi\": {\n    \"transactions\": %lu,\n    \"opcodes\": [", spi_transactions);
+	sep = "";
+	for (i = 0; i < ARRAY_SIZE(opcodes); i++) {
+		const struct opcode_stats *s = &opcodes[i];
+
+		if (!s->count)
+			continue;
+		if (i < 256)
+			fprintf(f, "%s\n      { \"opcode\": \"0x%02x\", ", sep, i);
+		else
+			fprintf(f, "%s\n      { \"opcode\": null, ", sep);
+		fprintf(f, "\"count\": %lu, \"bytes_written\": %" PRIu64 ", \"bytes_read\": %" PRIu64
+			", \"time_us\": %" PRIu64 " }", s->count, s->written, s->read, s->ns / 1000);
+		sep = ",";
+	}
+	fprintf(f, "%s]\n  },\n", *sep ? "\n    " : "");
+
+	fprintf(f, "  \"wip_polls\": [");
+	sep = "";
+	for (i = 0; i <= NUM_OP_TIMINGS; i++) {
+		if (!wip[i].ops)
+			continue;
+		fprintf(f, "%s\n    { \"operation\": \"%s\", \"count\": %lu, \"polls\": %lu, \"wait_us\": %" PRIu64
+			" }", sep, wip_names[i], wip[i].ops, wip[i].polls, wip[i].wait_us);
+		sep = ",";
+	}
+	fprintf(f, "%s],\n", *sep ? "\n  " : "");
+
+	fprintf(f, "  \"usb_transfers\": %lu,\n  \"delay_us\": %" PRIu64 "\n}\n", usb_transfers, delay_us);
+
+	if (f == stdout)
+		return fflush(f) ? 1 : 0;
+	if (fclose(f)) {
+		msg_gerr("Error: Writing statistics file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+#else
+int stats_write_json(const char *filename, const char *chip)
+{
+	msg_gerr("Writing statistics is not supported on this platform.\n");
+	return 1;
+}
+#endif
@@ -135,6 +135,7 @@ static int send_write(unsigned int writecnt, const unsigned char *writearr)
 		for (i = 0; i < n_write; i++) {
 			buf[i+1] = reverse(writearr[i]);
 		}
+		stats_usb_transfer();
 		if (ftdi_write_data(&ftdic, buf, n_write + 1) < 0) {
 			msg_perr("USB-Blaster write failed\n");
 			return -1;
@@ -159,6 +160,7 @@ static int send_read(unsigned int readcnt, unsigned char *readarr)
 		msg_pspew("reading %d-byte packet\n", payload_size);
 
 		buf[0] = BIT_BYTE | BIT_READ | (uint8_t)payload_size;
+		stats_usb_transfer();
 		if (ftdi_write_data(&ftdic, buf, payload_size + 1) < 0) {
 			msg_perr("USB-Blaster write failed\n");
 			return -1;
@@ -168,7 +170,10 @@ static int send_read(unsigned int readcnt, unsigned char *readarr)
 
 	n_read = readcnt;
 	while (n_read) {
-		int ret = ftdi_read_data(&ftdic, readarr, n_read);
+		int ret;
+
+		stats_usb_transfer();
+		ret = ftdi_read_data(&ftdic, readarr, n_read);
 		if (ret < 0) {
 			msg_perr("USB-Blaster read failed\n");
 			return -1;
@@ -190,6 +195,7 @@ static int usbblaster_spi_send_command(struct flashctx *flash, unsigned int writ
 	int ret = 0;
 
 	cmd = BIT_LED; // asserts /CS
+	stats_usb_transfer();
 	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
 		msg_perr("USB-Blaster enable chip select failed\n");
 		ret = -1;
@@ -202,6 +208,7 @@ static int usbblaster_spi_send_command(struct flashctx *flash, unsigned int writ
 		ret = send_read(readcnt, readarr);
 
 	cmd = BIT_CS;
+	stats_usb_transfer();
 	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
 		msg_perr("USB-Blaster disable chip select failed\n");
 		ret = -1;
@@ -0,0 +1,184 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Micro-benchmark for the buffer comparison kernels in bufcmp.c.
+ *
+ * Usage: bufcmp_bench [size in MiB]
+ *
+ * Every implementation available on this machine is first checked against the portable one on random buffers,
+ * lengths and mismatch positions, then each operation is timed on whole buffers of the given size (default
+ * 64 MiB, the largest chips we handle). The exit status is non-zero if any implementation disagrees.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "flash.h"
+
+#define CHECK_ROUNDS	20000
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+struct results {
+	size_t first_diff, first_not_ff, first_unprogrammable, count_diff, count_not_ff;
+};
+
+static void run_all(struct results *r, const uint8_t *a, const uint8_t *b, size_t len)
+{
+	r->first_diff = buf_first_diff(a, b, len);
+	r->first_not_ff = buf_first_not_ff(a, len);
+	r->first_unprogrammable = buf_first_unprogrammable(a, b, len);
+	r->count_diff = buf_count_diff(a, b, len);
+	r->count_not_ff = buf_count_not_ff(a, len);
+}
+
+/* Compare @impl against the portable implementation. Returns 0 if they always agree. */
+static int check_impl(const char *impl)
+{
+	uint8_t a[1024], b[1024];
+	struct results ref, res;
+	unsigned int round;
+
+	srand(1);
+	for (round = 0; round < CHECK_ROUNDS; round++) {
+		const size_t off = rand() % 64;
+		const size_t len = rand() % (sizeof(a) - off);
+		size_t i;
+
+		/* Mostly identical or erased data with a few random hits, like real images. */
+		memset(a, rand() % 2 ? 0xff : rand(), sizeof(a));
+		memcpy(b, a, sizeof(b));
+		for (i = rand() % 4; i > 0; i--) {
+			a[rand() % sizeof(a)] = rand();
+			b[rand() % sizeof(b)] = rand();
+		}
+		if (round % 16 == 0)
+			fill_random(b, sizeof(b));
+
+		bufcmp_select_impl("scalar");
+		run_all(&ref, a + off, b + off, len);
+		bufcmp_select_impl(impl);
+		run_all(&res, a + off, b + off, len);
+		if (memcmp(&ref, &res, sizeof(ref))) {
+			fprintf(stderr, "%s disagrees with scalar (round %u, offset %zu, length %zu).\n",
+				impl, round, off, len);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void report(const char *impl, const char *op, size_t len, unsigned int reps, double t)
+{
+	printf("%-8s %-22s %10.1f MiB/s\n", impl, op, (double)len * reps / t / (1024 * 1024));
+}
+
+static void bench_impl(const char *impl, const uint8_t *erased, const uint8_t *data, const uint8_t *copy,
+		       size_t len, unsigned int reps)
+{
+	volatile size_t sink = 0;
+	unsigned int i;
+	double t;
+
+	bufcmp_select_impl(impl);
+
+	t = now();
+	for (i = 0; i < reps; i++)
+		sink += buf_first_diff(data, copy, len);
+	report(impl, "first_diff", len, reps, now() - t);
+
+	t = now();
+	for (i = 0; i < reps; i++)
+		sink += buf_first_not_ff(erased, len);
+	report(impl, "first_not_ff", len, reps, now() - t);
+
+	t = now();
+	for (i = 0; i < reps; i++)
+		sink += buf_first_unprogrammable(erased, data, len);
+	report(impl, "first_unprogrammable", len, reps, now() - t);
+
+	t = now();
+	for (i = 0; i < reps; i++)
+		sink += buf_count_diff(data, erased, len);
+	report(impl, "count_diff", len, reps, now() - t);
+
+	t = now();
+	for (i = 0; i < reps; i++)
+		sink += buf_count_not_ff(data, len);
+	report(impl, "count_not_ff", len, reps, now() - t);
+	(void)sink;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = 64 * 1024 * 1024;
+	const unsigned int reps = 4;
+	uint8_t *erased, *data, *copy;
+	const char *impl;
+	unsigned int i;
+	int ret = 0;
+
+	if (argc > 1)
+		len = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+	if (!len) {
+		fprintf(stderr, "Usage: %s [size in MiB]\n", argv[0]);
+		return 1;
+	}
+
+	printf("Default implementation: %s\n", bufcmp_impl());
+	for (i = 0; (impl = bufcmp_impl_name(i)); i++) {
+		if (check_impl(impl))
+			ret = 1;
+	}
+	if (ret)
+		return ret;
+
+	erased = malloc(len);
+	data = malloc(len);
+	copy = malloc(len);
+	if (!erased || !data || !copy) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+	memset(erased, 0xff, len);
+	fill_random(data, len);
+	memcpy(copy, data, len);
+
+	for (i = 0; (impl = bufcmp_impl_name(i)); i++)
+		bench_impl(impl, erased, data, copy, len, reps);
+
+	free(copy);
+	free(data);
+	free(erased);
+	return 0;
+}
@@ -0,0 +1,517 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Performance regression benchmark for flashrom, driven by the dummy programmer.
+ *
+ * Usage: flashrom_bench [-f flashrom] [-b baseline] [-t tolerance] [-u] [-k]
+ *
+ * Every scenario starts from a known emulated chip, runs flashrom with --stats against the dummy programmer's
+ * virtual timing model and checks the resulting chip contents. The SPI transactions, commands, bytes on the
+ * wire and modeled time of each scenario are deterministic and are compared against the baseline file; any of
+ * them growing by more than the tolerance (in percent, default 0) is a regression and makes the exit status
+ * non-zero. The real elapsed time is only reported. With -u the baseline file is rewritten from this run, -k
+ * keeps the work directory with the images, logs and statistics of every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define CHIP_SIZE	(8 * 1024 * 1024)
+#define SECTOR_SIZE	4096
+#define REGION_START	0x200000
+#define REGION_END	0x3fffff
+
+/* The chip is accessed through a link with a USB-like latency per transaction. */
+#define PROGRAMMER	"dummy:emulate=MX25L6436,timing=virtual,spi_latency=100,image="
+#define CHIPNAME	"MX25L6436E/MX25L6445E/MX25L6465E/MX25L6473E"
+
+enum contents {
+	ERASED,		/* all 0xff */
+	IMAGE_A,	/* random data */
+	IMAGE_B,	/* other random data */
+	A_1PCT,		/* IMAGE_A with 1% of the sectors rewritten */
+	A_50PCT,	/* IMAGE_A with 50% of the sectors rewritten */
+	A_REGION,	/* IMAGE_A with the layout region taken from IMAGE_B */
+};
+
+struct scenario {
+	const char *name;
+	enum contents chip;	/* contents of the chip before the run */
+	const char *op;		/* flashrom operation */
+	enum contents image;	/* image file for the operation */
+	bool region;		/* restrict the operation to the layout region */
+	enum contents expect;	/* contents of the chip after the run */
+};
+
+static const struct scenario scenarios[] = {
+	{ "full_write",		ERASED,		"-w",	IMAGE_A,	false,	IMAGE_A },
+	{ "diff_1pct",		IMAGE_A,	"-w",	A_1PCT,		false,	A_1PCT },
+	{ "diff_50pct",		IMAGE_A,	"-w",	A_50PCT,	false,	A_50PCT },
+	{ "region_write",	IMAGE_A,	"-w",	IMAGE_B,	true,	A_REGION },
+	{ "erase",		IMAGE_A,	"-E",	ERASED,		false,	ERASED },
+	{ "read",		IMAGE_A,	"-r",	IMAGE_A,	false,	IMAGE_A },
+	{ "verify",		IMAGE_A,	"-v",	IMAGE_A,	false,	IMAGE_A },
+};
+
+#define NUM_SCENARIOS	(sizeof(scenarios) / sizeof(scenarios[0]))
+
+enum metric {
+	TRANSACTIONS,
+	COMMANDS,
+	WIRE_BYTES,
+	MODELED_US,
+	NUM_METRICS
+};
+
+static const char *const metric_names[NUM_METRICS] = {
+	[TRANSACTIONS]	= "transactions",
+	[COMMANDS]	= "commands",
+	[WIRE_BYTES]	= "wire_bytes",
+	[MODELED_US]	= "modeled_us",
+};
+
+struct result {
+	unsigned long long metric[NUM_METRICS];
+	unsigned long long elapsed_us;
+	bool have_baseline;
+	unsigned long long baseline[NUM_METRICS];
+};
+
+static char workdir[] = "/tmp/flashrom_bench.XXXXXX";
+
+static uint32_t xorshift(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void fill_random(uint8_t *buf, size_t len, uint32_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = xorshift(&seed) >> 24;
+}
+
+/* Replace @percent of the sectors, spread evenly over the chip, with other data. */
+static void rewrite_sectors(uint8_t *buf, unsigned int percent, uint32_t seed)
+{
+	const unsigned int sectors = CHIP_SIZE / SECTOR_SIZE;
+	unsigned int i;
+
+	for (i = 0; i < sectors; i++) {
+		if (i * percent / 100 != (i + 1) * percent / 100)
+			fill_random(buf + i * SECTOR_SIZE, SECTOR_SIZE, seed + i);
+	}
+}
+
+static void make_contents(enum contents c, uint8_t *buf)
+{
+	uint8_t *b;
+
+	switch (c) {
+	case ERASED:
+		memset(buf, 0xff, CHIP_SIZE);
+		break;
+	case IMAGE_A:
+		fill_random(buf, CHIP_SIZE, 1);
+		break;
+	case IMAGE_B:
+		fill_random(buf, CHIP_SIZE, 2);
+		break;
+	case A_1PCT:
+		fill_random(buf, CHIP_SIZE, 1);
+		rewrite_sectors(buf, 1, 3);
+		break;
+	case A_50PCT:
+		fill_random(buf, CHIP_SIZE, 1);
+		rewrite_sectors(buf, 50, 4);
+		break;
+	case A_REGION:
+		b = malloc(CHIP_SIZE);
+		if (!b) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(1);
+		}
+		fill_random(buf, CHIP_SIZE, 1);
+		fill_random(b, CHIP_SIZE, 2);
+		memcpy(buf + REGION_START, b + REGION_START, REGION_END + 1 - REGION_START);
+		free(b);
+		break;
+	}
+}
+
+static int write_file(const char *name, const void *buf, size_t len)
+{
+	FILE *f = fopen(name, "wb");
+
+	if (!f || fwrite(buf, 1, len, f) != len) {
+		fprintf(stderr, "Writing %s failed: %s\n", name, strerror(errno));
+		if (f)
+			fclose(f);
+		return 1;
+	}
+	return fclose(f) ? 1 : 0;
+}
+
+/* Returns 0 if the file @name holds exactly @len bytes of @buf. */
+static int check_file(const char *name, const uint8_t *buf, size_t len, uint8_t *tmp)
+{
+	FILE *f = fopen(name, "rb");
+	size_t got;
+
+	if (!f)
+		return 1;
+	got = fread(tmp, 1, len + 1, f);
+	fclose(f);
+	return got != len || memcmp(tmp, buf, len);
+}
+
+static char *slurp(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	char *buf = NULL;
+	long len;
+
+	if (!f)
+		return NULL;
+	if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 && !fseek(f, 0, SEEK_SET)) {
+		buf = malloc(len + 1);
+		if (buf && fread(buf, 1, len, f) == (size_t)len) {
+			buf[len] = '\0';
+		} else {
+			free(buf);
+			buf = NULL;
+		}
+	}
+	fclose(f);
+	return buf;
+}
+
+static unsigned long long json_number(const char *json, const char *key)
+{
+	const char *p = strstr(json, key);
+
+	return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+/* Pick the numbers we compare out of the statistics written by flashrom --stats. */
+static int parse_stats(const char *name, struct result *res)
+{
+	char *json = slurp(name);
+	const char *p;
+	unsigned long long count, written, read;
+
+	if (!json) {
+		fprintf(stderr, "Reading %s failed.\n", name);
+		return 1;
+	}
+	res->metric[TRANSACTIONS] = json_number(json, "\"transactions\": ");
+	res->metric[MODELED_US] = json_number(json, "\"modeled_us\": ");
+	res->elapsed_us = json_number(json, "\"elapsed_us\": ");
+	for (p = json; (p = strstr(p, "\"opcode\": ")); p++) {
+		p = strstr(p, "\"count\": ");
+		if (!p || sscanf(p, "\"count\": %llu, \"bytes_written\": %llu, \"bytes_read\": %llu",
+				 &count, &written, &read) != 3) {
+			fprintf(stderr, "Can't parse %s.\n", name);
+			free(json);
+			return 1;
+		}
+		res->metric[COMMANDS] += count;
+		res->metric[WIRE_BYTES] += written + read;
+	}
+	free(json);
+	return 0;
+}
+
+/* Run flashrom with the given arguments, its output goes to @log. Returns its exit status. */
+static int run(char *const argv[], const char *log)
+{
+	pid_t pid;
+	int status, fd;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static int run_scenario(const char *flashrom, const struct scenario *sc, struct result *res, uint8_t *buf,
+			uint8_t *tmp)
+{
+	char chip[256], image[256], stats[256], log[256], layout[256], prog[512];
+	char *argv[16];
+	int argc = 0, ret;
+
+	snprintf(chip, sizeof(chip), "%s/%s.chip", workdir, sc->name);
+	snprintf(image, sizeof(image), "%s/%s.image", workdir, sc->name);
+	snprintf(stats, sizeof(stats), "%s/%s.json", workdir, sc->name);
+	snprintf(log, sizeof(log), "%s/%s.log", workdir, sc->name);
+	snprintf(layout, sizeof(layout), "%s/layout", workdir);
+	snprintf(prog, sizeof(prog), PROGRAMMER "%s", chip);
+
+	make_contents(sc->chip, buf);
+	if (write_file(chip, buf, CHIP_SIZE))
+		return 1;
+	if (sc->op[1] != 'r' && sc->op[1] != 'E') {
+		make_contents(sc->image, buf);
+		if (write_file(image, buf, CHIP_SIZE))
+			return 1;
+	}
+
+	argv[argc++] = (char *)flashrom;
+	argv[argc++] = "-p";
+	argv[argc++] = prog;
+	argv[argc++] = "-c";
+	argv[argc++] = CHIPNAME;
+	if (sc->region) {
+		argv[argc++] = "-l";
+		argv[argc++] = layout;
+		argv[argc++] = "-i";
+		argv[argc++] = "region";
+	}
+	argv[argc++] = (char *)sc->op;
+	if (sc->op[1] != 'E')
+		argv[argc++] = image;
+	argv[argc++] = "--stats";
+	argv[argc++] = stats;
+	argv[argc] = NULL;
+
+	ret = run(argv, log);
+	if (ret) {
+		fprintf(stderr, "%s: flashrom failed (%d), see %s.\n", sc->name, ret, log);
+		return 1;
+	}
+	make_contents(sc->expect, buf);
+	if (check_file(chip, buf, CHIP_SIZE, tmp) || (sc->op[1] == 'r' && check_file(image, buf, CHIP_SIZE, tmp))) {
+		fprintf(stderr, "%s: wrong contents after the run, see %s.\n", sc->name, log);
+		return 1;
+	}
+	return parse_stats(stats, res);
+}
+
+static int read_baseline(const char *name, struct result *results)
+{
+	FILE *f = fopen(name, "r");
+	char line[256], scenario[64], metric[64];
+	unsigned long long value;
+	unsigned int i, m;
+
+	if (!f) {
+		fprintf(stderr, "Can't open baseline %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%63s %63s %llu", scenario, metric, &value) != 3)
+			continue;
+		for (i = 0; i < NUM_SCENARIOS; i++) {
+			if (strcmp(scenarios[i].name, scenario))
+				continue;
+			for (m = 0; m < NUM_METRICS; m++) {
+				if (!strcmp(metric_names[m], metric)) {
+					results[i].baseline[m] = value;
+					results[i].have_baseline = true;
+				}
+			}
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int write_baseline(const char *name, const struct result *results)
+{
+	FILE *f = fopen(name, "w");
+	unsigned int i, m;
+
+	if (!f) {
+		fprintf(stderr, "Can't write baseline %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	fprintf(f, "# flashrom_bench baseline: scenario metric value\n"
+		   "# Regenerate with \"make -C util/flashrom_bench update\" after intended changes.\n");
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		for (m = 0; m < NUM_METRICS; m++)
+			fprintf(f, "%s %s %llu\n", scenarios[i].name, metric_names[m], results[i].metric[m]);
+	}
+	return fclose(f) ? 1 : 0;
+}
+
+/* Print the comparison with the baseline. Returns the number of regressions. */
+static int compare(const struct result *results, unsigned int tolerance)
+{
+	unsigned int i, m;
+	int regressions = 0;
+
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		const struct result *r = &results[i];
+
+		if (!r->have_baseline) {
+			printf("%s: no baseline.\n", scenarios[i].name);
+			continue;
+		}
+		for (m = 0; m < NUM_METRICS; m++) {
+			const unsigned long long base = r->baseline[m], cur = r->metric[m];
+
+			if (cur == base)
+				continue;
+			if (cur * 100 > base * (100 + tolerance)) {
+				printf("REGRESSION: %s %s %llu -> %llu\n", scenarios[i].name, metric_names[m], base,
+				       cur);
+				regressions++;
+			} else {
+				printf("%s: %s %s %llu -> %llu\n", cur < base ? "Improved" : "Within tolerance",
+				       scenarios[i].name, metric_names[m], base, cur);
+			}
+		}
+	}
+	return regressions;
+}
+
+static void cleanup(void)
+{
+	char name[256];
+	unsigned int i;
+	const char *const suffixes[] = { "chip", "image", "json", "log" };
+	unsigned int j;
+
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		for (j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+			snprintf(name, sizeof(name), "%s/%s.%s", workdir, scenarios[i].name, suffixes[j]);
+			unlink(name);
+		}
+	}
+	snprintf(name, sizeof(name), "%s/layout", workdir);
+	unlink(name);
+	rmdir(workdir);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *flashrom = "../../flashrom", *baseline = "baseline";
+	struct result results[NUM_SCENARIOS] = { { { 0 } } };
+	unsigned int tolerance = 0, i;
+	bool update = false, keep = false;
+	uint8_t *buf, *tmp;
+	char layout[256];
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "f:b:t:uk")) != -1) {
+		switch (opt) {
+		case 'f':
+			flashrom = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tolerance = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			update = true;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f flashrom] [-b baseline] [-t tolerance] [-u] [-k]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	buf = malloc(CHIP_SIZE);
+	tmp = malloc(CHIP_SIZE + 1);
+	if (!buf || !tmp) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+	if (!mkdtemp(workdir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(layout, sizeof(layout), "%s/layout", workdir);
+	snprintf((char *)buf, CHIP_SIZE, "00000000:%08x low\n%08x:%08x region\n%08x:%08x high\n",
+		 REGION_START - 1, REGION_START, REGION_END, REGION_END + 1, CHIP_SIZE - 1);
+	if (write_file(layout, buf, strlen((char *)buf))) {
+		ret = 1;
+		goto out;
+	}
+
+	printf("%-14s %12s %12s %12s %12s %10s\n", "scenario", "transactions", "commands", "wire bytes",
+	       "modeled s", "elapsed s");
+	for (i = 0; i < NUM_SCENARIOS; i++) {
+		struct result *r = &results[i];
+
+		if (run_scenario(flashrom, &scenarios[i], r, buf, tmp)) {
+			ret = 1;
+			keep = true;
+			goto out;
+		}
+		printf("%-14s %12llu %12llu %12llu %12.3f %10.3f\n", scenarios[i].name, r->metric[TRANSACTIONS],
+		       r->metric[COMMANDS], r->metric[WIRE_BYTES], r->metric[MODELED_US] / 1e6,
+		       r->elapsed_us / 1e6);
+		fflush(stdout);
+	}
+
+	if (update) {
+		ret = write_baseline(baseline, results);
+		if (!ret)
+			printf("Wrote baseline %s.\n", baseline);
+	} else if (read_baseline(baseline, results)) {
+		ret = 1;
+	} else if (compare(results, tolerance)) {
+		printf("Performance regressions found.\n");
+		ret = 1;
+	} else {
+		printf("No regressions against baseline %s.\n", baseline);
+	}
+
+out:
+	if (keep)
+		printf("Files are kept in %s.\n", workdir);
+	else
+		cleanup();
+	free(tmp);
+	free(buf);
+	return ret;
+}
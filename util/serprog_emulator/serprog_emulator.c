@@ -0,0 +1,507 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Reference serprog device for testing the serprog driver without hardware.
+ *
+ * It listens on a TCP port on localhost and emulates an SPI-only serprog programmer with a Winbond W25Q64.V
+ * attached. The flash contents are backed by an image file which is (re)loaded for every connection and
+ * written back when the connection is closed. Program and erase operations keep the WIP bit set for a few
+ * status register reads so that both host-side and on-device polling are exercised.
+ *
+ * Usage: serprog_emulator <port> <image> [legacy]
+ *        flashrom -p serprog:ip=localhost:<port> ...
+ * With "legacy", the S_CMD_O_SPIOP_STREAM and S_CMD_O_SPIOP_PROGRAM extensions are not advertised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "serprog.h"
+
+#define FLASH_SIZE	(8 * 1024 * 1024)
+#define PAGE_SIZE	256
+#define MANUF_ID	0xEF
+#define MODEL_ID	0x4017
+/* Limits reported to the host. Reads are kept small like on a microcontroller with little RAM. */
+#define MAX_WRITE_N	(PAGE_SIZE + 5)
+#define MAX_READ_N	64
+/* Number of status register reads that return WIP after program and erase operations. */
+#define PROGRAM_POLLS	2
+#define ERASE_POLLS	4
+
+static const uint8_t supported_cmds[] = {
+	S_CMD_NOP, S_CMD_Q_IFACE, S_CMD_Q_CMDMAP, S_CMD_Q_PGMNAME, S_CMD_Q_SERBUF, S_CMD_Q_BUSTYPE,
+	S_CMD_Q_WRNMAXLEN, S_CMD_SYNCNOP, S_CMD_Q_RDNMAXLEN, S_CMD_S_BUSTYPE, S_CMD_O_SPIOP,
+	S_CMD_S_SPI_FREQ, S_CMD_S_PIN_STATE, S_CMD_O_SPIOP_STREAM, S_CMD_O_SPIOP_PROGRAM,
+};
+
+static bool legacy;
+static uint8_t flash[FLASH_SIZE];
+static bool wel;
+static unsigned int busy_polls;
+
+/* State of the current SPI transaction (chip select asserted). */
+static struct {
+	uint8_t resp[4];
+	unsigned int resp_len;
+	bool reading;
+	uint32_t addr;
+	unsigned int pos;
+} cs;
+
+static uint32_t get_addr(const uint8_t *w)
+{
+	return ((w[1] << 16) | (w[2] << 8) | w[3]) % FLASH_SIZE;
+}
+
+static void erase(uint32_t addr, uint32_t size)
+{
+	if (!wel)
+		return;
+	addr &= ~(size - 1);
+	memset(flash + addr, 0xff, size);
+	wel = false;
+	busy_polls = ERASE_POLLS;
+}
+
+/* Start an SPI transaction by sending the @wlen bytes at @w to the chip. */
+static void spi_select(const uint8_t *w, unsigned int wlen)
+{
+	unsigned int i;
+
+	memset(&cs, 0, sizeof(cs));
+	if (!wlen)
+		return;
+	switch (w[0]) {
+	case 0x9f: /* RDID */
+		cs.resp[0] = MANUF_ID;
+		cs.resp[1] = MODEL_ID >> 8;
+		cs.resp[2] = MODEL_ID & 0xff;
+		cs.resp_len = 3;
+		break;
+	case 0x90: /* REMS */
+		cs.resp[0] = MANUF_ID;
+		cs.resp[1] = (MODEL_ID & 0xff) - 1;
+		cs.resp_len = 2;
+		break;
+	case 0xab: /* RES */
+		cs.resp[0] = (MODEL_ID & 0xff) - 1;
+		cs.resp_len = 1;
+		break;
+	case 0x05: /* RDSR */
+		cs.resp[0] = (busy_polls ? 0x01 : 0x00) | (wel ? 0x02 : 0x00);
+		cs.resp_len = 1;
+		if (busy_polls)
+			busy_polls--;
+		break;
+	case 0x35: /* RDSR2 */
+		cs.resp_len = 1;
+		break;
+	case 0x06: /* WREN */
+		wel = true;
+		break;
+	case 0x04: /* WRDI */
+	case 0x01: /* WRSR, the protection bits are not emulated */
+		wel = false;
+		break;
+	case 0x03: /* READ */
+		cs.reading = wlen >= 4;
+		cs.addr = get_addr(w);
+		break;
+	case 0x0b: /* FAST READ */
+		cs.reading = wlen >= 5;
+		cs.addr = get_addr(w);
+		break;
+	case 0x02: /* PP */
+		if (!wel || wlen < 5)
+			break;
+		for (i = 0; i < wlen - 4; i++) {
+			uint32_t addr = get_addr(w);
+			addr = (addr & ~(PAGE_SIZE - 1)) | ((addr + i) & (PAGE_SIZE - 1));
+			flash[addr] &= w[4 + i];
+		}
+		wel = false;
+		busy_polls = PROGRAM_POLLS;
+		break;
+	case 0x20: /* SE */
+		if (wlen >= 4)
+			erase(get_addr(w), 4 * 1024);
+		break;
+	case 0x52: /* BE 32K */
+		if (wlen >= 4)
+			erase(get_addr(w), 32 * 1024);
+		break;
+	case 0xd8: /* BE 64K */
+		if (wlen >= 4)
+			erase(get_addr(w), 64 * 1024);
+		break;
+	case 0x60: /* CE */
+	case 0xc7:
+		erase(0, FLASH_SIZE);
+		break;
+	}
+}
+
+/* Clock @len bytes out of the chip within the current transaction. */
+static void spi_clock_out(uint8_t *r, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++, cs.pos++) {
+		if (cs.reading)
+			r[i] = flash[(cs.addr + cs.pos) % FLASH_SIZE];
+		else if (cs.resp_len)
+			r[i] = cs.resp[cs.pos % cs.resp_len];
+		else
+			r[i] = 0xff;
+	}
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static uint32_t get_le(const uint8_t *buf, unsigned int bytes)
+{
+	uint32_t val = 0;
+
+	while (bytes--)
+		val = (val << 8) | buf[bytes];
+	return val;
+}
+
+static int send_ack(int fd, const void *data, size_t len)
+{
+	const uint8_t ack = S_ACK;
+
+	if (write_full(fd, &ack, 1))
+		return 1;
+	return len ? write_full(fd, data, len) : 0;
+}
+
+static int send_nak(int fd)
+{
+	const uint8_t nak = S_NAK;
+
+	return write_full(fd, &nak, 1);
+}
+
+static int handle_spiop(int fd)
+{
+	uint8_t hdr[6], w[MAX_WRITE_N], *r;
+	uint32_t slen, rlen;
+	int ret;
+
+	if (read_full(fd, hdr, sizeof(hdr)))
+		return 1;
+	slen = get_le(hdr, 3);
+	rlen = get_le(hdr + 3, 3);
+	if (slen > MAX_WRITE_N) {
+		/* The parameters can't be skipped reliably. Drop the connection. */
+		fprintf(stderr, "SPIOP slen %u too large\n", slen);
+		return 1;
+	}
+	if (read_full(fd, w, slen))
+		return 1;
+	if (rlen > MAX_READ_N)
+		return send_nak(fd);
+
+	r = malloc(rlen + 1);
+	if (!r)
+		return 1;
+	spi_select(w, slen);
+	spi_clock_out(r, rlen);
+	ret = send_ack(fd, r, rlen);
+	free(r);
+	return ret;
+}
+
+static int handle_spiop_stream(int fd)
+{
+	uint8_t hdr[10], w[MAX_WRITE_N], r[MAX_READ_N];
+	uint32_t slen, rlen, chunk;
+
+	if (read_full(fd, hdr, sizeof(hdr)))
+		return 1;
+	slen = get_le(hdr, 3);
+	rlen = get_le(hdr + 3, 4);
+	chunk = get_le(hdr + 7, 3);
+	if (slen > MAX_WRITE_N) {
+		fprintf(stderr, "SPIOP_STREAM slen %u too large\n", slen);
+		return 1;
+	}
+	if (read_full(fd, w, slen))
+		return 1;
+	if (!chunk || chunk > MAX_READ_N)
+		return send_nak(fd);
+	if (send_ack(fd, NULL, 0))
+		return 1;
+
+	spi_select(w, slen);
+	while (rlen) {
+		const uint32_t len = rlen < chunk ? rlen : chunk;
+		uint8_t credit;
+
+		if (read_full(fd, &credit, 1))
+			return 1;
+		if (credit != S_ACK)
+			break;
+		spi_clock_out(r, len);
+		if (write_full(fd, r, len))
+			return 1;
+		rlen -= len;
+	}
+	return 0;
+}
+
+static int handle_spiop_program(int fd)
+{
+	static const uint8_t wren = 0x06, rdsr = 0x05;
+	uint8_t hdr[7], w[MAX_WRITE_N], status;
+	uint32_t slen, timeout, polls = 0;
+
+	if (read_full(fd, hdr, sizeof(hdr)))
+		return 1;
+	slen = get_le(hdr, 3);
+	timeout = get_le(hdr + 3, 4);
+	if (slen > MAX_WRITE_N) {
+		fprintf(stderr, "SPIOP_PROGRAM slen %u too large\n", slen);
+		return 1;
+	}
+	if (read_full(fd, w, slen))
+		return 1;
+
+	spi_select(&wren, 1);
+	spi_select(w, slen);
+	/* Every poll is accounted as 10 us. */
+	do {
+		spi_select(&rdsr, 1);
+		spi_clock_out(&status, 1);
+	} while ((status & 0x01) && ++polls * 10 < timeout);
+
+	if (status & 0x01)
+		return send_nak(fd);
+	return send_ack(fd, &status, 1);
+}
+
+/* Serve one connection. Returns when the host disconnects. */
+static void serve(int fd)
+{
+	uint8_t cmd, buf[32];
+
+	while (!read_full(fd, &cmd, 1)) {
+		int ret = 0;
+
+		switch (cmd) {
+		case S_CMD_NOP:
+			ret = send_ack(fd, NULL, 0);
+			break;
+		case S_CMD_Q_IFACE:
+			buf[0] = 1;
+			buf[1] = 0;
+			ret = send_ack(fd, buf, 2);
+			break;
+		case S_CMD_Q_CMDMAP: {
+			unsigned int i;
+			memset(buf, 0, 32);
+			for (i = 0; i < sizeof(supported_cmds); i++) {
+				if (legacy && supported_cmds[i] >= S_CMD_O_SPIOP_STREAM)
+					continue;
+				buf[supported_cmds[i] / 8] |= 1 << (supported_cmds[i] % 8);
+			}
+			ret = send_ack(fd, buf, 32);
+			break;
+		}
+		case S_CMD_Q_PGMNAME:
+			memset(buf, 0, 16);
+			strcpy((char *)buf, "serprog-emu");
+			ret = send_ack(fd, buf, 16);
+			break;
+		case S_CMD_Q_SERBUF:
+			buf[0] = buf[1] = 0xff;
+			ret = send_ack(fd, buf, 2);
+			break;
+		case S_CMD_Q_BUSTYPE:
+			buf[0] = 1 << 3; /* SPI */
+			ret = send_ack(fd, buf, 1);
+			break;
+		case S_CMD_Q_WRNMAXLEN:
+			buf[0] = (MAX_WRITE_N >> 0) & 0xff;
+			buf[1] = (MAX_WRITE_N >> 8) & 0xff;
+			buf[2] = (MAX_WRITE_N >> 16) & 0xff;
+			ret = send_ack(fd, buf, 3);
+			break;
+		case S_CMD_Q_RDNMAXLEN:
+			buf[0] = (MAX_READ_N >> 0) & 0xff;
+			buf[1] = (MAX_READ_N >> 8) & 0xff;
+			buf[2] = (MAX_READ_N >> 16) & 0xff;
+			ret = send_ack(fd, buf, 3);
+			break;
+		case S_CMD_SYNCNOP:
+			buf[0] = S_NAK;
+			buf[1] = S_ACK;
+			ret = write_full(fd, buf, 2);
+			break;
+		case S_CMD_S_BUSTYPE:
+			ret = read_full(fd, buf, 1);
+			if (!ret)
+				ret = (buf[0] & (1 << 3)) ? send_ack(fd, NULL, 0) : send_nak(fd);
+			break;
+		case S_CMD_S_SPI_FREQ:
+			ret = read_full(fd, buf, 4);
+			if (!ret)
+				ret = send_ack(fd, buf, 4);
+			break;
+		case S_CMD_S_PIN_STATE:
+			ret = read_full(fd, buf, 1);
+			if (!ret)
+				ret = send_ack(fd, NULL, 0);
+			break;
+		case S_CMD_O_SPIOP:
+			ret = handle_spiop(fd);
+			break;
+		case S_CMD_O_SPIOP_STREAM:
+			ret = handle_spiop_stream(fd);
+			break;
+		case S_CMD_O_SPIOP_PROGRAM:
+			ret = handle_spiop_program(fd);
+			break;
+		default:
+			ret = send_nak(fd);
+			break;
+		}
+		if (ret)
+			break;
+	}
+}
+
+static int load_image(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+
+	memset(flash, 0xff, sizeof(flash));
+	if (!f)
+		return errno == ENOENT ? 0 : 1;
+	if (fread(flash, 1, sizeof(flash), f) == 0 && ferror(f)) {
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int save_image(const char *name)
+{
+	FILE *f = fopen(name, "wb");
+
+	if (!f)
+		return 1;
+	if (fwrite(flash, 1, sizeof(flash), f) != sizeof(flash)) {
+		fclose(f);
+		return 1;
+	}
+	return fclose(f) ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	int sock, flag = 1;
+
+	if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "legacy"))) {
+		fprintf(stderr, "Usage: %s <port> <image> [legacy]\n", argv[0]);
+		return 1;
+	}
+	legacy = argc == 4;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(atoi(argv[1]));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 1)) {
+		perror("bind/listen");
+		close(sock);
+		return 1;
+	}
+
+	while (1) {
+		int fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+		if (load_image(argv[2])) {
+			fprintf(stderr, "Cannot read image %s\n", argv[2]);
+			close(fd);
+			continue;
+		}
+		wel = false;
+		busy_polls = 0;
+		serve(fd);
+		close(fd);
+		if (save_image(argv[2]))
+			fprintf(stderr, "Cannot write image %s\n", argv[2]);
+	}
+	close(sock);
+	return 1;
+}